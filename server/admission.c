@@ -0,0 +1,72 @@
+#include "admission.h"
+#include "aesdsocket.h"
+#include "metrics.h"
+#include "recv_buffer.h"
+
+static size_t connections = 0;
+static size_t pending_appends = 0;
+static size_t pending_bytes = 0;
+/**
+ * Set while acceptors are paused, so every pause is counted once
+ */
+static bool paused = false;
+
+static size_t load(const size_t *value){
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+bool admission_open(void){
+    const admission_limits_t *limits = &server_config.admission;
+
+    if(limits->max_connections > 0 && load(&connections) >= limits->max_connections){
+        return false;
+    }
+    if(limits->max_pending_appends > 0 && load(&pending_appends) >= limits->max_pending_appends){
+        return false;
+    }
+    if(limits->max_inflight_bytes > 0 && recv_buffer_total_pending() + load(&pending_bytes) >= limits->max_inflight_bytes){
+        return false;
+    }
+    return true;
+}
+
+bool admission_paused(void){
+    if(server_config.admission.policy != OVERLOAD_PAUSE || admission_open()){
+        __atomic_store_n(&paused, false, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    if(!__atomic_exchange_n(&paused, true, __ATOMIC_RELAXED)){
+        log_msg(LOG_INFO, "Overloaded, accepting paused");
+        metrics_add(METRIC_ACCEPT_PAUSES, 1);
+    }
+    return true;
+}
+
+bool admission_admit(int client_fd){
+    if(server_config.admission.policy == OVERLOAD_BUSY && !admission_open()){
+        // best effort, a client that does not read the answer only sees the close
+        send(client_fd, ADMISSION_BUSY_RESPONSE, sizeof(ADMISSION_BUSY_RESPONSE) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(client_fd);
+        metrics_add(METRIC_CONNECTIONS_SHED, 1);
+        log_msg(LOG_DEBUG, "Overloaded, connection shed");
+        return false;
+    }
+
+    __atomic_add_fetch(&connections, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+void admission_release(void){
+    __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+}
+
+void admission_append_begin(size_t len){
+    __atomic_add_fetch(&pending_appends, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pending_bytes, len, __ATOMIC_RELAXED);
+}
+
+void admission_append_end(size_t len){
+    __atomic_sub_fetch(&pending_appends, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&pending_bytes, len, __ATOMIC_RELAXED);
+}
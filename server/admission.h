@@ -0,0 +1,61 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ADMISSION_BUSY_RESPONSE     "AESDBUSY\n"
+/**
+ * How often a paused acceptor checks whether the load went down again
+ */
+#define ADMISSION_RETRY_MS          10
+
+typedef enum overload_policy{
+    /**
+     * Stop accepting, new clients wait in the listen backlog
+     */
+    OVERLOAD_PAUSE,
+    /**
+     * Accept, answer ADMISSION_BUSY_RESPONSE and close right away
+     */
+    OVERLOAD_BUSY
+} overload_policy_t;
+
+/**
+ * Load limits, 0 leaves a limit off. In-flight bytes are received bytes
+ * that were not appended yet, pending appends are packets waiting for or
+ * taking part in a commit.
+ */
+typedef struct admission_limits{
+    size_t max_connections;
+    size_t max_inflight_bytes;
+    size_t max_pending_appends;
+    overload_policy_t policy;
+} admission_limits_t;
+
+/**
+ * @return true while every limit has room for another connection
+ */
+bool admission_open(void);
+
+/**
+ * Checked by acceptors before accepting. Counts the start of a pause.
+ * @return true when the pause policy applies and a limit is reached
+ */
+bool admission_paused(void);
+
+/**
+ * Takes a freshly accepted client into account. Under the busy policy an
+ * overloaded server answers it and closes client_fd instead.
+ * @return true when the client was admitted, admission_release() follows its close
+ */
+bool admission_admit(int client_fd);
+void admission_release(void);
+
+/**
+ * Brackets an append of len bytes, from queueing until it was committed.
+ */
+void admission_append_begin(size_t len);
+void admission_append_end(size_t len);
+
+#endif // ADMISSION_H
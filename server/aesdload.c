@@ -0,0 +1,386 @@
+/**
+ * Load generator for aesdsocket. Every thread drives one connection at a
+ * time in a closed loop: send a packet, wait for the complete readback,
+ * repeat until the duration is over. Results are printed as "name value"
+ * lines, the format of the server's metrics report.
+ *
+ * Without -r every packet uses a connection of its own and the readback
+ * ends when the server closes it. With -r the connection is reused for that
+ * many packets, which needs the server running with -k. Reused connections
+ * send cursor commands, so the header tells how much readback follows.
+ */
+#include "aesdsocket.h"
+#include "metrics.h"
+#include <netinet/tcp.h>
+
+#define LOAD_OPTIONS            "h:p:c:d:s:r:S:"
+#define LOAD_DEFAULT_HOST       "127.0.0.1"
+#define LOAD_RECV_LEN           (64 * 1024)
+
+typedef struct load_config{
+    const char *host;
+    const char *port;
+    size_t connections;
+    int duration_sec;
+    size_t min_size;
+    size_t max_size;
+    /**
+     * Packets sent over one connection, 0 closes it after every packet
+     */
+    size_t reuse;
+    /**
+     * Percentage of packets replaced by a seekto command
+     */
+    unsigned int seekto_percent;
+} load_config_t;
+
+typedef struct load_thread{
+    pthread_t thread;
+    unsigned int seed;
+    metrics_histogram_t latency;
+    uint64_t packets;
+    uint64_t seektos;
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    uint64_t connections;
+    uint64_t errors;
+} load_thread_t;
+
+static load_config_t config = {
+    .host = LOAD_DEFAULT_HOST,
+    .port = PORT,
+    .connections = 8,
+    .duration_sec = 10,
+    .min_size = 64,
+    .max_size = 64
+};
+static struct addrinfo *server_addr = NULL;
+static uint64_t deadline;
+
+static int load_connect(void){
+    int fd = socket(server_addr->ai_family, server_addr->ai_socktype, server_addr->ai_protocol);
+    if(fd == -1){
+        return -1;
+    }
+
+    if(connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) == -1){
+        close(fd);
+        return -1;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    return fd;
+}
+
+static bool send_all(int fd, const char *data, size_t len){
+    while(len > 0){
+        ssize_t res = send(fd, data, len, MSG_NOSIGNAL);
+        if(res == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return false;
+        }
+        data += res;
+        len -= res;
+    }
+    return true;
+}
+
+/**
+ * Builds the next packet into buffer, a random payload of the configured
+ * size or a seekto command.
+ * @return packet length
+ */
+static size_t make_packet(load_thread_t *thread, char *buffer, off_t cursor, bool *seekto){
+    size_t size = config.min_size;
+    size_t len = 0;
+
+    *seekto = config.seekto_percent > 0 && (unsigned int)(rand_r(&thread->seed) % 100) < config.seekto_percent;
+    if(*seekto){
+        return snprintf(buffer, config.max_size + AESD_CURSOR_HEADER_LEN, "%s:%d,%d\n", AESD_SEEKTO_KEYWORD, rand_r(&thread->seed) % 10, 0);
+    }
+
+    if(config.max_size > config.min_size){
+        size += rand_r(&thread->seed) % (config.max_size - config.min_size + 1);
+    }
+
+    if(config.reuse > 0){
+        len = snprintf(buffer, AESD_CURSOR_HEADER_LEN, AESD_CURSOR_KEYWORD "%lld:", (long long) cursor);
+    }
+
+    for(size_t i = 0; i + 1 < size; i++){
+        buffer[len++] = 'a' + rand_r(&thread->seed) % 26;
+    }
+    buffer[len++] = '\n';
+    return len;
+}
+
+/**
+ * Reads a readback that ends when the server closes the connection.
+ */
+static bool read_to_end(load_thread_t *thread, int fd, char *buffer){
+    while(true){
+        ssize_t res = recv(fd, buffer, LOAD_RECV_LEN, 0);
+        if(res == 0){
+            return true;
+        }
+        if(res == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return false;
+        }
+        thread->bytes_in += res;
+    }
+}
+
+/**
+ * Reads the "AESDCURSOR:<new>\n" header and the readback it announces.
+ */
+static bool read_cursor_reply(load_thread_t *thread, int fd, char *buffer, off_t *cursor){
+    char header[AESD_CURSOR_HEADER_LEN];
+    size_t header_len = 0;
+    off_t new_cursor;
+    off_t remaining;
+    char *end;
+
+    // byte by byte so nothing of the readback is consumed with the header
+    while(header_len == 0 || header[header_len - 1] != '\n'){
+        ssize_t res = recv(fd, header + header_len, 1, 0);
+        if(res <= 0){
+            if(res == -1 && errno == EINTR){
+                continue;
+            }
+            return false;
+        }
+        if(++header_len == sizeof(header)){
+            return false;
+        }
+    }
+    thread->bytes_in += header_len;
+
+    header[header_len] = '\0';
+    if(strncmp(header, AESD_CURSOR_KEYWORD, AESD_CURSOR_KEYWORD_LEN) != 0){
+        return false;
+    }
+    new_cursor = strtoll(header + AESD_CURSOR_KEYWORD_LEN, &end, 10);
+    if(*end != '\n'){
+        return false;
+    }
+
+    remaining = new_cursor - (*cursor < new_cursor ? *cursor : new_cursor);
+    while(remaining > 0){
+        size_t to_read = remaining < LOAD_RECV_LEN ? (size_t) remaining : LOAD_RECV_LEN;
+        ssize_t res = recv(fd, buffer, to_read, 0);
+        if(res <= 0){
+            if(res == -1 && errno == EINTR){
+                continue;
+            }
+            return false;
+        }
+        remaining -= res;
+        thread->bytes_in += res;
+    }
+
+    *cursor = new_cursor;
+    return true;
+}
+
+static void *load_thread_main(void *arg){
+    load_thread_t *thread = (load_thread_t *) arg;
+    char *packet = NULL;
+    char *buffer = NULL;
+    int fd = -1;
+    size_t sent_on_connection = 0;
+    off_t cursor = 0;
+
+    packet = (char *) malloc(config.max_size + AESD_CURSOR_HEADER_LEN);
+    buffer = (char *) malloc(LOAD_RECV_LEN);
+    if(packet == NULL || buffer == NULL){
+        fprintf(stderr, "Error allocating buffers\n");
+        goto load_thread_exit;
+    }
+
+    while(metrics_now() < deadline){
+        bool seekto;
+        bool success;
+        size_t len;
+        uint64_t start;
+
+        if(fd == -1){
+            fd = load_connect();
+            if(fd == -1){
+                thread->errors++;
+                continue;
+            }
+            thread->connections++;
+            sent_on_connection = 0;
+            cursor = 0;
+        }
+
+        len = make_packet(thread, packet, cursor, &seekto);
+        start = metrics_now();
+
+        success = send_all(fd, packet, len);
+        if(success && config.reuse == 0){
+            shutdown(fd, SHUT_WR);
+            success = read_to_end(thread, fd, buffer);
+        } else if(success){
+            success = read_cursor_reply(thread, fd, buffer, &cursor);
+        }
+
+        if(success){
+            metrics_histogram_add(&thread->latency, metrics_now() - start);
+            thread->packets++;
+            thread->seektos += seekto;
+            thread->bytes_out += len;
+        } else {
+            thread->errors++;
+        }
+
+        if(!success || config.reuse == 0 || ++sent_on_connection == config.reuse){
+            close(fd);
+            fd = -1;
+        }
+    }
+
+load_thread_exit:
+    if(fd != -1){
+        close(fd);
+    }
+    free(packet);
+    free(buffer);
+    return NULL;
+}
+
+static bool parse_size(const char *arg){
+    char *end;
+
+    config.min_size = strtoul(arg, &end, 10);
+    config.max_size = *end == ':' ? strtoul(end + 1, &end, 10) : config.min_size;
+    return *end == '\0' && config.min_size > 0 && config.max_size >= config.min_size;
+}
+
+static void usage(const char *name){
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections] [-d duration_sec] [-s size|min:max] "
+        "[-r packets_per_connection] [-S seekto_percent]\n", name);
+}
+
+int main(int argc, char **argv){
+    struct addrinfo hints = {0};
+    metrics_histogram_t *latency = NULL;
+    load_thread_t *threads = NULL;
+    load_thread_t total = {0};
+    uint64_t start;
+    double elapsed;
+    int opt;
+    int res;
+
+    while((opt = getopt(argc, argv, LOAD_OPTIONS)) != -1){
+        switch(opt){
+        case 'h':
+            config.host = optarg;
+            break;
+        case 'p':
+            config.port = optarg;
+            break;
+        case 'c':
+            config.connections = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            config.duration_sec = atoi(optarg);
+            break;
+        case 's':
+            if(!parse_size(optarg)){
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'r':
+            config.reuse = strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            config.seekto_percent = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if(config.connections == 0 || config.duration_sec <= 0 || config.seekto_percent > 100){
+        usage(argv[0]);
+        return 1;
+    }
+    if(config.reuse > 0 && config.seekto_percent > 0){
+        // a seekto readback carries no length, only closing the connection ends it
+        fprintf(stderr, "Seekto commands need connections closed after every packet\n");
+        return 1;
+    }
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    res = getaddrinfo(config.host, config.port, &hints, &server_addr);
+    if(res != 0){
+        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(res));
+        return 1;
+    }
+
+    threads = (load_thread_t *) calloc(config.connections, sizeof(*threads));
+    latency = (metrics_histogram_t *) calloc(1, sizeof(*latency));
+    if(threads == NULL || latency == NULL){
+        fprintf(stderr, "Error allocating thread data\n");
+        return 1;
+    }
+
+    start = metrics_now();
+    deadline = start + (uint64_t) config.duration_sec * 1000000000ULL;
+
+    for(size_t i = 0; i < config.connections; i++){
+        threads[i].seed = (unsigned int)(start + i);
+        res = pthread_create(&threads[i].thread, NULL, load_thread_main, &threads[i]);
+        if(res != 0){
+            fprintf(stderr, "pthread_create error: %d\n", res);
+            config.connections = i;
+            break;
+        }
+    }
+
+    for(size_t i = 0; i < config.connections; i++){
+        pthread_join(threads[i].thread, NULL);
+        metrics_histogram_merge(latency, &threads[i].latency);
+        total.packets += threads[i].packets;
+        total.seektos += threads[i].seektos;
+        total.bytes_out += threads[i].bytes_out;
+        total.bytes_in += threads[i].bytes_in;
+        total.connections += threads[i].connections;
+        total.errors += threads[i].errors;
+    }
+
+    elapsed = (metrics_now() - start) / 1e9;
+
+    printf("threads %zu\n", config.connections);
+    printf("duration_sec %.3f\n", elapsed);
+    printf("min_size %zu\n", config.min_size);
+    printf("max_size %zu\n", config.max_size);
+    printf("reuse %zu\n", config.reuse);
+    printf("seekto_percent %u\n", config.seekto_percent);
+    printf("connections %llu\n", (unsigned long long) total.connections);
+    printf("packets %llu\n", (unsigned long long) total.packets);
+    printf("seektos %llu\n", (unsigned long long) total.seektos);
+    printf("errors %llu\n", (unsigned long long) total.errors);
+    printf("bytes_out %llu\n", (unsigned long long) total.bytes_out);
+    printf("bytes_in %llu\n", (unsigned long long) total.bytes_in);
+    printf("packets_per_sec %.1f\n", total.packets / elapsed);
+    printf("bytes_in_per_sec %.1f\n", total.bytes_in / elapsed);
+    printf("latency_ns_p50 %llu\n", (unsigned long long) metrics_histogram_percentile(latency, 0.5));
+    printf("latency_ns_p99 %llu\n", (unsigned long long) metrics_histogram_percentile(latency, 0.99));
+    printf("latency_ns_p999 %llu\n", (unsigned long long) metrics_histogram_percentile(latency, 0.999));
+    printf("latency_ns_max %llu\n", (unsigned long long) latency->max);
+
+    freeaddrinfo(server_addr);
+    free(latency);
+    free(threads);
+    return total.errors > 0 && total.packets == 0 ? 1 : 0;
+}
@@ -1,18 +1,25 @@
 #! /bin/sh
 
+HANDOFF=/var/run/aesdsocket.handoff
+
 case "$1" in
   start)
     echo "Starting aesdsocket"
-    start-stop-daemon -S -n aesdsocket -a /usr/bin/aesdsocket -- -d
+    start-stop-daemon -S -n aesdsocket -a /usr/bin/aesdsocket -- -d -H "$HANDOFF"
     ;;
   stop)
     echo "Stopping aesdsocket"
     start-stop-daemon -K -n aesdsocket
     ;;
+  upgrade)
+    # the running server hands its listeners and storage over and exits once drained
+    echo "Upgrading aesdsocket"
+    /usr/bin/aesdsocket -d -H "$HANDOFF"
+    ;;
   *)
-    echo "Usage: $0 {start|stop}"
+    echo "Usage: $0 {start|stop|upgrade}"
     exit 1
     ;;
 esac
 
-exit 0
\ No newline at end of file
+exit 0
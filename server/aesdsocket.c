@@ -1,165 +1,373 @@
 #include "aesdsocket.h"
+#include "data_log.h"
+#include "data_store.h"
+#include "event_loop.h"
+#include "handoff.h"
+#include "listener.h"
+#include "metrics.h"
+#include "object_cache.h"
+#include "recv_buffer.h"
+#include "storage.h"
+#include "ticker.h"
+#include "uring_loop.h"
+#include "worker_pool.h"
 
 bool is_active = true;
 int sockfd = -1;
-
-static void remove_data_file(void);
-static void *get_in_addr(struct sockaddr *sa);
-static void signal_handler(int sig);
-#if USE_AESD_CHAR_DEVICE == 0
-static void timer_expired_handler(union sigval sv);
+server_config_t server_config = {
+    .mode = SERVER_MODE_THREAD,
+    .shards = 1,
+    .backlog = LISTEN_BACKLOG_DEFAULT,
+    .tick_interval_sec = TICKER_INTERVAL_DEFAULT_SEC,
+#if USE_AESD_CHAR_DEVICE == 1
+    .storage = &storage_chardev,
+#else
+    .storage = &storage_file,
 #endif
+    .port = PORT,
+    .mirror_chunks = DATA_LOG_MIRROR_DEFAULT_CHUNKS
+};
+/**
+ * Listeners 1 to shards - 1, the first one is sockfd served by the main thread
+ */
+static listener_shard_t shards[LISTENER_MAX_SHARDS];
+static object_cache_t thread_data_cache = OBJECT_CACHE_INITIALIZER("thread_data", sizeof(client_thread_data_t), OBJECT_CACHE_DEPOT_DEFAULT);
+static object_cache_t thread_instance_cache = OBJECT_CACHE_INITIALIZER("thread_instance", sizeof(thread_instance_t), OBJECT_CACHE_DEPOT_DEFAULT);
+/**
+ * Connection threads that finished, joined by the listener in thread mode
+ */
+static completion_queue_t thread_completions = { .event_fd = -1 };
+static size_t threads_running = 0;
+
+static bool shards_start(pthread_mutex_t *file_mutex);
+static void shards_stop(void);
+static void listeners_adopt(const int *fds, size_t count);
+static void handoff_release(void);
+static void thread_data_release(void *thread_data);
+static void threads_reap(void);
+static const char *server_mode_name(server_mode_t mode);
+static bool parse_limit(const char *arg, size_t *value);
+static void print_usage(const char *name);
+static void signal_handler(int sig);
 
 void* connection_handler(void *current_thread_data){
-    int res;
-    char recv_buffer[RECV_BUFFER_LEN] = {0};
+    ssize_t res = 0;
+    recv_buffer_t recv_buffer;
+    const char *packet;
+    size_t packet_len;
+    int data_fd = -1;
+    data_snapshot_t snapshot;
     client_thread_data_t *thread_data = NULL;
+    uint64_t first_byte_pending;
+    uint64_t readback_start;
 
     thread_data = (client_thread_data_t *) current_thread_data;
 
     if(thread_data == NULL){
-        syslog(LOG_ERR, "Thread data is NULL");
+        log_msg(LOG_ERR, "Thread data is NULL");
         return current_thread_data;
     }
 
-    res = pthread_mutex_lock(thread_data->mutex);
-    if(res != 0){
-        syslog(LOG_ERR, "pthread_mutex_lock error: %d", res);
-        goto close_client;
-    }
-
-    syslog(LOG_DEBUG, "Opening data file");
+    recv_buffer_init(&recv_buffer);
+    first_byte_pending = thread_data->accepted_at;
 
-    FILE *data_file = fopen(DATA_FILE_NAME, "a+");
-
-    if(data_file == NULL){
-        syslog(LOG_ERR, "Error opening data file: %s", strerror(errno));
-        goto close_client;
+    if(server_config.persistent){
+        struct timeval idle_timeout = { .tv_sec = server_config.idle_timeout_sec };
+        if(setsockopt(thread_data->client_fd, SOL_SOCKET, SO_RCVTIMEO, &idle_timeout, sizeof(idle_timeout)) == -1){
+            log_msg(LOG_ERR, "setsockopt error: %s", strerror(errno));
+        }
     }
 
-    syslog(LOG_DEBUG, "Data file opened");
-
-    while((res = recv(thread_data->client_fd, recv_buffer, sizeof(recv_buffer), 0)) > 0){
-        syslog(LOG_DEBUG, "Received %d bytes", res);
-#if USE_AESD_CHAR_DEVICE == 1
-        if(res >= (int)AESD_SEEKTO_KEYWORD_LEN && strncmp(recv_buffer, AESD_SEEKTO_KEYWORD, AESD_SEEKTO_KEYWORD_LEN) == 0){
-#else
-        if(false){
-#endif
-            int ioctl_res;
-            syslog(LOG_INFO, "Received seekto keyword");
-            char *save_ptr;
-            char delimiter[] = ":,";
-
-            char *token = strtok_r(recv_buffer, delimiter, &save_ptr);
-            syslog(LOG_DEBUG, "First token: %s", token);
-
-            token = strtok_r(NULL, delimiter, &save_ptr);
-            syslog(LOG_DEBUG, "Second token: %s", token);
-
-            int cmd_offset = atoi(token);
-
-            token = strtok_r(NULL, delimiter, &save_ptr);
-            syslog(LOG_DEBUG, "Third token: %s", token);
-
-            int cmd_char_offset = atoi(token);
+    do{
+        // the whole packet is buffered before touching the data file, so a
+        // slow sender never holds the mutex
+        while(!recv_buffer_next_packet(&recv_buffer, &packet, &packet_len)){
+            size_t available;
+            char *space = recv_buffer_reserve(&recv_buffer, RECV_BUFFER_LEN, &available);
+            if(space == NULL){
+                if(recv_buffer.oversized){
+                    log_msg(LOG_ERR, "Packet exceeds the maximum length, closing connection");
+                } else {
+                    log_msg(LOG_ERR, "Error allocating memory for packet");
+                }
+                goto close_client;
+            }
 
-            struct aesd_seekto seekto = {
-                .write_cmd = cmd_offset,
-                .write_cmd_offset = cmd_char_offset
-            };
+            res = recv(thread_data->client_fd, space, available, 0);
+            if(res == 0){
+                log_msg(LOG_INFO, "Connection closed by client");
+                // a packet only counts once its newline arrived, the rest is dropped
+                if(recv_buffer_pending(&recv_buffer) > 0){
+                    log_msg(LOG_INFO, "Discarding %zu bytes of an unterminated packet", recv_buffer_pending(&recv_buffer));
+                }
+                goto close_client;
+            } else if(res == -1){
+                if(errno == EAGAIN || errno == EWOULDBLOCK){
+                    log_msg(LOG_INFO, "Idle timeout expired");
+                } else {
+                    log_msg(LOG_ERR, "recv error: %s", strerror(errno));
+                }
+                goto close_client;
+            }
 
-            int fd = fileno(data_file);
+            log_msg(LOG_DEBUG, "Received %zd bytes", res);
+            recv_buffer_commit(&recv_buffer, res);
+            metrics_add(METRIC_BYTES_IN, res);
+            metrics_record_since(METRIC_FIRST_BYTE, first_byte_pending);
+            first_byte_pending = 0;
+        }
 
-            unsigned long request = AESDCHAR_IOCSEEKTO;
+        log_msg(LOG_DEBUG, "Newline detected. Packet fully received");
 
-            syslog(LOG_DEBUG, "Sending ioctl request: %lu", request);
+        if(data_fd == -1){
+            log_msg(LOG_DEBUG, "Opening data file");
 
-            ioctl_res = ioctl(fd, request, &seekto);
-            if(ioctl_res < 0){
-                syslog(LOG_ERR, "ioctl error: %s", strerror(errno));
+            data_fd = data_store_open();
+            if(data_fd == -1){
+                goto close_client;
             }
         }
-        else{
-            fwrite(recv_buffer, sizeof(*recv_buffer), res, data_file);
-        }
 
-        if(memchr(recv_buffer, '\n', res) != NULL){
-            syslog(LOG_DEBUG, "Newline detected. Packet fully received");
-            break;
+        if(!data_store_commit(data_fd, thread_data->mutex, packet, packet_len, recv_buffer.framing, &snapshot)){
+            goto close_client;
         }
 
-        memset(recv_buffer, 0, sizeof(recv_buffer));
-    }
-
-    if(res == 0){
-        syslog(LOG_INFO, "Connection closed by client");
-        goto close_client_file;
-    } else if(res == -1){
-        syslog(LOG_ERR, "recv error: %s", strerror(errno));
-        goto close_client_file;
-    }
-
-#if USE_AESD_CHAR_DEVICE == 0
-    if(fseek(data_file, 0, SEEK_SET) == -1){
-        syslog(LOG_ERR, "Error seeking data file: %s", strerror(errno));
-        goto close_client_file;
-    }
-#endif
-
-    while((res = fread(recv_buffer, sizeof(*recv_buffer), sizeof(recv_buffer), data_file)) > 0){
-        syslog(LOG_DEBUG, "Sending %d bytes", res);
-        syslog(LOG_DEBUG, "Data: %.*s", res, recv_buffer);
-        res = send(thread_data->client_fd, recv_buffer, res, 0);
-        if(res == -1){
-            syslog(LOG_ERR, "send error: %s", strerror(errno));
-            goto close_client_file;
+        // blocking socket, so this only returns once everything was sent or on error
+        readback_start = metrics_now();
+        while((res = data_snapshot_send(&snapshot, thread_data->client_fd)) == 0);
+        if(res == 1){
+            metrics_record_since(METRIC_READBACK, readback_start);
+            if(snapshot.framing){
+                recv_buffer_set_framing(&recv_buffer);
+            }
         }
-        memset(recv_buffer, 0, sizeof(recv_buffer));
-    }
 
-    syslog(LOG_INFO, "Data sent to client");
+        data_snapshot_release(&snapshot);
+    } while((server_config.persistent || recv_buffer.framing) && res == 1);
 
-close_client_file:
-    fclose(data_file);
 close_client:
-    pthread_mutex_unlock(thread_data->mutex);
+    data_store_close(data_fd);
+    recv_buffer_free(&recv_buffer);
     close(thread_data->client_fd);
     thread_data->client_fd = -1;
+    admission_release();
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+    metrics_record_since(METRIC_CONNECTION, thread_data->accepted_at);
 
-    syslog(LOG_INFO, "Closed connection from %s", thread_data->addr_str);
+    log_msg(LOG_INFO, "Closed connection from %s", thread_data->addr_str);
 
-    thread_data->thread_completed = true;
+    // the listener may free thread_data as soon as it is pushed
+    if(thread_data->instance != NULL){
+        completion_queue_push(&thread_completions, &thread_data->instance->completion);
+    }
 
     return current_thread_data;
 }
 
 int main(int argc, char **argv){
     struct addrinfo hints, *addr_res;
-#if USE_AESD_CHAR_DEVICE == 0
-    struct itimerspec timer;
-    struct sigevent sev;
-    timer_data_t timer_data;
-    timer_t timer_id;
-#endif
     pthread_mutex_t file_mutex;
     struct sigaction sa = {0};
     int client_fd = -1;
     int res;
     int return_val = 0;
     bool start_in_daemon = false;
+    worker_pool_t *pool = NULL;
+    int listen_fds[LISTENER_MAX_SHARDS];
+    size_t listen_count = 0;
+    long opt_value;
+    int opt;
 
     openlog(argv[0], LOG_PID, LOG_USER);
 
-#if USE_AESD_CHAR_DEVICE == 1
-    syslog(LOG_INFO, "compiled to work with char device");
-#else
-    syslog(LOG_INFO, "compiled to work with temp file");
-#endif
+    while((opt = getopt(argc, argv, SERVER_OPTIONS)) != -1){
+        switch(opt){
+        case 'd':
+            log_msg(LOG_DEBUG, "daemon flag provided, server will start in daemon mode");
+            start_in_daemon = true;
+            break;
+        case 'm':
+            if(strcmp(optarg, MODE_EPOLL_NAME) == 0){
+                server_config.mode = SERVER_MODE_EPOLL;
+            } else if(strcmp(optarg, MODE_POOL_NAME) == 0){
+                server_config.mode = SERVER_MODE_POOL;
+            } else if(strcmp(optarg, MODE_URING_NAME) == 0){
+                server_config.mode = SERVER_MODE_URING;
+            } else if(strcmp(optarg, MODE_THREAD_NAME) == 0){
+                server_config.mode = SERVER_MODE_THREAD;
+            } else {
+                log_msg(LOG_ERR, "Unknown server mode: %s", optarg);
+                return -1;
+            }
+            break;
+        case 'w':
+            opt_value = strtol(optarg, NULL, 10);
+            if(opt_value < 0){
+                log_msg(LOG_ERR, "Invalid worker count: %s", optarg);
+                return -1;
+            }
+            server_config.workers = (size_t) opt_value;
+            break;
+        case 'k':
+            opt_value = strtol(optarg, NULL, 10);
+            if(opt_value <= 0){
+                log_msg(LOG_ERR, "Invalid idle timeout: %s", optarg);
+                return -1;
+            }
+            server_config.persistent = true;
+            server_config.idle_timeout_sec = (int) opt_value;
+            break;
+        case 'a':
+            server_config.admin_path = optarg;
+            break;
+        case 'l':
+            server_config.log_path = optarg;
+            break;
+        case 't':
+            opt_value = strtol(optarg, NULL, 10);
+            if(opt_value < 0 || opt_value > INT_MAX){
+                log_msg(LOG_ERR, "Invalid tick interval: %s", optarg);
+                return -1;
+            }
+            server_config.tick_interval_sec = (int) opt_value;
+            break;
+        case 'n':
+            opt_value = strtol(optarg, NULL, 10);
+            if(opt_value <= 0 || opt_value > LISTENER_MAX_SHARDS){
+                log_msg(LOG_ERR, "Invalid listener count: %s", optarg);
+                return -1;
+            }
+            server_config.shards = (size_t) opt_value;
+            break;
+        case 'b':
+            opt_value = strtol(optarg, NULL, 10);
+            if(opt_value <= 0){
+                log_msg(LOG_ERR, "Invalid backlog: %s", optarg);
+                return -1;
+            }
+            server_config.backlog = (int) opt_value;
+            break;
+        case 'f':
+            if(strcmp(optarg, SYNC_NONE_NAME) == 0){
+                server_config.sync_mode = SYNC_MODE_NONE;
+            } else if(strcmp(optarg, SYNC_GROUP_NAME) == 0){
+                server_config.sync_mode = SYNC_MODE_GROUP;
+            } else if(strcmp(optarg, SYNC_PACKET_NAME) == 0){
+                server_config.sync_mode = SYNC_MODE_PACKET;
+            } else {
+                log_msg(LOG_ERR, "Unknown sync mode: %s", optarg);
+                return -1;
+            }
+            break;
+        case 'C':
+            if(!parse_limit(optarg, &server_config.admission.max_connections)){
+                log_msg(LOG_ERR, "Invalid connection limit: %s", optarg);
+                print_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'B':
+            if(!parse_limit(optarg, &server_config.admission.max_inflight_bytes)){
+                log_msg(LOG_ERR, "Invalid in-flight byte limit: %s", optarg);
+                print_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'P':
+            if(!parse_limit(optarg, &server_config.admission.max_pending_appends)){
+                log_msg(LOG_ERR, "Invalid pending append limit: %s", optarg);
+                print_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'o':
+            if(strcmp(optarg, OVERLOAD_PAUSE_NAME) == 0){
+                server_config.admission.policy = OVERLOAD_PAUSE;
+            } else if(strcmp(optarg, OVERLOAD_BUSY_NAME) == 0){
+                server_config.admission.policy = OVERLOAD_BUSY;
+            } else {
+                log_msg(LOG_ERR, "Unknown overload policy: %s", optarg);
+                return -1;
+            }
+            break;
+        case 's':
+            server_config.storage = storage_find(optarg);
+            if(server_config.storage == NULL){
+                log_msg(LOG_ERR, "Unknown storage backend: %s", optarg);
+                return -1;
+            }
+            break;
+        case 'p':
+            server_config.port = optarg;
+            break;
+        case 'D':
+            server_config.data_path = optarg;
+            break;
+        case 'r':
+            if(!parse_limit(optarg, &server_config.retention.max_packets)){
+                log_msg(LOG_ERR, "Invalid retained packet limit: %s", optarg);
+                print_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'R':
+            if(!parse_limit(optarg, &server_config.retention.max_bytes)){
+                log_msg(LOG_ERR, "Invalid retained byte limit: %s", optarg);
+                print_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'A':
+            opt_value = strtol(optarg, NULL, 10);
+            if(opt_value < 0 || opt_value > INT_MAX){
+                log_msg(LOG_ERR, "Invalid retention age: %s", optarg);
+                return -1;
+            }
+            server_config.retention.max_age_sec = (int) opt_value;
+            break;
+        case 'H':
+            server_config.handoff_path = optarg;
+            break;
+        case 'M':
+            opt_value = strtol(optarg, NULL, 10);
+            if(opt_value < 0 || opt_value > DATA_LOG_MAX_CHUNKS){
+                log_msg(LOG_ERR, "Invalid mirror size: %s", optarg);
+                return -1;
+            }
+            server_config.mirror_chunks = (size_t) opt_value;
+            break;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if(server_config.data_path == NULL){
+        server_config.data_path = server_config.storage->default_path;
+    }
+    if(server_config.data_path != NULL){
+        log_msg(LOG_INFO, "Using %s storage at %s", server_config.storage->name, server_config.data_path);
+    } else {
+        log_msg(LOG_INFO, "Using %s storage", server_config.storage->name);
+    }
+    if(server_config.storage != &storage_segment && (server_config.retention.max_packets > 0
+        || server_config.retention.max_bytes > 0 || server_config.retention.max_age_sec > 0)){
+        log_msg(LOG_ERR, "Retention needs %s storage", STORAGE_SEGMENT_NAME);
+        return -1;
+    }
+    // the ring writes the data file or the device itself and bypasses the other backends
+    if(server_config.mode == SERVER_MODE_URING && server_config.storage != &storage_file && server_config.storage != &storage_chardev){
+        log_msg(LOG_ERR, "%s storage is not supported in %s mode", server_config.storage->name, MODE_URING_NAME);
+        return -1;
+    }
 
-    if(argc == 2 && strcmp(argv[1], DAEMON_KEY) == 0){
-        syslog(LOG_DEBUG, "daemon flag provided, server will start in daemon mode");
-        start_in_daemon = true;
+    log_msg(LOG_INFO, "Using %s server mode", server_mode_name(server_config.mode));
+    if(server_config.shards > 1 && server_config.mode != SERVER_MODE_EPOLL && server_config.mode != SERVER_MODE_POOL){
+        log_msg(LOG_ERR, "Multiple listeners need %s or %s mode, using one listener", MODE_EPOLL_NAME, MODE_POOL_NAME);
+        server_config.shards = 1;
+    }
+    if(server_config.persistent){
+        log_msg(LOG_INFO, "Persistent connections enabled, idle timeout %d s", server_config.idle_timeout_sec);
     }
 
     sa.sa_handler = signal_handler;
@@ -173,336 +381,709 @@ int main(int argc, char **argv){
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
     
-    res = getaddrinfo(NULL, PORT, &hints, &addr_res);
+    res = getaddrinfo(NULL, server_config.port, &hints, &addr_res);
     if(res != 0){
-        syslog(LOG_ERR, "getaddrinfo error: %s", gai_strerror(res));
+        log_msg(LOG_ERR, "getaddrinfo error: %s", gai_strerror(res));
         return -1;
     }
 
-    sockfd = socket(addr_res->ai_family, addr_res->ai_socktype, addr_res->ai_protocol);
-    if(sockfd == -1){
-        syslog(LOG_ERR, "socket error: %s", strerror(errno));
+    // a running server hands its listeners over, they never stop accepting
+    if(server_config.handoff_path != NULL
+        && !handoff_receive(server_config.handoff_path, listen_fds, LISTENER_MAX_SHARDS, &listen_count)){
         return_val = -1;
         goto exit;
     }
 
-    res = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
-    if(res == -1){
-        syslog(LOG_ERR, "setsockopt error: %s", strerror(errno));
-        return_val = -1;
-        goto exit;
-    }
+    if(listen_count > 0){
+        listeners_adopt(listen_fds, listen_count);
+    } else {
+        sockfd = listener_open(addr_res, server_config.shards > 1);
+        if(sockfd == -1){
+            return_val = -1;
+            goto exit;
+        }
 
-    res = bind(sockfd, addr_res->ai_addr, addr_res->ai_addrlen);
-    if(res == -1){
-        syslog(LOG_ERR, "bind error: %s", strerror(errno));
-        return_val = -1;
-        goto exit;
+        for(size_t i = 1; i < server_config.shards; i++){
+            shards[i].listen_fd = listener_open(addr_res, true);
+            if(shards[i].listen_fd == -1){
+                return_val = -1;
+                goto exit;
+            }
+        }
     }
 
     if (start_in_daemon){
         res = daemon(0, 0);
         if(res == -1){
-            syslog(LOG_ERR, "daemon creation error: %s", strerror(errno));
+            log_msg(LOG_ERR, "daemon creation error: %s", strerror(errno));
             return_val = -1;
             goto exit;
         }
     }
 
-    res = listen(sockfd, 20);
+    // started after daemon(), which keeps only the calling thread
+    if(!async_log_start(server_config.log_path)){
+        return_val = -1;
+        goto exit;
+    }
+
+    res = listen(sockfd, server_config.backlog);
     if(res == -1){
-        syslog(LOG_ERR, "listen error: %s", strerror(errno));
+        log_msg(LOG_ERR, "listen error: %s", strerror(errno));
         return_val = -1;
         goto exit;
     }
 
+    for(size_t i = 1; i < server_config.shards; i++){
+        if(listen(shards[i].listen_fd, server_config.backlog) == -1){
+            log_msg(LOG_ERR, "listen error: %s", strerror(errno));
+            return_val = -1;
+            goto exit;
+        }
+    }
+
     res = pthread_mutex_init(&file_mutex, NULL);
     if(res != 0){
-        syslog(LOG_ERR, "pthread_mutex_init error: %d", res);
+        log_msg(LOG_ERR, "pthread_mutex_init error: %d", res);
         return_val = -1;
         goto exit;
     }
 
-#if USE_AESD_CHAR_DEVICE == 0
-    memset(&timer, 0, sizeof(timer));
-    timer.it_value.tv_sec = 10;
-    timer.it_interval.tv_sec = 10;
+    if(!data_store_init()){
+        return_val = -1;
+        goto exit;
+    }
 
-    timer_data.mutex = &file_mutex;
+    if(server_config.admin_path != NULL && !metrics_admin_start(server_config.admin_path)){
+        return_val = -1;
+        goto exit;
+    }
 
-    sev.sigev_notify = SIGEV_THREAD;
-    sev.sigev_notify_function = &timer_expired_handler;
-    sev.sigev_value.sival_ptr = &timer_data;
-    sev.sigev_notify_attributes = NULL;
+    if(server_config.handoff_path != NULL){
+        listen_fds[0] = sockfd;
+        for(size_t i = 1; i < server_config.shards; i++){
+            listen_fds[i] = shards[i].listen_fd;
+        }
+        if(!handoff_serve(server_config.handoff_path, listen_fds, server_config.shards)){
+            return_val = -1;
+            goto exit;
+        }
+    }
 
-    res = timer_create(CLOCK_MONOTONIC, &sev, &timer_id);
-    if(res != 0){
-        syslog(LOG_ERR, "timer_create error: %s", strerror(errno));
-        goto exit;
+    // the io_uring loop runs its own ticker so it stays the only writer of the data file
+    if(server_config.storage->timestamps && server_config.mode != SERVER_MODE_URING && server_config.tick_interval_sec > 0){
+        if(ticker_open(server_config.tick_interval_sec) == -1){
+            return_val = -1;
+            goto exit;
+        }
     }
 
-    syslog(LOG_DEBUG, "Timer created");
+    if(server_config.shards > 1){
+        if(!shards_start(&file_mutex)){
+            return_val = -1;
+            goto exit;
+        }
+        // the main thread serves the first listener on the first CPU
+        listener_pin_thread(pthread_self(), 0);
+    }
 
-    res = timer_settime(timer_id, 0, &timer, NULL);
-    if(res != 0){
-        syslog(LOG_ERR, "timer_settime error: %s", strerror(errno));
-        goto exit;
+    if(server_config.mode == SERVER_MODE_EPOLL){
+        res = event_loop_run(sockfd, ticker_fd(), &file_mutex);
+        if(res != 0){
+            log_msg(LOG_ERR, "Event loop terminated with error");
+            return_val = -1;
+        }
+    } else if(server_config.mode == SERVER_MODE_URING){
+        res = uring_loop_run(sockfd);
+        if(res != 0){
+            log_msg(LOG_ERR, "io_uring loop terminated with error");
+            return_val = -1;
+        }
+    } else if(server_config.mode == SERVER_MODE_POOL){
+        pool = worker_pool_create(server_config.workers, connection_handler, thread_data_release);
+        if(pool == NULL){
+            return_val = -1;
+            goto exit;
+        }
+        for(size_t i = 0; server_config.shards > 1 && i < pool->worker_count; i++){
+            listener_pin_thread(pool->workers[i].thread, 0);
+        }
+    } else if(server_config.mode == SERVER_MODE_THREAD){
+        if(!completion_queue_init(&thread_completions)){
+            log_msg(LOG_ERR, "eventfd error: %s", strerror(errno));
+            return_val = -1;
+            goto exit;
+        }
     }
-#endif
 
-    while(is_active){
+    while((server_config.mode == SERVER_MODE_THREAD || server_config.mode == SERVER_MODE_POOL) && is_active){
         struct sockaddr_storage client_addr;
         client_thread_data_t *thread_data = NULL;
         thread_instance_t *thread_instance = NULL;
 
+        // the ticker shares this loop, so wait for either before accepting.
+        // While overloaded the listener is left out, clients wait in its backlog
+        bool paused = admission_paused();
+        struct pollfd fds[4] = {
+            { .fd = paused ? -1 : sockfd, .events = POLLIN },
+            { .fd = ticker_fd(), .events = POLLIN },
+            { .fd = handoff_drain_fd(), .events = POLLIN },
+            { .fd = completion_queue_fd(&thread_completions), .events = POLLIN }
+        };
+
+        if(poll(fds, 4, paused ? ADMISSION_RETRY_MS : -1) == -1){
+            if(errno != EINTR){
+                log_msg(LOG_ERR, "poll error: %s", strerror(errno));
+            }
+            continue;
+        }
+        // a successor accepts from here on, the connections left finish below
+        if(fds[2].revents & POLLIN){
+            break;
+        }
+        if(fds[3].revents & POLLIN){
+            threads_reap();
+        }
+        if(fds[1].revents & POLLIN){
+            ticker_expired(&file_mutex);
+        }
+        if(!(fds[0].revents & (POLLIN | POLLERR | POLLHUP))){
+            continue;
+        }
+
         client_fd = accept(sockfd, (struct sockaddr *)&client_addr, &(socklen_t){sizeof(client_addr)});
         if (client_fd == -1){
-            syslog(LOG_ERR, "accept error: %s", strerror(errno));
+            // the listener may be non-blocking when taken over from an event loop
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                log_msg(LOG_ERR, "accept error: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        if(!admission_admit(client_fd)){
             continue;
         }
 
-        thread_data = (client_thread_data_t *) malloc(sizeof(*thread_data));
+        thread_data = (client_thread_data_t *) object_cache_alloc(&thread_data_cache);
 
         if(thread_data == NULL){
-            syslog(LOG_ERR, "Error allocating memory for thread data: %s", strerror(errno));
+            log_msg(LOG_ERR, "Error allocating memory for thread data: %s", strerror(errno));
             goto listener_close_client;
             continue;
         }
 
         thread_data->client_fd = client_fd;
         thread_data->mutex = &file_mutex;
-        thread_data->thread_completed = false;
+        thread_data->accepted_at = metrics_now();
+        thread_data->instance = NULL;
+        metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
 
         inet_ntop(client_addr.ss_family, get_in_addr((struct sockaddr *)&client_addr), thread_data->addr_str, sizeof(thread_data->addr_str));
 
-        syslog(LOG_INFO, "Accepted connection from %s", thread_data->addr_str);
+        log_msg(LOG_INFO, "Accepted connection from %s", thread_data->addr_str);
 
-        syslog(LOG_DEBUG, "Spawning new thread to handle connection from %s", thread_data->addr_str);
+        if(server_config.mode == SERVER_MODE_POOL){
+            if(!worker_pool_submit(pool, thread_data)){
+                goto listener_free_thread_data;
+            }
+            continue;
+        }
 
-        thread_instance = (thread_instance_t *) malloc(sizeof(*thread_instance));
-        memset(thread_instance, 0, sizeof(*thread_instance));
+        log_msg(LOG_DEBUG, "Spawning new thread to handle connection from %s", thread_data->addr_str);
+
+        thread_instance = (thread_instance_t *) object_cache_alloc(&thread_instance_cache);
 
         if(thread_instance == NULL){
-            syslog(LOG_ERR, "Error allocating memory for thread instance: %s", strerror(errno));
+            log_msg(LOG_ERR, "Error allocating memory for thread instance: %s", strerror(errno));
             goto listener_free_thread_data;
             continue;
         }
+        memset(thread_instance, 0, sizeof(*thread_instance));
 
         thread_instance->thread_data = thread_data;
+        thread_data->instance = thread_instance;
 
         res = pthread_create(&(thread_instance->thread), NULL, connection_handler, (void *)thread_data);
         if(res != 0){
-            syslog(LOG_ERR, "pthread_create error: %d", res);
+            log_msg(LOG_ERR, "pthread_create error: %d", res);
             goto listener_free_thread_instance;
         }
+        threads_running++;
 
-        syslog(LOG_INFO, "Thread spawned successfully");
-
-        res = queue_enqueue(thread_instance);
-        if(!res){
-            syslog(LOG_ERR, "Error adding thread instance to queue");
-            goto listener_kill_thread;
-        }
-
-        syslog(LOG_DEBUG, "Thread instance added to queue");
-
-        node_t *node = queue_get_head();
-        do{
-            syslog(LOG_DEBUG, "Checking thread");
-            if(node == NULL){
-                syslog(LOG_ERR, "Node is NULL");
-                break;
-            }
-
-            if(node->data == NULL){
-                syslog(LOG_ERR, "Node data is NULL");
-                break;
-            }
-
-            thread_instance_t *thread_instance = (thread_instance_t *)node->data;
-            node = node->next;
-            
-            if(thread_instance == NULL){
-                syslog(LOG_ERR, "Thread instance is NULL");
-                continue;
-            }
-            if(thread_instance->thread_data == NULL){
-                syslog(LOG_ERR, "Thread data is NULL");
-                continue;
-            }
-
-            syslog(LOG_DEBUG, "Checking thread completion");
-
-            if(thread_instance->thread_data->thread_completed){
-                syslog(LOG_DEBUG, "Thread completed. Joining and freeing resources");
-                if(thread_instance->thread_data->client_fd != -1){
-                    close(thread_instance->thread_data->client_fd);
-                }
-                free(thread_instance->thread_data);
-                pthread_join(thread_instance->thread, NULL);
-                queue_remove(thread_instance);
-                free(thread_instance);
-                syslog(LOG_DEBUG, "Thread resources freed");
-            }
-        }while(node != NULL);
-
-        syslog(LOG_DEBUG, "Thread queue checked");
+        log_msg(LOG_INFO, "Thread spawned successfully");
 
         continue;
 
-    listener_kill_thread:
-        pthread_cancel(thread_instance->thread);
     listener_free_thread_instance:
-        free(thread_instance);
+        object_cache_free(&thread_instance_cache, thread_instance);
     listener_free_thread_data:
-        free(thread_data);
+        thread_data_release(thread_data);
     listener_close_client:
         close(client_fd);
+        admission_release();
     }
 
-    syslog(LOG_DEBUG, "Cleaning allocated resources and threads");
+    log_msg(LOG_DEBUG, "Cleaning allocated resources and threads");
 
-    thread_instance_t *thread_instance;
-    while ((thread_instance = (thread_instance_t *) queue_dequeue()) != NULL)
-    {
-        if(thread_instance != NULL){
-            if(thread_instance->thread_data != NULL){
-                if(thread_instance->thread_data->client_fd != -1){
-                    close(thread_instance->thread_data->client_fd);
-                }
-                free(thread_instance->thread_data);
-            }
-            pthread_join(thread_instance->thread, NULL);
-            free(thread_instance);
+    worker_pool_destroy(pool);
+
+    // connections still open finish first, like the pool's queued ones
+    while(threads_running > 0){
+        struct pollfd pfd = { .fd = completion_queue_fd(&thread_completions), .events = POLLIN };
+
+        if(poll(&pfd, 1, -1) > 0){
+            threads_reap();
         }
     }
+    completion_queue_destroy(&thread_completions);
 
-    syslog(LOG_DEBUG, "All threads cleaned");
+    log_msg(LOG_DEBUG, "All threads cleaned");
 
 exit:
-#if USE_AESD_CHAR_DEVICE == 0
-    if(timer_delete(timer_id) != 0){
-        syslog(LOG_ERR, "timer_delete error: %s", strerror(errno));
-    }
+    shards_stop();
+    ticker_close();
     if(pthread_mutex_destroy(&file_mutex) != 0){
-        syslog(LOG_ERR, "pthread_mutex_destroy error: %s", strerror(errno));
+        log_msg(LOG_ERR, "pthread_mutex_destroy error: %s", strerror(errno));
     }
-#endif
     freeaddrinfo(addr_res);
     close(sockfd);
     sockfd = -1;
-    remove_data_file();
+    metrics_admin_stop();
+    handoff_release();
+    data_store_cleanup();
+    object_cache_log_stats();
+    object_cache_cleanup();
+    async_log_stop();
     closelog();
     return return_val;
 }
 
-static void remove_data_file(void){
-#if USE_AESD_CHAR_DEVICE == 0
-    if(remove(DATA_FILE_NAME) == 0){
-        syslog(LOG_INFO, "Removed data file");
+/**
+ * Accept loop of an additional listener in pool mode.
+ */
+static void shard_accept(listener_shard_t *shard){
+    while(is_active){
+        struct sockaddr_storage client_addr;
+        client_thread_data_t *thread_data = NULL;
+        int client_fd;
+        struct pollfd fds[2] = {
+            { .fd = shard->listen_fd, .events = POLLIN },
+            { .fd = handoff_drain_fd(), .events = POLLIN }
+        };
+
+        if(admission_paused()){
+            poll(NULL, 0, ADMISSION_RETRY_MS);
+            continue;
+        }
+
+        if(poll(fds, 2, -1) == -1){
+            continue;
+        }
+        if(fds[1].revents & POLLIN){
+            break;
+        }
+
+        client_fd = accept(shard->listen_fd, (struct sockaddr *)&client_addr, &(socklen_t){sizeof(client_addr)});
+        if(client_fd == -1){
+            if(is_active && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK){
+                log_msg(LOG_ERR, "accept error: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        if(!admission_admit(client_fd)){
+            continue;
+        }
+
+        thread_data = (client_thread_data_t *) object_cache_alloc(&thread_data_cache);
+        if(thread_data == NULL){
+            log_msg(LOG_ERR, "Error allocating memory for thread data: %s", strerror(errno));
+            close(client_fd);
+            admission_release();
+            continue;
+        }
+
+        thread_data->client_fd = client_fd;
+        thread_data->mutex = shard->file_mutex;
+        thread_data->accepted_at = metrics_now();
+        thread_data->instance = NULL;
+        metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+
+        inet_ntop(client_addr.ss_family, get_in_addr((struct sockaddr *)&client_addr), thread_data->addr_str, sizeof(thread_data->addr_str));
+
+        log_msg(LOG_INFO, "Accepted connection from %s on listener %zu", thread_data->addr_str, shard->index);
+
+        if(!worker_pool_submit(shard->pool, thread_data)){
+            close(client_fd);
+            admission_release();
+            thread_data_release(thread_data);
+        }
+    }
+}
+
+static void *shard_thread(void *arg){
+    listener_shard_t *shard = (listener_shard_t *) arg;
+
+    if(server_config.mode == SERVER_MODE_EPOLL){
+        if(event_loop_run(shard->listen_fd, -1, shard->file_mutex) != 0){
+            log_msg(LOG_ERR, "Event loop of listener %zu terminated with error", shard->index);
+        }
     } else {
-        syslog(LOG_ERR, "Error removing data file: %s", strerror(errno));
+        shard_accept(shard);
     }
-#else
-    syslog(LOG_INFO, "using  aesd char device, not removing data file");
-#endif
+
+    return NULL;
 }
 
-static void *get_in_addr(struct sockaddr *sa){
-    if(sa->sa_family == AF_INET){
-        return &(((struct sockaddr_in *)sa)->sin_addr);
+/**
+ * Starts the threads of listeners 1 to shards - 1, each pinned to the CPU of
+ * its index together with its workers.
+ */
+static bool shards_start(pthread_mutex_t *file_mutex){
+    size_t workers = server_config.workers;
+    int res;
+
+    if(workers == 0){
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > (long) server_config.shards ? (size_t) cpus / server_config.shards : 1;
+        // the first listener's pool follows the same split
+        server_config.workers = workers;
     }
-    return &(((struct sockaddr_in6 *)sa)->sin6_addr);
+
+    for(size_t i = 1; i < server_config.shards; i++){
+        listener_shard_t *shard = &shards[i];
+
+        shard->index = i;
+        shard->file_mutex = file_mutex;
+
+        if(server_config.mode == SERVER_MODE_POOL){
+            shard->pool = worker_pool_create(workers, connection_handler, thread_data_release);
+            if(shard->pool == NULL){
+                return false;
+            }
+            for(size_t j = 0; j < shard->pool->worker_count; j++){
+                listener_pin_thread(shard->pool->workers[j].thread, i);
+            }
+        }
+
+        res = pthread_create(&shard->thread, NULL, shard_thread, shard);
+        if(res != 0){
+            log_msg(LOG_ERR, "pthread_create error: %d", res);
+            return false;
+        }
+        shard->started = true;
+        listener_pin_thread(shard->thread, i);
+    }
+
+    log_msg(LOG_INFO, "Serving %zu listeners", server_config.shards);
+
+    return true;
 }
 
-static void signal_handler(int sig){
-    int old_errno = errno;
-    if(sig == SIGINT || sig == SIGTERM){
-        syslog(LOG_INFO, "Received SIGINT/SIGTERM (%d). Shutting down...", sig);
+static void shards_stop(void){
+    // after a handoff the listeners are shared with the successor, every
+    // listener thread stops on its own once drained
+    if(!handoff_done()){
         is_active = false;
-        if(sockfd != -1){
-            shutdown(sockfd, SHUT_RDWR);
+
+        for(size_t i = 1; i < server_config.shards; i++){
+            if(shards[i].listen_fd > 0){
+                shutdown(shards[i].listen_fd, SHUT_RDWR);
+            }
         }
     }
-    else if(sig == SIGALRM){
-        syslog(LOG_INFO, "Received SIGALRM (%d)", sig);
+
+    for(size_t i = 1; i < server_config.shards; i++){
+        listener_shard_t *shard = &shards[i];
+
+        if(shard->started){
+            pthread_join(shard->thread, NULL);
+            shard->started = false;
+        }
+        worker_pool_destroy(shard->pool);
+        shard->pool = NULL;
+        if(shard->listen_fd > 0){
+            close(shard->listen_fd);
+            shard->listen_fd = -1;
+        }
     }
+}
 
-    errno = old_errno;
+/**
+ * Serves the listeners handed over by a predecessor, as many as this mode
+ * supports.
+ */
+static void listeners_adopt(const int *fds, size_t count){
+    size_t supported = server_config.mode == SERVER_MODE_EPOLL || server_config.mode == SERVER_MODE_POOL ? count : 1;
+
+    if(supported != server_config.shards){
+        log_msg(LOG_INFO, "Serving the %zu listeners taken over instead of %zu", supported, server_config.shards);
+    }
+    server_config.shards = supported;
+
+    sockfd = fds[0];
+    for(size_t i = 1; i < count; i++){
+        if(i < supported){
+            shards[i].listen_fd = fds[i];
+        } else {
+            close(fds[i]);
+        }
+    }
 }
 
-#if USE_AESD_CHAR_DEVICE == 0
-static void timer_expired_handler(union sigval sv){
-    syslog(LOG_INFO, "Timer event invoked");
+static void thread_data_release(void *thread_data){
+    object_cache_free(&thread_data_cache, thread_data);
+}
 
-    time_t curr_time;
-    struct tm *time_info;
-    struct tm *time_info_saved;
-    timer_data_t *timer_data = NULL;
-    int res;
-    int str_size;
-    char time_str[1024] = {0};
+/**
+ * Joins every connection thread that finished since the last call.
+ */
+static void threads_reap(void){
+    completion_node_t *node;
+
+    completion_queue_clear(&thread_completions);
+    while((node = completion_queue_pop(&thread_completions)) != NULL){
+        thread_instance_t *thread_instance = completion_entry(node, thread_instance_t, completion);
 
-    curr_time = time(NULL);
-    if(curr_time == -1){
-        syslog(LOG_ERR, "time error: %s", strerror(errno));
-        return;
+        pthread_join(thread_instance->thread, NULL);
+        thread_data_release(thread_instance->thread_data);
+        object_cache_free(&thread_instance_cache, thread_instance);
+        threads_running--;
     }
+    log_msg(LOG_DEBUG, "Finished threads joined, %zu running", threads_running);
+}
+
+/**
+ * Passes the storage to a successor, if one took over.
+ */
+static void handoff_release(void){
+    int fds[HANDOFF_MAX_FDS];
+    size_t count = 0;
+
+    // storage never taken over from a predecessor is left to the successor to open
+    if(server_config.storage->handoff_fds != NULL && data_store_attached()){
+        count = server_config.storage->handoff_fds(fds, HANDOFF_MAX_FDS);
+    }
+    handoff_stop(fds, count);
+}
 
-    time_info = (struct tm *) malloc(sizeof(*time_info));
-    if(time_info == NULL){
-        syslog(LOG_ERR, "Error allocating memory for time info");
-        return;
+static const char *server_mode_name(server_mode_t mode){
+    switch(mode){
+    case SERVER_MODE_EPOLL:
+        return MODE_EPOLL_NAME;
+    case SERVER_MODE_POOL:
+        return MODE_POOL_NAME;
+    case SERVER_MODE_URING:
+        return MODE_URING_NAME;
+    default:
+        return MODE_THREAD_NAME;
     }
+}
 
-    time_info_saved = time_info;
-    time_info = localtime_r(&curr_time, time_info);
+/**
+ * Parses a limit given as a non-negative decimal number, 0 leaves it off.
+ */
+static bool parse_limit(const char *arg, size_t *value){
+    unsigned long long parsed;
+    char *end;
 
-    if(time_info == NULL){
-        syslog(LOG_ERR, "localtime_r error: %s", strerror(errno));
-        time_info = time_info_saved;
-        goto timer_expired_exit;
+    // strtoull() would wrap a negative number around
+    if(strchr(arg, '-') != NULL){
+        return false;
     }
 
-    str_size = strftime(time_str, sizeof(time_str), "timestamp: %Y, %m, %d, %H, %M, %S\n", time_info);
-    if(str_size == 0){
-        syslog(LOG_ERR, "strftime error: %s", strerror(errno));
-        goto timer_expired_exit;
+    errno = 0;
+    parsed = strtoull(arg, &end, 10);
+    if(errno != 0 || end == arg || *end != '\0' || parsed > SIZE_MAX){
+        return false;
     }
 
-    syslog(LOG_DEBUG, "Current time: %s", time_str);
+    *value = (size_t) parsed;
+    return true;
+}
+
+static void print_usage(const char *name){
+    log_msg(LOG_ERR, "Usage: %s [-d] [-m %s|%s|%s|%s] [-w workers] [-k idle_timeout_sec] [-f %s|%s|%s] [-a admin_socket] [-n listeners] [-b backlog] [-l log_file] [-t tick_interval_sec] "
+        "[-C max_connections] [-B max_inflight_bytes] [-P max_pending_appends] [-o %s|%s] [-s %s|%s|%s|%s] [-p port] [-D data_path] "
+        "[-r max_packets] [-R max_bytes] [-A max_age_sec] [-H handoff_socket] [-M mirror_mib]", name,
+        MODE_THREAD_NAME, MODE_EPOLL_NAME, MODE_POOL_NAME, MODE_URING_NAME, SYNC_NONE_NAME, SYNC_GROUP_NAME, SYNC_PACKET_NAME,
+        OVERLOAD_PAUSE_NAME, OVERLOAD_BUSY_NAME, STORAGE_FILE_NAME, STORAGE_CHARDEV_NAME, STORAGE_MEMORY_NAME, STORAGE_SEGMENT_NAME);
+}
 
-    timer_data = (timer_data_t *) sv.sival_ptr;
-    if(timer_data == NULL){
-        syslog(LOG_ERR, "Timer data is NULL");
-        goto timer_expired_exit;
+size_t format_timestamp(char *buffer, size_t size){
+    struct tm time_info;
+    time_t curr_time = time(NULL);
+
+    if(curr_time == -1 || localtime_r(&curr_time, &time_info) == NULL){
+        log_msg(LOG_ERR, "Error reading current time: %s", strerror(errno));
+        return 0;
     }
 
-    res = pthread_mutex_lock(timer_data->mutex);
-    if(res != 0){
-        syslog(LOG_ERR, "pthread_mutex_lock error: %d", res);
-        goto timer_expired_exit;
+    return strftime(buffer, size, TIMESTAMP_FORMAT, &time_info);
+}
+
+bool parse_seekto_command(const char *cmd, size_t cmd_len, struct aesd_seekto *seekto){
+    char cmd_buffer[RECV_BUFFER_LEN] = {0};
+    char delimiter[] = ":,";
+    char *save_ptr;
+    char *token;
+
+    if(cmd_len >= sizeof(cmd_buffer)){
+        cmd_len = sizeof(cmd_buffer) - 1;
     }
+    memcpy(cmd_buffer, cmd, cmd_len);
 
-    FILE *data_file = fopen(DATA_FILE_NAME, "a+");
+    token = strtok_r(cmd_buffer, delimiter, &save_ptr);
+    log_msg(LOG_DEBUG, "First token: %s", token);
+    if(token == NULL || strcmp(token, AESD_SEEKTO_KEYWORD) != 0){
+        return false;
+    }
 
-    if(data_file == NULL){
-        syslog(LOG_ERR, "Error opening data file: %s", strerror(errno));
-        goto timer_expired_exit;
+    token = strtok_r(NULL, delimiter, &save_ptr);
+    log_msg(LOG_DEBUG, "Second token: %s", token);
+    if(token == NULL){
+        return false;
     }
 
-    res = fwrite(time_str, sizeof(*time_str), str_size, data_file);
-    if(res != str_size){
-        syslog(LOG_ERR, "fwrite error: %s", strerror(errno));
-        goto timer_expired_close_file;
+    seekto->write_cmd = atoi(token);
+
+    token = strtok_r(NULL, delimiter, &save_ptr);
+    log_msg(LOG_DEBUG, "Third token: %s", token);
+    if(token == NULL){
+        return false;
+    }
+
+    seekto->write_cmd_offset = atoi(token);
+
+    return true;
+}
+
+bool parse_cursor_command(const char *cmd, size_t cmd_len, off_t *cursor, const char **payload, size_t *payload_len){
+    const char *end = cmd + cmd_len;
+    const char *pos = cmd + AESD_CURSOR_KEYWORD_LEN;
+    off_t value = 0;
+
+    if(cmd_len < AESD_CURSOR_KEYWORD_LEN || strncmp(cmd, AESD_CURSOR_KEYWORD, AESD_CURSOR_KEYWORD_LEN) != 0){
+        return false;
     }
 
-    syslog(LOG_INFO, "Wrote timestamp to data file");
+    if(pos == end || *pos < '0' || *pos > '9'){
+        return false;
+    }
+
+    while(pos < end && *pos >= '0' && *pos <= '9'){
+        value = value * 10 + (*pos - '0');
+        pos++;
+    }
+
+    if(pos == end || *pos != ':'){
+        return false;
+    }
+    pos++;
+
+    *cursor = value;
+    *payload = pos;
+    *payload_len = end - pos;
+
+    // a bare newline carries no data, the client only polls
+    if(*payload_len == 1 && **payload == '\n'){
+        *payload_len = 0;
+    }
+
+    return true;
+}
 
-timer_expired_close_file:
-    fclose(data_file);
-    pthread_mutex_unlock(timer_data->mutex);
-timer_expired_exit:
-    free(time_info);
+/**
+ * Parses an optionally negative decimal number and moves pos past it.
+ * @return false when there are no digits or the number does not fit
+ */
+static bool parse_signed(const char **pos, const char *end, int64_t *value){
+    bool negative = *pos < end && **pos == '-';
+    const char *digits = *pos + negative;
+    int64_t result = 0;
+
+    *pos = digits;
+    while(*pos < end && **pos >= '0' && **pos <= '9'){
+        if(result > (INT64_MAX - (**pos - '0')) / 10){
+            return false;
+        }
+        result = result * 10 + (**pos - '0');
+        (*pos)++;
+    }
+
+    *value = negative ? -result : result;
+    return *pos > digits;
+}
+
+bool parse_range_command(const char *cmd, size_t cmd_len, aesd_range_t *range){
+    const char *end = cmd + cmd_len;
+    const char *pos;
+
+    if(cmd_len >= AESD_PACKETS_KEYWORD_LEN && strncmp(cmd, AESD_PACKETS_KEYWORD, AESD_PACKETS_KEYWORD_LEN) == 0){
+        range->packets = true;
+        pos = cmd + AESD_PACKETS_KEYWORD_LEN;
+    } else if(cmd_len >= AESD_BYTES_KEYWORD_LEN && strncmp(cmd, AESD_BYTES_KEYWORD, AESD_BYTES_KEYWORD_LEN) == 0){
+        range->packets = false;
+        pos = cmd + AESD_BYTES_KEYWORD_LEN;
+    } else {
+        return false;
+    }
+
+    if(!parse_signed(&pos, end, &range->first) || pos == end || *pos != ','){
+        return false;
+    }
+    pos++;
+
+    range->last = INT64_MAX;
+    if(pos < end && *pos != '\n' && !parse_signed(&pos, end, &range->last)){
+        return false;
+    }
+
+    return pos == end || (*pos == '\n' && pos + 1 == end);
+}
+
+int64_t range_bound(int64_t value, int64_t low, int64_t high){
+    if(value < 0){
+        value = high + value;
+    }
+    if(value < low){
+        return low;
+    }
+    return value < high ? value : high;
+}
+
+size_t format_cursor_header(char *buffer, size_t size, off_t cursor){
+    int len = snprintf(buffer, size, AESD_CURSOR_KEYWORD "%lld\n", (long long) cursor);
+    return len > 0 && (size_t) len < size ? (size_t) len : 0;
+}
+
+void *get_in_addr(struct sockaddr *sa){
+    if(sa->sa_family == AF_INET){
+        return &(((struct sockaddr_in *)sa)->sin_addr);
+    }
+    return &(((struct sockaddr_in6 *)sa)->sin6_addr);
+}
+
+static void signal_handler(int sig){
+    int old_errno = errno;
+    if(sig == SIGINT || sig == SIGTERM){
+        syslog(LOG_INFO, "Received SIGINT/SIGTERM (%d). Shutting down...", sig);
+        is_active = false;
+        // after a handoff the listeners are shared with the successor
+        if(!handoff_done()){
+            if(sockfd != -1){
+                shutdown(sockfd, SHUT_RDWR);
+            }
+            for(size_t i = 1; i < server_config.shards; i++){
+                if(shards[i].listen_fd > 0){
+                    shutdown(shards[i].listen_fd, SHUT_RDWR);
+                }
+            }
+        }
+    }
+    else if(sig == SIGALRM){
+        syslog(LOG_INFO, "Received SIGALRM (%d)", sig);
+    }
+
+    errno = old_errno;
 }
-#endif
\ No newline at end of file
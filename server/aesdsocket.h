@@ -6,6 +6,7 @@
 #include <strings.h>
 #include <syslog.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -16,44 +17,191 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <signal.h>
-#include <thread_queue.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
 #include <time.h>
+#include <poll.h>
+#include <limits.h>
+#include "admission.h"
+#include "async_log.h"
+#include "completion_queue.h"
+#include "segment_log.h"
 #include "../aesd-char-driver/aesd_ioctl.h"
 
 typedef struct client_thread_data{
     int client_fd;
     char addr_str[INET6_ADDRSTRLEN];
     pthread_mutex_t *mutex;
-    bool thread_completed;
+    uint64_t accepted_at;
+    /**
+     * Thread serving the connection in thread mode, NULL in pool mode
+     */
+    struct thread_instance *instance;
 } client_thread_data_t;
 
-typedef struct timer_data{
-    pthread_mutex_t *mutex;
-} timer_data_t;
-
 typedef struct thread_instance{
     pthread_t thread;
     client_thread_data_t *thread_data;
+    /**
+     * Pushed by the thread once it is done, the listener joins it then
+     */
+    completion_node_t completion;
 } thread_instance_t;
 
-#define DAEMON_KEY              "-d"
+/**
+ * Additional SO_REUSEPORT listener with its own pinned acceptor thread,
+ * which runs an event loop in epoll mode or feeds its own worker pool
+ */
+typedef struct listener_shard{
+    pthread_t thread;
+    size_t index;
+    int listen_fd;
+    pthread_mutex_t *file_mutex;
+    struct worker_pool *pool;
+    bool started;
+} listener_shard_t;
+
+typedef enum server_mode{
+    SERVER_MODE_THREAD,
+    SERVER_MODE_EPOLL,
+    SERVER_MODE_POOL,
+    SERVER_MODE_URING
+} server_mode_t;
+
+typedef enum sync_mode{
+    SYNC_MODE_NONE,
+    SYNC_MODE_GROUP,
+    SYNC_MODE_PACKET
+} sync_mode_t;
+
+typedef struct server_config{
+    server_mode_t mode;
+    /**
+     * Worker count of the pool mode, 0 picks one per online CPU
+     */
+    size_t workers;
+    /**
+     * Keep connections open for further packets until the client closes
+     * them or they stay idle for idle_timeout_sec
+     */
+    bool persistent;
+    int idle_timeout_sec;
+    /**
+     * When appended data is flushed to disk: never explicitly, once per
+     * group commit, or after every single packet
+     */
+    sync_mode_t sync_mode;
+    /**
+     * UNIX socket serving the metrics report, NULL when disabled
+     */
+    const char *admin_path;
+    /**
+     * File the log is appended to, NULL logs to syslog
+     */
+    const char *log_path;
+    /**
+     * Seconds between timestamps written in file mode, 0 disables them
+     */
+    int tick_interval_sec;
+    admission_limits_t admission;
+    /**
+     * Number of SO_REUSEPORT listeners, each served on its own CPU
+     */
+    size_t shards;
+    int backlog;
+    /**
+     * Where packets are stored, data_path is handed to the backend and
+     * defaults to the backend's own path
+     */
+    const struct storage_backend *storage;
+    const char *data_path;
+    const char *port;
+    /**
+     * Most recent 1 MiB chunks of the data file kept in memory, 0 serves
+     * every readback from the file
+     */
+    size_t mirror_chunks;
+    /**
+     * How much the segment backend keeps
+     */
+    retention_limits_t retention;
+    /**
+     * UNIX socket a restarted server takes the listeners and the storage
+     * over through, NULL when disabled
+     */
+    const char *handoff_path;
+} server_config_t;
+
+#define SERVER_OPTIONS          "dm:w:k:f:a:n:b:l:t:C:B:P:o:s:p:D:r:R:A:H:M:"
+#define MODE_THREAD_NAME        "thread"
+#define MODE_EPOLL_NAME         "epoll"
+#define MODE_POOL_NAME          "pool"
+#define MODE_URING_NAME         "uring"
+#define SYNC_NONE_NAME          "none"
+#define SYNC_GROUP_NAME         "group"
+#define SYNC_PACKET_NAME        "packet"
+#define OVERLOAD_PAUSE_NAME     "pause"
+#define OVERLOAD_BUSY_NAME      "busy"
 #define PORT                    "9000"
 
+/**
+ * Only picks the storage backend used when none is given on the command line
+ */
+#ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE    (1)
-
-#if USE_AESD_CHAR_DEVICE == 1
-#define DATA_FILE_NAME          "/dev/aesdchar"
-#else
-#define DATA_FILE_NAME          "/var/tmp/aesdsocketdata"
 #endif
 
 #define AESD_SEEKTO_KEYWORD     "AESDCHAR_IOCSEEKTO"
 #define AESD_SEEKTO_KEYWORD_LEN (sizeof(AESD_SEEKTO_KEYWORD) - 1)
 
+/**
+ * Incremental readback: "AESDCURSOR:<offset>:<data>\n" appends <data> and is
+ * answered with "AESDCURSOR:<new offset>\n" followed by everything stored
+ * after <offset>. An empty <data> only polls for new content.
+ */
+#define AESD_CURSOR_KEYWORD     "AESDCURSOR:"
+#define AESD_CURSOR_KEYWORD_LEN (sizeof(AESD_CURSOR_KEYWORD) - 1)
+#define AESD_CURSOR_HEADER_LEN  64
+
+/**
+ * Ranged read: "AESDPACKETS:<first>,<last>\n" is answered with the packets
+ * from <first> up to but excluding <last>, counted from the oldest packet
+ * kept. "AESDBYTES:<first>,<last>\n" is answered with the bytes stored at
+ * those offsets. Negative values count back from the end, an empty <last>
+ * reads up to the end. Nothing is appended.
+ */
+#define AESD_PACKETS_KEYWORD    "AESDPACKETS:"
+#define AESD_PACKETS_KEYWORD_LEN (sizeof(AESD_PACKETS_KEYWORD) - 1)
+#define AESD_BYTES_KEYWORD      "AESDBYTES:"
+#define AESD_BYTES_KEYWORD_LEN  (sizeof(AESD_BYTES_KEYWORD) - 1)
+
+typedef struct aesd_range{
+    bool packets;
+    int64_t first;
+    /**
+     * INT64_MAX when the range reaches up to the end
+     */
+    int64_t last;
+} aesd_range_t;
+
 #define RECV_BUFFER_LEN         512
 
+#define TIMESTAMP_FORMAT        "timestamp: %Y, %m, %d, %H, %M, %S\n"
+
+extern bool is_active;
+extern server_config_t server_config;
+
+bool parse_seekto_command(const char *cmd, size_t cmd_len, struct aesd_seekto *seekto);
+bool parse_cursor_command(const char *cmd, size_t cmd_len, off_t *cursor, const char **payload, size_t *payload_len);
+size_t format_cursor_header(char *buffer, size_t size, off_t cursor);
+bool parse_range_command(const char *cmd, size_t cmd_len, aesd_range_t *range);
+/**
+ * @return value clamped to [low, high], a negative value counts back from high
+ */
+int64_t range_bound(int64_t value, int64_t low, int64_t high);
+void *get_in_addr(struct sockaddr *sa);
+size_t format_timestamp(char *buffer, size_t size);
+
 #endif
\ No newline at end of file
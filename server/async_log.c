@@ -0,0 +1,283 @@
+#include "async_log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct log_record{
+    int level;
+    struct timespec time;
+    char text[LOG_RECORD_LEN];
+} log_record_t;
+
+/**
+ * Single producer, single consumer ring: the owning thread advances head,
+ * the drain thread advances tail, neither ever waits for the other.
+ */
+typedef struct log_ring{
+    log_record_t records[LOG_RING_RECORDS];
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    /**
+     * Drops already reported, only touched by the drain thread
+     */
+    uint64_t dropped_reported;
+    /**
+     * Cleared once the owning thread exited, the next thread that logs
+     * claims the ring instead of allocating one
+     */
+    bool owned;
+    struct log_ring *next;
+} log_ring_t;
+
+static const char *level_names[] = {
+    "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+};
+
+/**
+ * Every ring ever created, only prepended and never unlinked, so neither
+ * the threads nor the drain thread take a lock
+ */
+static log_ring_t *rings = NULL;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread log_ring_t *local_ring = NULL;
+
+static pthread_t drain_thread;
+static bool drain_running = false;
+static int log_fd = -1;
+static char file_batch[LOG_FILE_BATCH_LEN];
+static size_t file_batch_len = 0;
+
+static void ring_retire(void *data){
+    log_ring_t *ring = (log_ring_t *) data;
+
+    // publishes head to the thread claiming the ring next
+    __atomic_store_n(&ring->owned, false, __ATOMIC_RELEASE);
+}
+
+static void key_create(void){
+    pthread_key_create(&ring_key, ring_retire);
+}
+
+/**
+ * Only drained rings are claimed, otherwise threads that come and go
+ * faster than the drain interval would all fill the same ring.
+ * @return an empty ring an exited thread left behind, NULL when there is none
+ */
+static log_ring_t *ring_claim(void){
+    for(log_ring_t *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next){
+        bool owned = false;
+
+        if(!__atomic_load_n(&ring->owned, __ATOMIC_RELAXED)
+            && __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) == __atomic_load_n(&ring->head, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(&ring->owned, &owned, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            return ring;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @return the ring of the calling thread, claimed or created on first use,
+ * NULL when out of memory
+ */
+static log_ring_t *ring_get(void){
+    log_ring_t *ring = local_ring;
+
+    if(ring != NULL){
+        return ring;
+    }
+
+    pthread_once(&key_once, key_create);
+
+    ring = ring_claim();
+    if(ring == NULL){
+        ring = (log_ring_t *) calloc(1, sizeof(*ring));
+        if(ring == NULL){
+            return NULL;
+        }
+        ring->owned = true;
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&rings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+        }
+    }
+
+    pthread_setspecific(ring_key, ring);
+    local_ring = ring;
+    return ring;
+}
+
+void async_log_write(int level, const char *format, ...){
+    int old_errno = errno;
+    log_ring_t *ring = NULL;
+    va_list args;
+
+    va_start(args, format);
+
+    if(!__atomic_load_n(&drain_running, __ATOMIC_ACQUIRE) || (ring = ring_get()) == NULL){
+        vsyslog(level, format, args);
+    } else {
+        uint64_t head = ring->head;
+
+        if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_RECORDS){
+            __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        } else {
+            log_record_t *record = &ring->records[head % LOG_RING_RECORDS];
+
+            record->level = level;
+            clock_gettime(CLOCK_REALTIME, &record->time);
+            vsnprintf(record->text, sizeof(record->text), format, args);
+            __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    va_end(args);
+    errno = old_errno;
+}
+
+static void file_flush(void){
+    size_t written = 0;
+
+    while(written < file_batch_len){
+        ssize_t res = write(log_fd, file_batch + written, file_batch_len - written);
+        if(res == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            syslog(LOG_ERR, "log file write error: %s", strerror(errno));
+            break;
+        }
+        written += res;
+    }
+    file_batch_len = 0;
+}
+
+static void sink_write(int level, const struct timespec *time, const char *text){
+    char stamp[32];
+    struct tm tm;
+    int len;
+
+    if(log_fd == -1){
+        syslog(level, "%s", text);
+        return;
+    }
+
+    localtime_r(&time->tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+    if(file_batch_len + LOG_RECORD_LEN + 64 > sizeof(file_batch)){
+        file_flush();
+    }
+    len = snprintf(file_batch + file_batch_len, sizeof(file_batch) - file_batch_len, "%s.%06ld %s %s\n",
+        stamp, time->tv_nsec / 1000, level_names[LOG_PRI(level)], text);
+    // the flush above leaves room for the longest line
+    if(len > 0){
+        file_batch_len += len;
+    }
+}
+
+/**
+ * Passes the records of every ring to the sink.
+ * @return number of records drained
+ */
+static size_t drain_all(void){
+    size_t drained = 0;
+
+    for(log_ring_t *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next){
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        uint64_t tail = ring->tail;
+
+        for(; tail != head; tail++){
+            const log_record_t *record = &ring->records[tail % LOG_RING_RECORDS];
+            sink_write(record->level, &record->time, record->text);
+            drained++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        if(dropped != ring->dropped_reported){
+            struct timespec now;
+            char text[64];
+
+            clock_gettime(CLOCK_REALTIME, &now);
+            snprintf(text, sizeof(text), "Dropped %llu log records, ring full",
+                (unsigned long long)(dropped - ring->dropped_reported));
+            sink_write(LOG_WARNING, &now, text);
+            ring->dropped_reported = dropped;
+        }
+    }
+
+    if(log_fd != -1 && file_batch_len > 0){
+        file_flush();
+    }
+
+    return drained;
+}
+
+static void *drain_thread_main(void *arg){
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = LOG_DRAIN_INTERVAL_MS * 1000000L };
+    (void) arg;
+
+    while(__atomic_load_n(&drain_running, __ATOMIC_ACQUIRE)){
+        if(drain_all() == 0){
+            nanosleep(&interval, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+bool async_log_start(const char *path){
+    int res;
+
+    if(path != NULL){
+        log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if(log_fd == -1){
+            syslog(LOG_ERR, "open error: %s", strerror(errno));
+            return false;
+        }
+    }
+
+    __atomic_store_n(&drain_running, true, __ATOMIC_RELEASE);
+    res = pthread_create(&drain_thread, NULL, drain_thread_main, NULL);
+    if(res != 0){
+        syslog(LOG_ERR, "pthread_create error: %d", res);
+        __atomic_store_n(&drain_running, false, __ATOMIC_RELEASE);
+        if(log_fd != -1){
+            close(log_fd);
+            log_fd = -1;
+        }
+        return false;
+    }
+
+    return true;
+}
+
+void async_log_stop(void){
+    if(!__atomic_load_n(&drain_running, __ATOMIC_ACQUIRE)){
+        return;
+    }
+
+    __atomic_store_n(&drain_running, false, __ATOMIC_RELEASE);
+    pthread_join(drain_thread, NULL);
+
+    // the ring of the caller is drained a last time, later records use syslog
+    if(local_ring != NULL){
+        pthread_setspecific(ring_key, NULL);
+        ring_retire(local_ring);
+        local_ring = NULL;
+    }
+    drain_all();
+
+    if(log_fd != -1){
+        close(log_fd);
+        log_fd = -1;
+    }
+}
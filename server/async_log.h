@@ -0,0 +1,50 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <syslog.h>
+
+/**
+ * Records above this syslog level are compiled out, build with
+ * -DLOG_LEVEL_MAX=LOG_DEBUG to keep the per-packet debug records
+ */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX           LOG_INFO
+#endif
+
+#define LOG_RECORD_LEN          240
+#define LOG_RING_RECORDS        128
+#define LOG_DRAIN_INTERVAL_MS   10
+#define LOG_FILE_BATCH_LEN      16384
+
+/**
+ * Drop-in replacement for syslog(). The level check is a constant, so
+ * disabled records cost nothing, not even the evaluation of their arguments.
+ */
+#define log_msg(level, ...) do{ \
+        if((level) <= LOG_LEVEL_MAX){ \
+            async_log_write((level), __VA_ARGS__); \
+        } \
+    } while(0)
+
+/**
+ * Formats a record into the ring of the calling thread, dropping it when the
+ * ring is full. Until async_log_start() and after async_log_stop() records go
+ * straight to syslog.
+ */
+void async_log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Starts the thread draining every ring, to syslog or appended to the file
+ * at path when not NULL. Call it after daemon(), which drops all threads.
+ */
+bool async_log_start(const char *path);
+
+/**
+ * Drains the remaining records and stops the drain thread. Call it once the
+ * other logging threads have exited.
+ */
+void async_log_stop(void);
+
+#endif // ASYNC_LOG_H
@@ -0,0 +1,95 @@
+#include "completion_queue.h"
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+bool completion_queue_init(completion_queue_t *queue){
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+    queue->signalled = false;
+
+    queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return queue->event_fd != -1;
+}
+
+void completion_queue_destroy(completion_queue_t *queue){
+    if(queue->event_fd != -1){
+        close(queue->event_fd);
+        queue->event_fd = -1;
+    }
+}
+
+/**
+ * Links node behind the last one pushed. Between the exchange and the
+ * store the node is not reachable from tail yet, the consumer then sees
+ * the queue as empty.
+ */
+static void queue_link(completion_queue_t *queue, completion_node_t *node){
+    completion_node_t *prev;
+
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+void completion_queue_push(completion_queue_t *queue, completion_node_t *node){
+    int old_errno = errno;
+
+    queue_link(queue, node);
+
+    // a push that finds the signal set is popped after the consumer clears it
+    if(__atomic_exchange_n(&queue->signalled, true, __ATOMIC_ACQ_REL)){
+        return;
+    }
+
+    // only fails when the counter would overflow, which leaves it readable anyway
+    while(eventfd_write(queue->event_fd, 1) == -1 && errno == EINTR);
+    errno = old_errno;
+}
+
+completion_node_t *completion_queue_pop(completion_queue_t *queue){
+    completion_node_t *tail = queue->tail;
+    completion_node_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if(tail == &queue->stub){
+        if(next == NULL){
+            return NULL;
+        }
+        queue->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if(next != NULL){
+        queue->tail = next;
+        return tail;
+    }
+
+    // tail is the last node linked, a producer may be about to link another
+    if(tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)){
+        return NULL;
+    }
+
+    // the stub takes over as the last node so tail can be handed out
+    queue_link(queue, &queue->stub);
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if(next != NULL){
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+int completion_queue_fd(const completion_queue_t *queue){
+    return queue->event_fd;
+}
+
+void completion_queue_clear(completion_queue_t *queue){
+    eventfd_t value;
+
+    while(eventfd_read(queue->event_fd, &value) == -1 && errno == EINTR);
+    // after the read, so a push signalling from here on leaves the eventfd readable
+    (void) __atomic_exchange_n(&queue->signalled, false, __ATOMIC_ACQ_REL);
+}
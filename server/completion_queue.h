@@ -0,0 +1,77 @@
+#ifndef COMPLETION_QUEUE_H
+#define COMPLETION_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Link embedded in every object pushed, the queue never allocates
+ */
+typedef struct completion_node{
+    struct completion_node *next;
+} completion_node_t;
+
+/**
+ * Intrusive multi-producer single-consumer queue. Producers push with one
+ * atomic exchange and never wait for each other or the consumer, then
+ * signal event_fd so a consumer polling it reaps right away. Only the first
+ * push after the consumer cleared the signal writes the eventfd. Only a
+ * single thread may pop. Nodes come out in push order per producer.
+ */
+typedef struct completion_queue{
+    /**
+     * Last node pushed, exchanged by the producers
+     */
+    completion_node_t *head;
+    /**
+     * Next node to pop, touched by the consumer only
+     */
+    completion_node_t *tail;
+    /**
+     * Keeps the list non-empty, so producers never touch tail
+     */
+    completion_node_t stub;
+    int event_fd;
+    /**
+     * Set while event_fd was written and not cleared yet
+     */
+    bool signalled;
+} completion_queue_t;
+
+#define completion_entry(node, type, member) \
+    ((type *)((char *)(node) - offsetof(type, member)))
+
+/**
+ * @return false with errno set when the eventfd cannot be created
+ */
+bool completion_queue_init(completion_queue_t *queue);
+
+/**
+ * Closes the eventfd, nodes still queued are left to their owners.
+ */
+void completion_queue_destroy(completion_queue_t *queue);
+
+/**
+ * Pushes node from any thread and wakes the consumer.
+ */
+void completion_queue_push(completion_queue_t *queue, completion_node_t *node);
+
+/**
+ * @return oldest node, NULL when empty or while the only pending push has
+ * not linked its node yet. That push signals the eventfd once it has.
+ */
+completion_node_t *completion_queue_pop(completion_queue_t *queue);
+
+/**
+ * @return descriptor that is readable while pushes were signalled since
+ * the last completion_queue_clear()
+ */
+int completion_queue_fd(const completion_queue_t *queue);
+
+/**
+ * Resets the eventfd, to be called before popping everything pending so a
+ * push racing with the pops signals again.
+ */
+void completion_queue_clear(completion_queue_t *queue);
+
+#endif // COMPLETION_QUEUE_H
@@ -0,0 +1,183 @@
+/**
+ * Measures the completion queue under producer contention against a
+ * mutex-protected list that signals the same eventfd the same way. Every
+ * producer pushes its own nodes, the main thread reaps them the way the
+ * listener does: wait for the eventfd, clear it, pop until empty.
+ *
+ * usage: completion_queue_bench [producers] [pushes per producer]
+ */
+#include "completion_queue.h"
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+typedef struct bench_queue bench_queue_t;
+
+typedef struct bench_ops{
+    const char *name;
+    void (*push)(bench_queue_t *queue, completion_node_t *node);
+    completion_node_t *(*pop)(bench_queue_t *queue);
+} bench_ops_t;
+
+struct bench_queue{
+    const bench_ops_t *ops;
+    completion_queue_t queue;
+    /**
+     * Baseline list, shares the eventfd of queue
+     */
+    pthread_mutex_t lock;
+    completion_node_t *head;
+    completion_node_t *tail;
+};
+
+typedef struct producer{
+    pthread_t thread;
+    bench_queue_t *queue;
+    completion_node_t *nodes;
+    size_t count;
+} producer_t;
+
+static double elapsed_sec(const struct timespec *start){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void mpsc_push(bench_queue_t *queue, completion_node_t *node){
+    completion_queue_push(&queue->queue, node);
+}
+
+static completion_node_t *mpsc_pop(bench_queue_t *queue){
+    return completion_queue_pop(&queue->queue);
+}
+
+static void locked_push(bench_queue_t *queue, completion_node_t *node){
+    node->next = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if(queue->tail != NULL){
+        queue->tail->next = node;
+    } else {
+        queue->head = node;
+    }
+    queue->tail = node;
+    pthread_mutex_unlock(&queue->lock);
+    if(!__atomic_exchange_n(&queue->queue.signalled, true, __ATOMIC_ACQ_REL)){
+        eventfd_write(queue->queue.event_fd, 1);
+    }
+}
+
+static completion_node_t *locked_pop(bench_queue_t *queue){
+    completion_node_t *node;
+
+    pthread_mutex_lock(&queue->lock);
+    node = queue->head;
+    if(node != NULL){
+        queue->head = node->next;
+        if(queue->head == NULL){
+            queue->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return node;
+}
+
+static const bench_ops_t bench_ops[] = {
+    { "locked", locked_push, locked_pop },
+    { "mpsc", mpsc_push, mpsc_pop }
+};
+
+static void *producer_thread(void *arg){
+    producer_t *producer = (producer_t *) arg;
+
+    for(size_t i = 0; i < producer->count; i++){
+        producer->queue->ops->push(producer->queue, &producer->nodes[i]);
+    }
+    return NULL;
+}
+
+static int run(const bench_ops_t *ops, producer_t *producers, size_t producer_count, size_t count){
+    bench_queue_t queue = { .ops = ops, .lock = PTHREAD_MUTEX_INITIALIZER };
+    size_t total = producer_count * count;
+    size_t popped = 0;
+    size_t wakeups = 0;
+    struct timespec start;
+    double sec;
+
+    if(!completion_queue_init(&queue.queue)){
+        perror("eventfd");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(size_t i = 0; i < producer_count; i++){
+        producers[i].queue = &queue;
+        pthread_create(&producers[i].thread, NULL, producer_thread, &producers[i]);
+    }
+
+    while(popped < total){
+        struct pollfd pfd = { .fd = completion_queue_fd(&queue.queue), .events = POLLIN };
+
+        if(poll(&pfd, 1, -1) <= 0){
+            continue;
+        }
+        wakeups++;
+        completion_queue_clear(&queue.queue);
+        while(ops->pop(&queue) != NULL){
+            popped++;
+        }
+    }
+    sec = elapsed_sec(&start);
+
+    for(size_t i = 0; i < producer_count; i++){
+        pthread_join(producers[i].thread, NULL);
+    }
+    completion_queue_destroy(&queue.queue);
+
+    printf("%-8s %10zu pushes %8.3f s %10.2f Mpush/s %10zu wakeups\n", ops->name, total, sec, total / sec / 1e6, wakeups);
+    return 0;
+}
+
+int main(int argc, char **argv){
+    size_t producer_count = argc > 1 ? strtoul(argv[1], NULL, 10) : 4;
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    producer_t *producers;
+    int return_val = 0;
+
+    if(producer_count == 0 || count == 0){
+        fprintf(stderr, "usage: %s [producers] [pushes per producer]\n", argv[0]);
+        return 1;
+    }
+
+    producers = calloc(producer_count, sizeof(*producers));
+    if(producers == NULL){
+        fprintf(stderr, "Error allocating producers\n");
+        return 1;
+    }
+    for(size_t i = 0; i < producer_count; i++){
+        producers[i].count = count;
+        producers[i].nodes = calloc(count, sizeof(completion_node_t));
+        if(producers[i].nodes == NULL){
+            fprintf(stderr, "Error allocating %zu nodes\n", count);
+            return_val = 1;
+            goto bench_exit;
+        }
+    }
+
+    printf("%zu producers, %zu pushes each\n", producer_count, count);
+    for(size_t i = 0; i < sizeof(bench_ops) / sizeof(bench_ops[0]); i++){
+        if(run(&bench_ops[i], producers, producer_count, count) != 0){
+            return_val = 1;
+        }
+    }
+
+bench_exit:
+    for(size_t i = 0; i < producer_count; i++){
+        free(producers[i].nodes);
+    }
+    free(producers);
+    return return_val;
+}
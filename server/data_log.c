@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+#include "data_log.h"
+#include "async_log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+static data_log_t data_log = {
+    .fd = -1
+};
+
+static bool write_all(int fd, const char *data, size_t len){
+    size_t written = 0;
+
+    while(written < len){
+        ssize_t res = write(fd, data + written, len - written);
+        if(res == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            log_msg(LOG_ERR, "write error: %s", strerror(errno));
+            return false;
+        }
+        written += res;
+    }
+
+    return true;
+}
+
+/**
+ * Drops the oldest chunks no snapshot pins until chunk fits into the
+ * configured mirror size.
+ * @return buffer of the first chunk dropped for reuse, NULL when none was
+ */
+static char *mirror_reclaim(off_t chunk){
+    off_t first = data_log.mirror_start / DATA_LOG_CHUNK_SIZE;
+    char *reuse = NULL;
+
+    while(first < chunk && (size_t)(chunk - first) >= data_log.max_chunks
+        && __atomic_load_n(&data_log.pins[first % DATA_LOG_MAX_CHUNKS], __ATOMIC_ACQUIRE) == 0){
+        size_t slot = first % DATA_LOG_MAX_CHUNKS;
+
+        // published first, so peek() stops handing out the chunk before it goes away
+        first++;
+        __atomic_store_n(&data_log.mirror_start, first * DATA_LOG_CHUNK_SIZE, __ATOMIC_RELEASE);
+        if(reuse == NULL){
+            reuse = data_log.chunks[slot];
+        } else {
+            free(data_log.chunks[slot]);
+        }
+        data_log.chunks[slot] = NULL;
+    }
+
+    return reuse;
+}
+
+/**
+ * Makes room for chunk at the front of the mirror.
+ * @return false when the ring is taken by pinned chunks or out of memory
+ */
+static bool mirror_extend(off_t chunk){
+    size_t slot = chunk % DATA_LOG_MAX_CHUNKS;
+    char *buffer = NULL;
+
+    if(data_log.fd != -1){
+        buffer = mirror_reclaim(chunk);
+    }
+
+    if(chunk - data_log.mirror_start / DATA_LOG_CHUNK_SIZE >= DATA_LOG_MAX_CHUNKS){
+        if(data_log.fd == -1){
+            log_msg(LOG_ERR, "Data log full, dropping further content");
+        } else {
+            log_msg(LOG_INFO, "Data log mirror pinned by readers, content is served from the file until they finished");
+        }
+        free(buffer);
+        return false;
+    }
+
+    // a chunk kept from bytes that were dropped again is filled anew
+    if(data_log.chunks[slot] != NULL){
+        free(buffer);
+        return true;
+    }
+
+    if(buffer == NULL){
+        buffer = (char *) malloc(DATA_LOG_CHUNK_SIZE);
+        if(buffer == NULL){
+            log_msg(LOG_ERR, "Error allocating memory for data log chunk");
+            return false;
+        }
+    }
+
+    data_log.chunks[slot] = buffer;
+    return true;
+}
+
+/**
+ * Starts a mirror that stopped over at offset, once no reader pins any of
+ * its chunks any more. What was appended in between is only in the file.
+ * @return false while chunks are pinned
+ */
+static bool mirror_restart(off_t offset){
+    off_t first = data_log.mirror_start / DATA_LOG_CHUNK_SIZE;
+    off_t end = (data_log.mirror_length + DATA_LOG_CHUNK_SIZE - 1) / DATA_LOG_CHUNK_SIZE;
+
+    for(off_t chunk = first; chunk < end; chunk++){
+        if(__atomic_load_n(&data_log.pins[chunk % DATA_LOG_MAX_CHUNKS], __ATOMIC_ACQUIRE) != 0){
+            return false;
+        }
+    }
+
+    // published first, so peek() stops handing out the chunks before they go away
+    __atomic_store_n(&data_log.mirror_start, offset, __ATOMIC_RELEASE);
+    __atomic_store_n(&data_log.mirror_length, offset, __ATOMIC_RELEASE);
+    for(size_t i = 0; i < DATA_LOG_MAX_CHUNKS; i++){
+        free(data_log.chunks[i]);
+        data_log.chunks[i] = NULL;
+    }
+    data_log.mirror_full = false;
+
+    log_msg(LOG_INFO, "Data log mirror restarted at %lld", (long long) offset);
+    return true;
+}
+
+/**
+ * Mirrors data that starts at offset of the log.
+ * @return false when it was not mirrored completely
+ */
+static bool mirror_append(off_t offset, const char *data, size_t len){
+    if(data_log.fd != -1 && data_log.max_chunks == 0){
+        return false;
+    }
+
+    // bytes mirrored ahead of a write that failed are dropped
+    if(!data_log.mirror_full && data_log.mirror_length > offset && offset >= data_log.mirror_start){
+        __atomic_store_n(&data_log.mirror_length, offset, __ATOMIC_RELEASE);
+    }
+    if(data_log.mirror_full || data_log.mirror_length != offset){
+        if(data_log.fd == -1 || !mirror_restart(offset)){
+            return false;
+        }
+    }
+
+    while(len > 0){
+        off_t chunk = data_log.mirror_length / DATA_LOG_CHUNK_SIZE;
+        size_t offset = data_log.mirror_length % DATA_LOG_CHUNK_SIZE;
+        size_t to_copy = DATA_LOG_CHUNK_SIZE - offset;
+
+        // an empty mirror may start inside a chunk, when content was left in the file
+        if((offset == 0 || data_log.mirror_length == data_log.mirror_start) && !mirror_extend(chunk)){
+            // cleared by mirror_restart() once the readers released the ring
+            data_log.mirror_full = true;
+            break;
+        }
+
+        if(to_copy > len){
+            to_copy = len;
+        }
+
+        memcpy(data_log.chunks[chunk % DATA_LOG_MAX_CHUNKS] + offset, data, to_copy);
+        __atomic_store_n(&data_log.mirror_length, data_log.mirror_length + (off_t) to_copy, __ATOMIC_RELEASE);
+        data += to_copy;
+        len -= to_copy;
+    }
+
+    return len == 0;
+}
+
+bool data_log_mirror(const char *data, size_t len){
+    return mirror_append(data_log.length, data, len);
+}
+
+void data_log_publish(size_t len){
+    __atomic_store_n(&data_log.length, data_log.length + (off_t) len, __ATOMIC_RELEASE);
+}
+
+bool data_log_open(const char *path, int fd, size_t max_chunks){
+    char *buffer = NULL;
+    struct stat st;
+    off_t length;
+    ssize_t res;
+
+    data_log.max_chunks = max_chunks < DATA_LOG_MAX_CHUNKS ? max_chunks : DATA_LOG_MAX_CHUNKS;
+
+    if(path == NULL){
+        log_msg(LOG_INFO, "Data log kept in memory only");
+        return true;
+    }
+
+    data_log.fd = fd != -1 ? fd : open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(data_log.fd == -1){
+        log_msg(LOG_ERR, "Error opening data file: %s", strerror(errno));
+        return false;
+    }
+
+    if(fstat(data_log.fd, &st) == -1){
+        log_msg(LOG_ERR, "fstat error: %s", strerror(errno));
+        data_log_close();
+        return false;
+    }
+    length = st.st_size;
+
+    // content left by a previous run is served like anything appended later,
+    // only the end of it that fits into the mirror is loaded. A log handed
+    // over by a running predecessor is not loaded at all, the successor
+    // serves it from the file and mirrors what it appends itself
+    data_log.length = length;
+    if(fd != -1 || data_log.max_chunks == 0){
+        data_log.mirror_start = length;
+    } else if(length > (off_t) data_log.max_chunks * DATA_LOG_CHUNK_SIZE){
+        data_log.mirror_start = (length / DATA_LOG_CHUNK_SIZE - (off_t) data_log.max_chunks + 1) * DATA_LOG_CHUNK_SIZE;
+    }
+    data_log.mirror_length = data_log.mirror_start;
+
+    while(data_log.mirror_length < length){
+        if(buffer == NULL){
+            buffer = (char *) malloc(DATA_LOG_CHUNK_SIZE);
+            if(buffer == NULL){
+                log_msg(LOG_ERR, "Error allocating memory for data log reload");
+                data_log_close();
+                return false;
+            }
+        }
+
+        res = pread(data_log.fd, buffer, DATA_LOG_CHUNK_SIZE, data_log.mirror_length);
+        if(res == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            log_msg(LOG_ERR, "pread error: %s", strerror(errno));
+            free(buffer);
+            data_log_close();
+            return false;
+        }
+        if(res == 0 || !mirror_append(data_log.mirror_length, buffer, res)){
+            break;
+        }
+    }
+
+    free(buffer);
+
+    log_msg(LOG_INFO, "Data log opened with %lld bytes, %lld of them mirrored", (long long) data_log.length,
+        (long long)(data_log.mirror_length - data_log.mirror_start));
+
+    return true;
+}
+
+void data_log_close(void){
+    if(data_log.fd != -1){
+        close(data_log.fd);
+    }
+
+    for(size_t i = 0; i < DATA_LOG_MAX_CHUNKS; i++){
+        free(data_log.chunks[i]);
+        data_log.chunks[i] = NULL;
+    }
+
+    data_log.fd = -1;
+    data_log.length = 0;
+    data_log.mirror_start = 0;
+    data_log.mirror_length = 0;
+    data_log.mirror_full = false;
+}
+
+int data_log_fd(void){
+    return data_log.fd;
+}
+
+bool data_log_append(const char *data, size_t len){
+    if(!write_all(data_log.fd, data, len)){
+        return false;
+    }
+
+    data_log_mirror(data, len);
+    data_log_publish(len);
+    return true;
+}
+
+/**
+ * Without a file the mirror is the log. Every buffer is a packet, which is
+ * published completely or not at all.
+ */
+static bool memory_appendv(struct iovec *iov, int count){
+    for(int i = 0; i < count; i++){
+        off_t mirrored = data_log.mirror_length;
+
+        if(mirrored + (off_t) iov[i].iov_len > (off_t) DATA_LOG_MAX_CHUNKS * DATA_LOG_CHUNK_SIZE){
+            log_msg(LOG_ERR, "Data log full, dropping a packet of %zu bytes", iov[i].iov_len);
+            return false;
+        }
+        if(!mirror_append(mirrored, iov[i].iov_base, iov[i].iov_len)){
+            __atomic_store_n(&data_log.mirror_length, mirrored, __ATOMIC_RELEASE);
+            data_log.mirror_full = false;
+            return false;
+        }
+        data_log_publish(iov[i].iov_len);
+    }
+    return true;
+}
+
+bool data_log_appendv(struct iovec *iov, int count, bool sync){
+    off_t end = data_log.length;
+    size_t written = 0;
+    bool success = true;
+    int first = 0;
+
+    if(data_log.fd == -1){
+        return memory_appendv(iov, count);
+    }
+
+    while(first < count){
+        int batch = count - first < IOV_MAX ? count - first : IOV_MAX;
+        ssize_t res = writev(data_log.fd, iov + first, batch);
+        if(res == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            log_msg(LOG_ERR, "writev error: %s", strerror(errno));
+            success = false;
+            break;
+        }
+        written += res;
+
+        // mirror what was written, a partially written buffer is resumed where it stopped
+        while(first < count){
+            size_t done = (size_t) res < iov[first].iov_len ? (size_t) res : iov[first].iov_len;
+            mirror_append(end, iov[first].iov_base, done);
+            end += done;
+            iov[first].iov_base = (char *) iov[first].iov_base + done;
+            iov[first].iov_len -= done;
+            res -= done;
+            if(iov[first].iov_len > 0){
+                break;
+            }
+            first++;
+        }
+    }
+
+    if(success && sync && fdatasync(data_log.fd) == -1){
+        log_msg(LOG_ERR, "fdatasync error: %s", strerror(errno));
+        success = false;
+    }
+
+    // whatever reached the file is part of the log, even when the rest failed
+    data_log_publish(written);
+    return success;
+}
+
+off_t data_log_length(void){
+    return __atomic_load_n(&data_log.length, __ATOMIC_ACQUIRE);
+}
+
+off_t data_log_mirror_start(void){
+    return __atomic_load_n(&data_log.mirror_start, __ATOMIC_ACQUIRE);
+}
+
+off_t data_log_pin(off_t offset){
+    off_t pin;
+
+    if(offset < data_log.mirror_start){
+        offset = data_log.mirror_start;
+    }
+    if(offset >= data_log.mirror_length){
+        return -1;
+    }
+
+    pin = offset / DATA_LOG_CHUNK_SIZE;
+    __atomic_add_fetch(&data_log.pins[pin % DATA_LOG_MAX_CHUNKS], 1, __ATOMIC_RELAXED);
+    return pin;
+}
+
+void data_log_unpin(off_t pin){
+    if(pin != -1){
+        __atomic_sub_fetch(&data_log.pins[pin % DATA_LOG_MAX_CHUNKS], 1, __ATOMIC_RELEASE);
+    }
+}
+
+size_t data_log_peek(off_t offset, const char **data){
+    size_t chunk_offset = offset % DATA_LOG_CHUNK_SIZE;
+    off_t mirrored = __atomic_load_n(&data_log.mirror_length, __ATOMIC_ACQUIRE);
+    size_t available;
+
+    if(offset >= mirrored || offset < data_log_mirror_start()){
+        return 0;
+    }
+
+    available = DATA_LOG_CHUNK_SIZE - chunk_offset;
+    if((off_t) available > mirrored - offset){
+        available = mirrored - offset;
+    }
+
+    *data = data_log.chunks[(offset / DATA_LOG_CHUNK_SIZE) % DATA_LOG_MAX_CHUNKS] + chunk_offset;
+    return available;
+}
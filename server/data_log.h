@@ -0,0 +1,109 @@
+#ifndef DATA_LOG_H
+#define DATA_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define DATA_LOG_CHUNK_SIZE     (1024 * 1024)
+/**
+ * Chunks the mirror can hold at once, readers that pin old chunks can make
+ * a file backed mirror grow past its configured size up to here
+ */
+#define DATA_LOG_MAX_CHUNKS     256
+#define DATA_LOG_MIRROR_DEFAULT_CHUNKS  64
+
+/**
+ * Long-lived handle on the data file plus an in-memory mirror of its most
+ * recent content, kept as a ring of fixed size chunks that never move while
+ * they are mirrored. Chunk c occupies slot c % DATA_LOG_MAX_CHUNKS. Once a
+ * file backed mirror holds max_chunks chunks, the oldest one is dropped for
+ * every new one, offsets before mirror_start are only kept in the file.
+ * Readers only need the published length to access the mirror and pin the
+ * chunks they read from, appends are serialized by the caller.
+ */
+typedef struct data_log{
+    int fd;
+    char *chunks[DATA_LOG_MAX_CHUNKS];
+    /**
+     * Snapshots reading from the chunk in this slot onwards, it is not
+     * dropped until they were released
+     */
+    size_t pins[DATA_LOG_MAX_CHUNKS];
+    size_t max_chunks;
+    /**
+     * Bytes persisted and visible to readers
+     */
+    off_t length;
+    /**
+     * First mirrored byte
+     */
+    off_t mirror_start;
+    /**
+     * End of the mirrored bytes, may run ahead of length while a write is in flight
+     */
+    off_t mirror_length;
+    /**
+     * Set when pinned chunks or a failed allocation stopped the mirror, it
+     * starts over with the first append after the readers released it
+     */
+    bool mirror_full;
+} data_log_t;
+
+/**
+ * Opens path for appending and loads the end of its current content into a
+ * mirror of at most max_chunks chunks, 0 serves everything from the file.
+ * A NULL path keeps the log in the mirror only, appends then fail once
+ * DATA_LOG_MAX_CHUNKS chunks are filled. fd is a descriptor of path that
+ * is adopted instead, -1 opens path. An adopted log is not loaded, only
+ * what is appended afterwards is mirrored.
+ */
+bool data_log_open(const char *path, int fd, size_t max_chunks);
+void data_log_close(void);
+int data_log_fd(void);
+
+/**
+ * Writes data to the file, mirrors it and publishes it to readers.
+ */
+bool data_log_append(const char *data, size_t len);
+
+/**
+ * Writes all buffers with as few writev() calls as possible, mirrors them and
+ * publishes them. With sync set the data reaches the disk before readers can
+ * see it. iov is modified while partial writes are resumed.
+ */
+bool data_log_appendv(struct iovec *iov, int count, bool sync);
+
+/**
+ * Copies data appended at the published length into the mirror without
+ * publishing it, for writers that persist asynchronously and call
+ * data_log_publish() once the write completed. Bytes mirrored for a write
+ * that failed are dropped by the next call.
+ * @return false when the mirror is full and data was not copied completely
+ */
+bool data_log_mirror(const char *data, size_t len);
+void data_log_publish(size_t len);
+
+off_t data_log_length(void);
+
+/**
+ * @return offset the mirror starts at, everything before is only in the file
+ */
+off_t data_log_mirror_start(void);
+
+/**
+ * Keeps the mirrored chunks from offset onwards until data_log_unpin() is
+ * called with the returned pin. Called with appends serialized.
+ */
+off_t data_log_pin(off_t offset);
+void data_log_unpin(off_t pin);
+
+/**
+ * @return number of contiguous mirrored bytes at offset, 0 when the range is
+ * only available from the file. Offsets before the caller's pin are not
+ * protected from being dropped.
+ */
+size_t data_log_peek(off_t offset, const char **data);
+
+#endif // DATA_LOG_H
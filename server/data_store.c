@@ -0,0 +1,678 @@
+#define _GNU_SOURCE
+#include "data_store.h"
+#include "admission.h"
+#include "frame.h"
+#include "handoff.h"
+#include "metrics.h"
+#include "storage.h"
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+/**
+ * Packets of threads waiting for a group commit, protected by its own mutex
+ * so queueing never waits for the data mutex held during a commit
+ */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t arrived;
+    pthread_cond_t committed;
+    data_commit_t *head;
+    data_commit_t *tail;
+    size_t count;
+    size_t bytes;
+    bool leader_active;
+} commit_group = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .committed = PTHREAD_COND_INITIALIZER
+};
+
+/**
+ * Whether the backend was prepared, attaching is serialized by the mutex
+ */
+static struct {
+    pthread_mutex_t mutex;
+    bool attached;
+    bool success;
+} backend = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+bool data_store_init(void){
+    pthread_condattr_t attr;
+    int res;
+
+    // the group window is measured on the monotonic clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    res = pthread_cond_init(&commit_group.arrived, &attr);
+    pthread_condattr_destroy(&attr);
+    if(res != 0){
+        log_msg(LOG_ERR, "pthread_cond_init error: %d", res);
+        return false;
+    }
+
+    // the storage is only consistent once the predecessor stopped appending
+    if(handoff_storage_ready_fd() != -1){
+        log_msg(LOG_INFO, "Serving before the predecessor drained, the storage follows");
+        return true;
+    }
+    return data_store_attach();
+}
+
+bool data_store_attach(void){
+    bool success;
+
+    if(__atomic_load_n(&backend.attached, __ATOMIC_ACQUIRE)){
+        return backend.success;
+    }
+
+    pthread_mutex_lock(&backend.mutex);
+    if(!backend.attached){
+        if(!handoff_wait_drained()){
+            log_msg(LOG_ERR, "Handoff of the storage failed, opening it anew");
+        }
+        backend.success = server_config.storage->init(server_config.data_path);
+        // a cold start returns the error, a deferred one stops serving
+        if(!backend.success && handoff_storage_ready_fd() != -1){
+            log_msg(LOG_ERR, "Storage unavailable after the handoff, shutting down");
+            kill(getpid(), SIGTERM);
+        }
+        __atomic_store_n(&backend.attached, true, __ATOMIC_RELEASE);
+    }
+    success = backend.success;
+    pthread_mutex_unlock(&backend.mutex);
+
+    return success;
+}
+
+bool data_store_attached(void){
+    return __atomic_load_n(&backend.attached, __ATOMIC_ACQUIRE) && backend.success;
+}
+
+int data_store_pending_fd(void){
+    if(__atomic_load_n(&backend.attached, __ATOMIC_ACQUIRE)){
+        return -1;
+    }
+    return handoff_storage_ready_fd();
+}
+
+void data_store_cleanup(void){
+    storage_stats_t stats;
+
+    // a predecessor that never drained keeps its storage
+    if(!__atomic_load_n(&backend.attached, __ATOMIC_ACQUIRE)){
+        pthread_cond_destroy(&commit_group.arrived);
+        return;
+    }
+
+    server_config.storage->stats(&stats);
+    log_msg(LOG_INFO, "Storage %s: %lld bytes stored, capacity %lld", server_config.storage->name,
+        (long long) stats.length, (long long) stats.capacity);
+    server_config.storage->cleanup();
+    pthread_cond_destroy(&commit_group.arrived);
+}
+
+int data_store_open(void){
+    if(!data_store_attach()){
+        return -1;
+    }
+    return server_config.storage->open();
+}
+
+void data_store_close(int data_fd){
+    server_config.storage->close(data_fd);
+}
+
+/**
+ * Captures everything stored after cursor and prepares the header with the
+ * cursor the client has to send next time.
+ */
+static bool snapshot_capture_from(int data_fd, off_t cursor, data_snapshot_t *snapshot){
+    off_t new_cursor;
+
+    if(!server_config.storage->readback_from(data_fd, cursor, snapshot, &new_cursor)){
+        return false;
+    }
+
+    snapshot->header_len = format_cursor_header(snapshot->header, sizeof(snapshot->header), new_cursor);
+    return true;
+}
+
+/**
+ * Captures the readback from position on, -1 captures the full readback.
+ */
+static bool snapshot_capture_at(int data_fd, off_t position, data_snapshot_t *snapshot){
+    if(position == -1){
+        return server_config.storage->readback(data_fd, snapshot);
+    }
+    return server_config.storage->readback_range(data_fd, position, UINT64_MAX, snapshot);
+}
+
+/**
+ * Captures the part of the storage range covers. A range the storage
+ * cannot resolve leaves located cleared and is answered with nothing.
+ * @return false when the readback could not be captured
+ */
+static bool snapshot_capture_range(int data_fd, const aesd_range_t *range, data_snapshot_t *snapshot, bool *located){
+    off_t start;
+    off_t end;
+
+    *located = server_config.storage->locate(data_fd, range, &start, &end);
+    if(!*located){
+        log_msg(LOG_ERR, "Range cannot be resolved by %s storage", server_config.storage->name);
+        return true;
+    }
+    return server_config.storage->readback_range(data_fd, start, (uint64_t)(end - start), snapshot);
+}
+
+void data_commit_init(data_commit_t *commit, int data_fd, const char *packet, size_t packet_len, bool framed, data_snapshot_t *snapshot){
+    memset(commit, 0, sizeof(*commit));
+    commit->data_fd = data_fd;
+    commit->packet = packet;
+    commit->packet_len = packet_len;
+    commit->framed = framed;
+    commit->snapshot = snapshot;
+}
+
+/**
+ * @return bytes of the captured content still to be sent after the header
+ */
+static size_t snapshot_remaining(const data_snapshot_t *snapshot){
+    return snapshot->pipe_len + (size_t)(snapshot->length - snapshot->position);
+}
+
+/**
+ * Sets the part of a frame that is appended, only appends carry data.
+ */
+static void frame_parse(data_commit_t *commit){
+    frame_header_t header;
+
+    frame_header_parse(commit->packet, &header);
+    if(header.opcode == FRAME_OP_APPEND){
+        commit->payload = commit->packet + FRAME_HEADER_LEN;
+        commit->payload_len = commit->packet_len - FRAME_HEADER_LEN;
+    }
+}
+
+/**
+ * Executes the request of a frame and prepares the answer frame, whose
+ * header goes ahead of the captured content.
+ * @return false when the readback could not be captured
+ */
+static bool frame_capture(const data_commit_t *commit){
+    const storage_backend_t *storage = server_config.storage;
+    data_snapshot_t *snapshot = commit->snapshot;
+    const char *payload = commit->packet + FRAME_HEADER_LEN;
+    size_t payload_len = commit->packet_len - FRAME_HEADER_LEN;
+    frame_header_t header;
+    uint8_t request_flags;
+    size_t extra_len = 0;
+    bool success = true;
+
+    frame_header_parse(commit->packet, &header);
+    request_flags = header.flags;
+    header.flags = 0;
+
+    switch(header.opcode){
+    case FRAME_OP_APPEND:
+        if(!(request_flags & FRAME_FLAG_NO_READBACK)){
+            success = storage->readback(commit->data_fd, snapshot);
+        }
+        break;
+    case FRAME_OP_SEEKTO:
+        if(payload_len == 8){
+            struct aesd_seekto seekto = {
+                .write_cmd = frame_get_u32(payload),
+                .write_cmd_offset = frame_get_u32(payload + 4)
+            };
+            off_t position;
+            if(storage->seek(commit->data_fd, &seekto, &position)){
+                success = snapshot_capture_at(commit->data_fd, position, snapshot);
+            } else {
+                header.flags = FRAME_FLAG_ERROR;
+            }
+        } else {
+            header.flags = FRAME_FLAG_ERROR;
+        }
+        break;
+    case FRAME_OP_READ:
+        if(payload_len == 16 && frame_get_u64(payload) <= INT64_MAX){
+            success = storage->readback_range(commit->data_fd, (off_t) frame_get_u64(payload), frame_get_u64(payload + 8), snapshot);
+        } else {
+            header.flags = FRAME_FLAG_ERROR;
+        }
+        break;
+    case FRAME_OP_READ_PACKETS:
+        if(payload_len == 16){
+            aesd_range_t range = {
+                .packets = true,
+                .first = (int64_t) frame_get_u64(payload),
+                .last = (int64_t) frame_get_u64(payload + 8)
+            };
+            bool located;
+            success = snapshot_capture_range(commit->data_fd, &range, snapshot, &located);
+            if(!located){
+                header.flags = FRAME_FLAG_ERROR;
+            }
+        } else {
+            header.flags = FRAME_FLAG_ERROR;
+        }
+        break;
+    case FRAME_OP_STATS:
+        {
+            storage_stats_t stats;
+
+            storage->stats(&stats);
+            frame_put_u64(snapshot->header + FRAME_HEADER_LEN, (uint64_t) stats.length);
+            frame_put_u64(snapshot->header + FRAME_HEADER_LEN + 8, (uint64_t) stats.capacity);
+            extra_len = 16;
+        }
+        break;
+    default:
+        header.flags = FRAME_FLAG_ERROR;
+        break;
+    }
+
+    if(!success){
+        return false;
+    }
+
+    // answers obey the limit of requests, so the length always fits the header
+    if(extra_len + snapshot_remaining(snapshot) > FRAME_MAX_PAYLOAD){
+        snapshot->length = snapshot->position + (off_t)(FRAME_MAX_PAYLOAD - extra_len - snapshot->pipe_len);
+        header.flags |= FRAME_FLAG_TRUNCATED;
+    }
+    header.length = (uint32_t)(extra_len + snapshot_remaining(snapshot));
+    frame_header_format(snapshot->header, &header);
+    snapshot->header_len = FRAME_HEADER_LEN + extra_len;
+    return true;
+}
+
+static bool is_binary_keyword(const char *packet, size_t packet_len){
+    return packet_len == AESD_BINARY_KEYWORD_LEN && memcmp(packet, AESD_BINARY_KEYWORD, AESD_BINARY_KEYWORD_LEN) == 0;
+}
+
+void data_store_commit_batch(pthread_mutex_t *mutex, data_commit_t *commits){
+    struct iovec iov[DATA_STORE_MAX_BATCH];
+    int count = 0;
+    bool appended = true;
+    uint64_t wait_start;
+    uint64_t hold_start;
+    int res;
+
+    for(data_commit_t *commit = commits; commit != NULL; commit = commit->next){
+        if(commit->snapshot != NULL){
+            data_snapshot_init(commit->snapshot);
+        }
+        commit->success = false;
+
+        if(commit->framed){
+            frame_parse(commit);
+        } else if(is_binary_keyword(commit->packet, commit->packet_len)){
+            commit->payload_len = 0;
+        } else if(parse_cursor_command(commit->packet, commit->packet_len, &commit->cursor, &commit->payload, &commit->payload_len)){
+            log_msg(LOG_DEBUG, "Received cursor %lld", (long long) commit->cursor);
+            commit->has_cursor = true;
+        } else if(parse_range_command(commit->packet, commit->packet_len, &commit->range)){
+            commit->has_range = true;
+        } else if(storage_is_seekto(commit->packet, commit->packet_len)){
+            commit->payload_len = 0;
+        } else {
+            commit->payload = commit->packet;
+            commit->payload_len = commit->packet_len;
+        }
+    }
+
+    wait_start = metrics_now();
+    res = pthread_mutex_lock(mutex);
+    if(res != 0){
+        log_msg(LOG_ERR, "pthread_mutex_lock error: %d", res);
+        return;
+    }
+    hold_start = metrics_now();
+    metrics_record(METRIC_LOCK_WAIT, hold_start - wait_start);
+
+    for(data_commit_t *commit = commits; commit != NULL && appended; commit = commit->next){
+        metrics_add(METRIC_PACKETS, 1);
+        if(commit->payload_len > 0){
+            iov[count].iov_base = (void *) commit->payload;
+            iov[count].iov_len = commit->payload_len;
+            count++;
+        }
+        if(count == DATA_STORE_MAX_BATCH || (commit->next == NULL && count > 0)){
+            uint64_t append_start = metrics_now();
+            appended = server_config.storage->appendv(commits->data_fd, iov, count);
+            metrics_record_since(METRIC_APPEND, append_start);
+            log_msg(LOG_DEBUG, "Committed %d packets", count);
+            count = 0;
+        }
+    }
+
+    // every snapshot covers the whole batch, including the client's own packet
+    for(data_commit_t *commit = commits; commit != NULL && appended; commit = commit->next){
+        if(commit->snapshot == NULL){
+            commit->success = true;
+        } else if(commit->framed){
+            commit->success = frame_capture(commit);
+        } else if(is_binary_keyword(commit->packet, commit->packet_len)){
+            log_msg(LOG_DEBUG, "Switching to binary framing");
+            memcpy(commit->snapshot->header, AESD_BINARY_KEYWORD, AESD_BINARY_KEYWORD_LEN);
+            commit->snapshot->header_len = AESD_BINARY_KEYWORD_LEN;
+            commit->snapshot->framing = true;
+            commit->success = true;
+        } else if(commit->has_cursor){
+            commit->success = snapshot_capture_from(commit->data_fd, commit->cursor, commit->snapshot);
+        } else if(commit->has_range){
+            bool located;
+            commit->success = snapshot_capture_range(commit->data_fd, &commit->range, commit->snapshot, &located);
+        } else {
+            off_t position = -1;
+
+            // a seekto target that does not exist leaves the full readback
+            if(storage_is_seekto(commit->packet, commit->packet_len)){
+                storage_seekto(commit->data_fd, commit->packet, commit->packet_len, &position);
+            }
+            commit->success = snapshot_capture_at(commit->data_fd, position, commit->snapshot);
+        }
+
+        if(!commit->success){
+            data_snapshot_release(commit->snapshot);
+        }
+    }
+
+    pthread_mutex_unlock(mutex);
+    metrics_record_since(METRIC_LOCK_HOLD, hold_start);
+}
+
+/**
+ * Detaches up to DATA_STORE_MAX_BATCH queued packets, with group sync after
+ * waiting for the group window to fill. Called with commit_group.mutex held.
+ */
+static data_commit_t *commit_group_take(void){
+    data_commit_t *batch = commit_group.head;
+    data_commit_t *last = batch;
+
+    if(server_config.sync_mode == SYNC_MODE_GROUP){
+        struct timespec now;
+        long waited_us = 0;
+
+        // the window closes early once a slice passes without new packets
+        while(waited_us < DATA_STORE_GROUP_WINDOW_US && commit_group.count < DATA_STORE_MAX_BATCH
+            && commit_group.bytes < DATA_STORE_GROUP_MAX_BYTES){
+            size_t count = commit_group.count;
+            struct timespec deadline;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            deadline = now;
+            deadline.tv_nsec += DATA_STORE_GROUP_SLICE_US * 1000L;
+            if(deadline.tv_nsec >= 1000000000L){
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+
+            if(pthread_cond_timedwait(&commit_group.arrived, &commit_group.mutex, &deadline) == ETIMEDOUT
+                && commit_group.count == count){
+                break;
+            }
+            waited_us += DATA_STORE_GROUP_SLICE_US;
+        }
+        batch = commit_group.head;
+        last = batch;
+    }
+
+    for(size_t i = 1; i < DATA_STORE_MAX_BATCH && last->next != NULL; i++){
+        last = last->next;
+    }
+
+    commit_group.head = last->next;
+    if(commit_group.head == NULL){
+        commit_group.tail = NULL;
+    }
+    last->next = NULL;
+
+    for(data_commit_t *commit = batch; commit != NULL; commit = commit->next){
+        commit_group.count--;
+        commit_group.bytes -= commit->packet_len;
+    }
+
+    return batch;
+}
+
+bool data_store_commit(int data_fd, pthread_mutex_t *mutex, const char *packet, size_t packet_len, bool framed, data_snapshot_t *snapshot){
+    data_commit_t commit;
+
+    data_commit_init(&commit, data_fd, packet, packet_len, framed, snapshot);
+    admission_append_begin(packet_len);
+
+    pthread_mutex_lock(&commit_group.mutex);
+
+    if(commit_group.tail != NULL){
+        commit_group.tail->next = &commit;
+    } else {
+        commit_group.head = &commit;
+    }
+    commit_group.tail = &commit;
+    commit_group.count++;
+    commit_group.bytes += packet_len;
+    pthread_cond_signal(&commit_group.arrived);
+
+    while(!commit.done){
+        data_commit_t *batch;
+
+        if(commit_group.leader_active){
+            pthread_cond_wait(&commit_group.committed, &commit_group.mutex);
+            continue;
+        }
+
+        // nobody is committing, so this thread commits for everyone queued
+        commit_group.leader_active = true;
+        batch = commit_group_take();
+        pthread_mutex_unlock(&commit_group.mutex);
+
+        data_store_commit_batch(mutex, batch);
+
+        pthread_mutex_lock(&commit_group.mutex);
+        // the waiting threads own these entries, they are only touched with the group mutex held
+        while(batch != NULL){
+            data_commit_t *next = batch->next;
+            batch->done = true;
+            batch = next;
+        }
+        commit_group.leader_active = false;
+        pthread_cond_broadcast(&commit_group.committed);
+    }
+
+    pthread_mutex_unlock(&commit_group.mutex);
+    admission_append_end(packet_len);
+
+    return commit.success;
+}
+
+static int send_result(const char *what){
+    if(errno == EAGAIN || errno == EWOULDBLOCK){
+        return 0;
+    }
+    log_msg(LOG_ERR, "%s error: %s", what, strerror(errno));
+    return -1;
+}
+
+/**
+ * Sends the captured content up to end that is not taken from the mirror,
+ * resuming a chunk that was copied out before.
+ * @return 1 when everything up to end was sent, 0 when the socket would block, -1 on error
+ */
+static int snapshot_send_file(data_snapshot_t *snapshot, int client_fd, off_t end){
+    while(snapshot->data_fd != -1 && !snapshot->copy_fallback && snapshot->position < end){
+        ssize_t res = sendfile(client_fd, snapshot->data_fd, &snapshot->position, end - snapshot->position);
+        if(res == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno == EINVAL || errno == ENOSYS){
+                log_msg(LOG_DEBUG, "sendfile refused, falling back to copying");
+                snapshot->copy_fallback = true;
+                break;
+            }
+            return send_result("sendfile");
+        }
+        if(res == 0){
+            log_msg(LOG_ERR, "Data file shorter than committed length");
+            return -1;
+        }
+        log_msg(LOG_DEBUG, "Sent %zd bytes", res);
+        metrics_add(METRIC_BYTES_OUT, res);
+    }
+
+    while(true){
+        if(snapshot->chunk_offset < snapshot->chunk_len){
+            ssize_t res = send(client_fd, snapshot->chunk + snapshot->chunk_offset, snapshot->chunk_len - snapshot->chunk_offset, MSG_NOSIGNAL);
+            if(res == -1){
+                if(errno == EINTR){
+                    continue;
+                }
+                return send_result("send");
+            }
+            snapshot->chunk_offset += res;
+            metrics_add(METRIC_BYTES_OUT, res);
+            continue;
+        }
+
+        if(snapshot->buffer != NULL && snapshot->position < end){
+            ssize_t res = send(client_fd, snapshot->buffer + snapshot->position, end - snapshot->position, MSG_NOSIGNAL);
+            if(res == -1){
+                if(errno == EINTR){
+                    continue;
+                }
+                return send_result("send");
+            }
+            snapshot->position += res;
+            metrics_add(METRIC_BYTES_OUT, res);
+            continue;
+        }
+
+        if(snapshot->data_fd == -1 || snapshot->position >= end){
+            return 1;
+        }
+
+        size_t to_read = sizeof(snapshot->chunk);
+        if((off_t) to_read > end - snapshot->position){
+            to_read = end - snapshot->position;
+        }
+
+        ssize_t res = pread(snapshot->data_fd, snapshot->chunk, to_read, snapshot->position);
+        if(res == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            log_msg(LOG_ERR, "pread error: %s", strerror(errno));
+            return -1;
+        }
+        if(res == 0){
+            log_msg(LOG_ERR, "Data file shorter than committed length");
+            return -1;
+        }
+
+        log_msg(LOG_DEBUG, "Sending %zd bytes", res);
+        snapshot->position += res;
+        snapshot->chunk_len = res;
+        snapshot->chunk_offset = 0;
+    }
+}
+
+int data_snapshot_send(data_snapshot_t *snapshot, int client_fd){
+    int result;
+
+    while(snapshot->header_sent < snapshot->header_len){
+        ssize_t res = send(client_fd, snapshot->header + snapshot->header_sent, snapshot->header_len - snapshot->header_sent, MSG_NOSIGNAL | MSG_MORE);
+        if(res == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return send_result("send");
+        }
+        snapshot->header_sent += res;
+        metrics_add(METRIC_BYTES_OUT, res);
+    }
+
+    while(snapshot->pipe_len > 0){
+        ssize_t res = splice(snapshot->pipe_fds[0], NULL, client_fd, NULL, snapshot->pipe_len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(res == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return send_result("splice");
+        }
+        snapshot->pipe_len -= res;
+        metrics_add(METRIC_BYTES_OUT, res);
+    }
+
+    // content the mirror dropped already goes out ahead of the mirrored part
+    if(snapshot->peek != NULL && (snapshot->position < snapshot->peek_start || snapshot->chunk_offset < snapshot->chunk_len)){
+        result = snapshot_send_file(snapshot, client_fd, snapshot->peek_start < snapshot->length ? snapshot->peek_start : snapshot->length);
+        if(result != 1){
+            return result;
+        }
+    }
+
+    while(snapshot->peek != NULL && snapshot->position < snapshot->length){
+        const char *data;
+        size_t available = snapshot->peek(snapshot->position, &data);
+        if(available == 0){
+            break;
+        }
+        if((off_t) available > snapshot->length - snapshot->position){
+            available = snapshot->length - snapshot->position;
+        }
+
+        ssize_t res = send(client_fd, data, available, MSG_NOSIGNAL);
+        if(res == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return send_result("send");
+        }
+        snapshot->position += res;
+        metrics_add(METRIC_BYTES_OUT, res);
+    }
+
+    // whatever is not mirrored is sent straight from the file
+    result = snapshot_send_file(snapshot, client_fd, snapshot->length);
+    if(result == 1){
+        log_msg(LOG_INFO, "Data sent to client");
+    }
+    return result;
+}
+
+void data_snapshot_init(data_snapshot_t *snapshot){
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->data_fd = -1;
+    snapshot->pipe_fds[0] = -1;
+    snapshot->pipe_fds[1] = -1;
+}
+
+void data_snapshot_release(data_snapshot_t *snapshot){
+    for(int i = 0; i < 2; i++){
+        if(snapshot->pipe_fds[i] != -1){
+            close(snapshot->pipe_fds[i]);
+            snapshot->pipe_fds[i] = -1;
+        }
+    }
+    snapshot->pipe_len = 0;
+    snapshot->header_len = 0;
+    snapshot->header_sent = 0;
+    snapshot->copy_fallback = false;
+    snapshot->peek = NULL;
+    snapshot->framing = false;
+    if(snapshot->unpin != NULL){
+        snapshot->unpin(snapshot->pin);
+        snapshot->unpin = NULL;
+    }
+    free(snapshot->buffer);
+    snapshot->buffer = NULL;
+    snapshot->data_fd = -1;
+    snapshot->position = 0;
+    snapshot->length = 0;
+    snapshot->chunk_len = 0;
+    snapshot->chunk_offset = 0;
+}
@@ -0,0 +1,187 @@
+#ifndef DATA_STORE_H
+#define DATA_STORE_H
+
+#include "aesdsocket.h"
+
+#define SNAPSHOT_PIPE_SIZE      (1024 * 1024)
+/**
+ * Most packets appended by one group commit
+ */
+#define DATA_STORE_MAX_BATCH    64
+/**
+ * With group sync the commit leader waits up to this long for more packets,
+ * unless DATA_STORE_GROUP_MAX_BYTES are already queued or a whole slice
+ * passes without a new one
+ */
+#define DATA_STORE_GROUP_WINDOW_US  1000
+#define DATA_STORE_GROUP_SLICE_US   100
+#define DATA_STORE_GROUP_MAX_BYTES  (256 * 1024)
+
+/**
+ * What a client gets back after its packet was committed. It is captured
+ * while holding the data mutex and sent afterwards without any lock.
+ */
+typedef struct data_snapshot{
+    /**
+     * Sent ahead of the data, carries the new cursor of incremental readbacks
+     */
+    char header[AESD_CURSOR_HEADER_LEN];
+    size_t header_len;
+    size_t header_sent;
+    /**
+     * Set when the snapshot is served from memory the storage keeps mapped,
+     * returns the contiguous bytes at offset like data_log_peek()
+     */
+    size_t (*peek)(off_t offset, const char **data);
+    /**
+     * Offsets before it are not mirrored and sent from data_fd ahead of
+     * the peeked part
+     */
+    off_t peek_start;
+    /**
+     * Handed back to unpin() on release, keeps what the snapshot references
+     * from being reclaimed by the storage while it is sent
+     */
+    void (*unpin)(off_t pin);
+    off_t pin;
+    /**
+     * Descriptor of the data log file, the part of the snapshot past the
+     * mirror is sent from it. -1 when there is no file or the content was
+     * captured into the pipe or buffer instead
+     */
+    int data_fd;
+    /**
+     * Next offset to send and the committed length of the log at commit time
+     */
+    off_t position;
+    off_t length;
+    /**
+     * Set once sendfile() was refused and the copy loop has to be used
+     */
+    bool copy_fallback;
+    /**
+     * Set when the packet switched the connection to binary framing, the
+     * caller splits what it receives next into frames
+     */
+    bool framing;
+    /**
+     * Char device content spliced into a pipe while the mutex was held, the
+     * pipe is drained into the socket with splice() afterwards
+     */
+    int pipe_fds[2];
+    size_t pipe_len;
+    /**
+     * Char device content copied out when splicing is refused or the pipe is full
+     */
+    char *buffer;
+    /**
+     * Chunk currently being pushed to the socket
+     */
+    char chunk[RECV_BUFFER_LEN];
+    size_t chunk_len;
+    size_t chunk_offset;
+} data_snapshot_t;
+
+/**
+ * One packet taking part in a group commit, see data_store_commit_batch().
+ */
+typedef struct data_commit{
+    int data_fd;
+    const char *packet;
+    size_t packet_len;
+    /**
+     * The packet is a frame, see frame.h, and carries no text commands
+     */
+    bool framed;
+    data_snapshot_t *snapshot;
+    bool success;
+    /**
+     * Filled in by the commit: the part of the packet that is appended and
+     * the cursor of an incremental readback
+     */
+    const char *payload;
+    size_t payload_len;
+    bool has_cursor;
+    off_t cursor;
+    /**
+     * Set for a ranged read, which appends nothing
+     */
+    bool has_range;
+    aesd_range_t range;
+    /**
+     * Set by the leader that committed this packet on behalf of its thread
+     */
+    bool done;
+    struct data_commit *next;
+} data_commit_t;
+
+/**
+ * Prepares the configured storage backend at the configured data path.
+ * While a predecessor still drains, the backend is prepared only once
+ * its storage was handed over, see data_store_attach().
+ */
+bool data_store_init(void);
+void data_store_cleanup(void);
+
+/**
+ * Prepares the backend deferred by data_store_init(), waiting for the
+ * predecessor when needed. A backend that cannot be prepared shuts the
+ * server down.
+ * @return true once the backend is ready
+ */
+bool data_store_attach(void);
+
+/**
+ * @return true once the backend was prepared successfully
+ */
+bool data_store_attached(void);
+
+/**
+ * Readable once data_store_attach() no longer waits, -1 when it never has
+ * to. Event loops park their packets meanwhile instead of blocking.
+ */
+int data_store_pending_fd(void);
+
+/**
+ * Storage handle a connection appends through, see storage_backend_t.
+ * Waits for data_store_attach() first.
+ * @return handle or -1 on error
+ */
+int data_store_open(void);
+void data_store_close(int data_fd);
+
+/**
+ * Appends packet to the data file, or applies the seekto command it carries,
+ * and captures the readback snapshot. A cursor command appends its payload
+ * and limits the snapshot to what follows the client's cursor, a ranged
+ * read only captures the range it asks for. A framed
+ * packet is executed according to its opcode and answered with a frame. The mutex is
+ * only held for the append and the snapshot itself.
+ * Concurrent callers are grouped: whichever thread finds no commit in
+ * progress becomes the leader and appends the packets of all waiting
+ * threads at once, the others sleep until their packet was committed.
+ * A NULL snapshot only appends, for writers that expect no readback.
+ * @return true on success
+ */
+bool data_store_commit(int data_fd, pthread_mutex_t *mutex, const char *packet, size_t packet_len, bool framed, data_snapshot_t *snapshot);
+
+void data_commit_init(data_commit_t *commit, int data_fd, const char *packet, size_t packet_len, bool framed, data_snapshot_t *snapshot);
+
+/**
+ * Appends the packets of the list with one writev() and syncs them
+ * according to server_config.sync_mode, then captures every snapshot. For
+ * callers that collect packets themselves, the outcome of each packet is
+ * left in its success flag.
+ */
+void data_store_commit_batch(pthread_mutex_t *mutex, data_commit_t *commits);
+
+/**
+ * Sends the snapshot, resuming where the previous call stopped.
+ * @return 1 when everything was sent, 0 when the socket would block, -1 on error
+ */
+int data_snapshot_send(data_snapshot_t *snapshot, int client_fd);
+
+void data_snapshot_init(data_snapshot_t *snapshot);
+void data_snapshot_release(data_snapshot_t *snapshot);
+
+#endif // DATA_STORE_H
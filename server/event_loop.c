@@ -0,0 +1,489 @@
+#define _GNU_SOURCE
+#include "event_loop.h"
+#include "admission.h"
+#include "handoff.h"
+#include "metrics.h"
+#include "object_cache.h"
+#include "ticker.h"
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+/**
+ * One loop per listener thread, so the loop state is thread local
+ */
+static __thread int epoll_fd = -1;
+static __thread pthread_mutex_t *data_mutex = NULL;
+static __thread event_connection_t *idle_head = NULL;
+static __thread event_connection_t *idle_tail = NULL;
+static __thread event_connection_t *commit_batch[DATA_STORE_MAX_BATCH];
+static __thread size_t commit_count = 0;
+/**
+ * Set when accepting stopped because of overload, the listener's edge was consumed
+ */
+static __thread bool accept_paused = false;
+/**
+ * Set once a successor took over the listener, the loop ends with the last connection
+ */
+static __thread bool draining = false;
+/**
+ * Addresses tagging the ticker's and the handoff's epoll entries
+ */
+static char ticker_tag;
+static char drain_tag;
+static char storage_tag;
+static object_cache_t connection_cache = OBJECT_CACHE_INITIALIZER("connection", sizeof(event_connection_t), OBJECT_CACHE_DEPOT_DEFAULT);
+
+static time_t monotonic_seconds(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+static void idle_list_remove(event_connection_t *conn){
+    if(conn->idle_prev != NULL){
+        conn->idle_prev->idle_next = conn->idle_next;
+    } else if(idle_head == conn){
+        idle_head = conn->idle_next;
+    }
+    if(conn->idle_next != NULL){
+        conn->idle_next->idle_prev = conn->idle_prev;
+    } else if(idle_tail == conn){
+        idle_tail = conn->idle_prev;
+    }
+    conn->idle_prev = NULL;
+    conn->idle_next = NULL;
+}
+
+static void idle_list_touch(event_connection_t *conn){
+    idle_list_remove(conn);
+    conn->last_active = monotonic_seconds();
+    conn->idle_prev = idle_tail;
+    if(idle_tail != NULL){
+        idle_tail->idle_next = conn;
+    } else {
+        idle_head = conn;
+    }
+    idle_tail = conn;
+}
+
+static int set_nonblocking(int fd){
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags == -1){
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void connection_close(event_connection_t *conn){
+    log_msg(LOG_INFO, "Closed connection from %s", conn->addr_str);
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+    metrics_record_since(METRIC_CONNECTION, conn->accepted_at);
+
+    idle_list_remove(conn);
+
+    data_store_close(conn->data_fd);
+    if(conn->client_fd != -1){
+        // closing the descriptor also drops it from the epoll interest list
+        close(conn->client_fd);
+    }
+    data_snapshot_release(&conn->snapshot);
+    recv_buffer_free(&conn->recv_buffer);
+    admission_release();
+    object_cache_free(&connection_cache, conn);
+}
+
+static void accept_connections(int listen_fd){
+    while(true){
+        struct sockaddr_storage client_addr;
+        struct epoll_event ev = {0};
+        event_connection_t *conn = NULL;
+        int client_fd;
+
+        if(admission_paused()){
+            accept_paused = true;
+            return;
+        }
+
+        client_fd = accept4(listen_fd, (struct sockaddr *)&client_addr, &(socklen_t){sizeof(client_addr)}, SOCK_NONBLOCK);
+        if(client_fd == -1){
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                log_msg(LOG_ERR, "accept error: %s", strerror(errno));
+            }
+            return;
+        }
+
+        if(!admission_admit(client_fd)){
+            continue;
+        }
+
+        conn = (event_connection_t *) object_cache_alloc(&connection_cache);
+        if(conn == NULL){
+            log_msg(LOG_ERR, "Error allocating memory for connection: %s", strerror(errno));
+            close(client_fd);
+            admission_release();
+            continue;
+        }
+        memset(conn, 0, sizeof(*conn));
+
+        conn->client_fd = client_fd;
+        conn->data_fd = -1;
+        conn->accepted_at = metrics_now();
+        conn->first_byte_pending = conn->accepted_at;
+        metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+        data_snapshot_init(&conn->snapshot);
+        recv_buffer_init(&conn->recv_buffer);
+        idle_list_touch(conn);
+        conn->state = CONNECTION_STATE_RECEIVING;
+
+        inet_ntop(client_addr.ss_family, get_in_addr((struct sockaddr *)&client_addr), conn->addr_str, sizeof(conn->addr_str));
+
+        log_msg(LOG_INFO, "Accepted connection from %s", conn->addr_str);
+
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1){
+            log_msg(LOG_ERR, "epoll_ctl error: %s", strerror(errno));
+            connection_close(conn);
+        }
+    }
+}
+
+/**
+ * Receives until a complete packet is buffered.
+ * @return true when conn->packet holds the next packet, false when the socket has no more data for now
+ */
+static bool connection_receive(event_connection_t *conn){
+    while(true){
+        size_t available;
+        ssize_t res;
+        char *space;
+
+        if(recv_buffer_next_packet(&conn->recv_buffer, &conn->packet, &conn->packet_len)){
+            log_msg(LOG_DEBUG, "Newline detected. Packet fully received");
+            return true;
+        }
+
+        space = recv_buffer_reserve(&conn->recv_buffer, RECV_BUFFER_LEN, &available);
+        if(space == NULL){
+            if(conn->recv_buffer.oversized){
+                log_msg(LOG_ERR, "Packet exceeds the maximum length, closing connection");
+            } else {
+                log_msg(LOG_ERR, "Error allocating memory for packet");
+            }
+            conn->state = CONNECTION_STATE_CLOSING;
+            return false;
+        }
+
+        res = recv(conn->client_fd, space, available, 0);
+        if(res > 0){
+            log_msg(LOG_DEBUG, "Received %zd bytes", res);
+            recv_buffer_commit(&conn->recv_buffer, res);
+            metrics_add(METRIC_BYTES_IN, res);
+            metrics_record_since(METRIC_FIRST_BYTE, conn->first_byte_pending);
+            conn->first_byte_pending = 0;
+        } else if(res == 0){
+            log_msg(LOG_INFO, "Connection closed by client");
+            // a packet only counts once its newline arrived, the rest is dropped
+            if(recv_buffer_pending(&conn->recv_buffer) > 0){
+                log_msg(LOG_INFO, "Discarding %zu bytes of an unterminated packet", recv_buffer_pending(&conn->recv_buffer));
+            }
+            conn->state = CONNECTION_STATE_CLOSING;
+            return false;
+        } else if(errno == EINTR){
+            continue;
+        } else {
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                log_msg(LOG_ERR, "recv error: %s", strerror(errno));
+                conn->state = CONNECTION_STATE_CLOSING;
+            }
+            return false;
+        }
+    }
+}
+
+static void connection_append(event_connection_t *conn){
+    if(data_store_pending_fd() != -1){
+        conn->state = CONNECTION_STATE_WAITING_STORAGE;
+        return;
+    }
+
+    if(conn->data_fd == -1){
+        conn->data_fd = data_store_open();
+        if(conn->data_fd == -1){
+            conn->state = CONNECTION_STATE_CLOSING;
+            return;
+        }
+    }
+
+    data_commit_init(&conn->commit, conn->data_fd, conn->packet, conn->packet_len, conn->recv_buffer.framing, &conn->snapshot);
+    admission_append_begin(conn->packet_len);
+    commit_batch[commit_count++] = conn;
+    conn->state = CONNECTION_STATE_COMMITTING;
+}
+
+static void connection_advance(event_connection_t *conn);
+
+/**
+ * Commits the packets collected from all connections with a single append
+ * and continues each connection with its readback. Connections continuing
+ * with a pipelined packet queue it for the next flush.
+ */
+static void commit_flush(void){
+    event_connection_t *batch[DATA_STORE_MAX_BATCH];
+    size_t count = commit_count;
+
+    if(count == 0){
+        return;
+    }
+
+    memcpy(batch, commit_batch, count * sizeof(batch[0]));
+    commit_count = 0;
+
+    for(size_t i = 0; i < count; i++){
+        batch[i]->commit.next = i + 1 < count ? &batch[i + 1]->commit : NULL;
+    }
+
+    data_store_commit_batch(data_mutex, &batch[0]->commit);
+
+    for(size_t i = 0; i < count; i++){
+        event_connection_t *conn = batch[i];
+        admission_append_end(conn->packet_len);
+        conn->state = conn->commit.success ? CONNECTION_STATE_READING_BACK : CONNECTION_STATE_CLOSING;
+        conn->readback_start = metrics_now();
+        connection_advance(conn);
+    }
+}
+
+static void connection_advance(event_connection_t *conn){
+    while(true){
+        switch(conn->state){
+        case CONNECTION_STATE_RECEIVING:
+            if(!connection_receive(conn)){
+                if(conn->state == CONNECTION_STATE_CLOSING){
+                    break;
+                }
+                return;
+            }
+            conn->state = CONNECTION_STATE_APPENDING;
+            break;
+        case CONNECTION_STATE_APPENDING:
+            connection_append(conn);
+            break;
+        case CONNECTION_STATE_COMMITTING:
+        case CONNECTION_STATE_WAITING_STORAGE:
+            return;
+        case CONNECTION_STATE_READING_BACK:
+            switch(data_snapshot_send(&conn->snapshot, conn->client_fd)){
+            case 0:
+                return;
+            case 1:
+                metrics_record_since(METRIC_READBACK, conn->readback_start);
+                if(conn->snapshot.framing){
+                    recv_buffer_set_framing(&conn->recv_buffer);
+                }
+                data_snapshot_release(&conn->snapshot);
+                // framed connections carry several requests, they always stay open
+                conn->state = server_config.persistent || conn->recv_buffer.framing ? CONNECTION_STATE_RECEIVING : CONNECTION_STATE_CLOSING;
+                break;
+            default:
+                conn->state = CONNECTION_STATE_CLOSING;
+                break;
+            }
+            break;
+        case CONNECTION_STATE_CLOSING:
+            connection_close(conn);
+            return;
+        }
+    }
+}
+
+/**
+ * Appends the packets parked until the storage was handed over, in batches
+ * like the packets of a round of events.
+ */
+static void storage_resume(void){
+    bool again = true;
+
+    data_store_attach();
+
+    while(again){
+        event_connection_t *next;
+
+        again = false;
+        for(event_connection_t *conn = idle_head; conn != NULL; conn = next){
+            next = conn->idle_next;
+            if(conn->state != CONNECTION_STATE_WAITING_STORAGE){
+                continue;
+            }
+            conn->state = CONNECTION_STATE_APPENDING;
+            connection_advance(conn);
+            // the flush may close connections, so the walk starts over after it
+            if(commit_count == DATA_STORE_MAX_BATCH){
+                again = true;
+                break;
+            }
+        }
+
+        while(commit_count > 0){
+            commit_flush();
+        }
+    }
+}
+
+int event_loop_run(int listen_fd, int timer_fd, pthread_mutex_t *file_mutex){
+    struct epoll_event ev = {0};
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    int return_val = 0;
+
+    data_mutex = file_mutex;
+
+    if(set_nonblocking(listen_fd) == -1){
+        log_msg(LOG_ERR, "fcntl error: %s", strerror(errno));
+        return -1;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_fd == -1){
+        log_msg(LOG_ERR, "epoll_create1 error: %s", strerror(errno));
+        return -1;
+    }
+
+    // listener is tagged with a NULL pointer, every other entry is an event_connection_t
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1){
+        log_msg(LOG_ERR, "epoll_ctl error: %s", strerror(errno));
+        return_val = -1;
+        goto event_loop_exit;
+    }
+
+    if(timer_fd != -1){
+        ev.events = EPOLLIN;
+        ev.data.ptr = &ticker_tag;
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) == -1){
+            log_msg(LOG_ERR, "epoll_ctl error: %s", strerror(errno));
+            return_val = -1;
+            goto event_loop_exit;
+        }
+    }
+
+    // never read, so the loop of every listener notices
+    if(handoff_drain_fd() != -1){
+        ev.events = EPOLLIN;
+        ev.data.ptr = &drain_tag;
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handoff_drain_fd(), &ev) == -1){
+            log_msg(LOG_ERR, "epoll_ctl error: %s", strerror(errno));
+            return_val = -1;
+            goto event_loop_exit;
+        }
+    }
+
+    // packets wait for the storage of a predecessor still draining, connections do not
+    if(data_store_pending_fd() != -1){
+        ev.events = EPOLLIN;
+        ev.data.ptr = &storage_tag;
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, data_store_pending_fd(), &ev) == -1){
+            log_msg(LOG_ERR, "epoll_ctl error: %s", strerror(errno));
+            return_val = -1;
+            goto event_loop_exit;
+        }
+    }
+
+    log_msg(LOG_INFO, "Event loop started");
+
+    while(is_active && !(draining && idle_head == NULL)){
+        int timeout = server_config.persistent ? EVENT_LOOP_IDLE_CHECK_MS : -1;
+        int nfds;
+
+        if(accept_paused){
+            timeout = ADMISSION_RETRY_MS;
+        }
+
+        nfds = epoll_wait(epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+        if(nfds == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            log_msg(LOG_ERR, "epoll_wait error: %s", strerror(errno));
+            return_val = -1;
+            break;
+        }
+
+        for(int i = 0; i < nfds; i++){
+            event_connection_t *conn = (event_connection_t *) events[i].data.ptr;
+
+            if(conn == NULL){
+                if(!draining){
+                    accept_connections(listen_fd);
+                }
+                continue;
+            }
+            if(events[i].data.ptr == &ticker_tag){
+                ticker_expired(data_mutex);
+                continue;
+            }
+            if(events[i].data.ptr == &storage_tag){
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, handoff_storage_ready_fd(), NULL);
+                storage_resume();
+                continue;
+            }
+            if(events[i].data.ptr == &drain_tag){
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, NULL);
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, handoff_drain_fd(), NULL);
+                draining = true;
+                log_msg(LOG_INFO, "Event loop draining its connections");
+                continue;
+            }
+
+            idle_list_touch(conn);
+
+            // a queued packet is still referenced by the batch, the send after the flush reports the error
+            if(conn->state == CONNECTION_STATE_COMMITTING || conn->state == CONNECTION_STATE_WAITING_STORAGE){
+                continue;
+            }
+
+            if(events[i].events & EPOLLERR){
+                conn->state = CONNECTION_STATE_CLOSING;
+            }
+
+            connection_advance(conn);
+
+            if(commit_count == DATA_STORE_MAX_BATCH){
+                while(commit_count > 0){
+                    commit_flush();
+                }
+            }
+        }
+
+        while(commit_count > 0){
+            commit_flush();
+        }
+
+        // no new edge arrives for clients already waiting in the backlog
+        if(accept_paused && !draining){
+            accept_paused = false;
+            accept_connections(listen_fd);
+        }
+
+        if(server_config.persistent){
+            time_t now = monotonic_seconds();
+            while(idle_head != NULL && now - idle_head->last_active >= server_config.idle_timeout_sec){
+                log_msg(LOG_INFO, "Idle timeout expired");
+                connection_close(idle_head);
+            }
+        }
+    }
+
+    while(idle_head != NULL){
+        connection_close(idle_head);
+    }
+
+    log_msg(LOG_INFO, "Event loop stopped");
+
+event_loop_exit:
+    draining = false;
+    close(epoll_fd);
+    epoll_fd = -1;
+    return return_val;
+}
@@ -0,0 +1,64 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "aesdsocket.h"
+#include "data_store.h"
+#include "recv_buffer.h"
+
+#define EVENT_LOOP_MAX_EVENTS   64
+#define EVENT_LOOP_IDLE_CHECK_MS    1000
+
+typedef enum connection_state{
+    CONNECTION_STATE_RECEIVING,
+    CONNECTION_STATE_APPENDING,
+    /**
+     * Packet waits in the loop's batch, which is committed once the current
+     * round of events was handled
+     */
+    CONNECTION_STATE_COMMITTING,
+    /**
+     * Packet waits until the predecessor handed the storage over
+     */
+    CONNECTION_STATE_WAITING_STORAGE,
+    CONNECTION_STATE_READING_BACK,
+    CONNECTION_STATE_CLOSING
+} connection_state_t;
+
+typedef struct event_connection{
+    int client_fd;
+    int data_fd;
+    connection_state_t state;
+    char addr_str[INET6_ADDRSTRLEN];
+    recv_buffer_t recv_buffer;
+    /**
+     * Packet handed out by recv_buffer, valid until the next receive
+     */
+    const char *packet;
+    size_t packet_len;
+    data_snapshot_t snapshot;
+    data_commit_t commit;
+    /**
+     * Metrics timestamps, first_byte_pending is cleared once data arrived
+     */
+    uint64_t accepted_at;
+    uint64_t first_byte_pending;
+    uint64_t readback_start;
+    /**
+     * Connections ordered by last activity, the idle timeout expires them from the head
+     */
+    time_t last_active;
+    struct event_connection *idle_prev;
+    struct event_connection *idle_next;
+} event_connection_t;
+
+/**
+ * Runs an edge-triggered epoll reactor on the already listening socket until
+ * is_active is cleared, or once a successor took over the listener and
+ * the last connection closed. Every accepted client is driven through
+ * connection_state_t by the single loop thread. A timer_fd other than -1
+ * is the ticker, which the loop serves between its connections.
+ * @return 0 on clean shutdown, -1 on setup error
+ */
+int event_loop_run(int listen_fd, int timer_fd, pthread_mutex_t *file_mutex);
+
+#endif // EVENT_LOOP_H
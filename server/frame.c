@@ -0,0 +1,38 @@
+#include "frame.h"
+#include <arpa/inet.h>
+#include <string.h>
+
+uint32_t frame_get_u32(const char *data){
+    uint32_t value;
+
+    memcpy(&value, data, sizeof(value));
+    return ntohl(value);
+}
+
+uint64_t frame_get_u64(const char *data){
+    return ((uint64_t) frame_get_u32(data) << 32) | frame_get_u32(data + 4);
+}
+
+void frame_put_u64(char *data, uint64_t value){
+    uint32_t high = htonl((uint32_t)(value >> 32));
+    uint32_t low = htonl((uint32_t) value);
+
+    memcpy(data, &high, sizeof(high));
+    memcpy(data + 4, &low, sizeof(low));
+}
+
+void frame_header_parse(const char *data, frame_header_t *header){
+    header->length = frame_get_u32(data);
+    header->opcode = (uint8_t) data[4];
+    header->flags = (uint8_t) data[5];
+}
+
+void frame_header_format(char *data, const frame_header_t *header){
+    uint32_t length = htonl(header->length);
+
+    memcpy(data, &length, sizeof(length));
+    data[4] = (char) header->opcode;
+    data[5] = (char) header->flags;
+    data[6] = 0;
+    data[7] = 0;
+}
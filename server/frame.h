@@ -0,0 +1,90 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Binary framing, switched on per connection by sending AESD_BINARY_KEYWORD
+ * as a text packet. The server answers with the same line and every byte
+ * after it is a frame: a FRAME_HEADER_LEN byte header, then length payload
+ * bytes. All integers are in network byte order.
+ *   0  uint32 length
+ *   4  uint8  opcode
+ *   5  uint8  flags
+ *   6  uint16 reserved, 0
+ * Each request frame is answered with one frame carrying the same opcode.
+ */
+#define AESD_BINARY_KEYWORD     "AESDBINARY\n"
+#define AESD_BINARY_KEYWORD_LEN (sizeof(AESD_BINARY_KEYWORD) - 1)
+
+#define FRAME_HEADER_LEN        8
+/**
+ * Larger frames close the connection
+ */
+#define FRAME_MAX_PAYLOAD       (64 * 1024 * 1024)
+
+typedef enum frame_opcode{
+    /**
+     * Payload is appended as is, the answer carries the full readback
+     */
+    FRAME_OP_APPEND = 1,
+    /**
+     * Payload is uint32 write_cmd and uint32 write_cmd_offset, the answer
+     * carries the readback from the new position
+     */
+    FRAME_OP_SEEKTO = 2,
+    /**
+     * Payload is uint64 offset and uint64 length, the answer carries at
+     * most length bytes stored from offset on
+     */
+    FRAME_OP_READ = 3,
+    /**
+     * No payload, the answer carries int64 stored bytes and int64 capacity,
+     * -1 when unknown
+     */
+    FRAME_OP_STATS = 4,
+    /**
+     * Payload is int64 first and int64 last packet, see AESD_PACKETS_KEYWORD,
+     * the answer carries the packets [first, last)
+     */
+    FRAME_OP_READ_PACKETS = 5
+} frame_opcode_t;
+
+/**
+ * Request flag of FRAME_OP_APPEND: answer with an empty frame instead of
+ * the readback
+ */
+#define FRAME_FLAG_NO_READBACK  0x01
+/**
+ * Answer flag: the content was cut after FRAME_MAX_PAYLOAD bytes, the rest
+ * is fetched with FRAME_OP_READ from where this answer ended
+ */
+#define FRAME_FLAG_TRUNCATED    0x02
+/**
+ * Answer flag: the request was malformed or failed, the payload is empty
+ */
+#define FRAME_FLAG_ERROR        0x80
+
+typedef struct frame_header{
+    uint32_t length;
+    uint8_t opcode;
+    uint8_t flags;
+} frame_header_t;
+
+/**
+ * Decodes the header at the start of data, which holds at least FRAME_HEADER_LEN bytes.
+ */
+void frame_header_parse(const char *data, frame_header_t *header);
+
+/**
+ * Encodes header into FRAME_HEADER_LEN bytes at data.
+ */
+void frame_header_format(char *data, const frame_header_t *header);
+
+uint32_t frame_get_u32(const char *data);
+uint64_t frame_get_u64(const char *data);
+void frame_put_u64(char *data, uint64_t value);
+
+#endif // FRAME_H
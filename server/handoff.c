@@ -0,0 +1,391 @@
+#define _GNU_SOURCE
+#include "handoff.h"
+#include "async_log.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static pthread_t handoff_thread;
+static bool handoff_running = false;
+static int server_fd = -1;
+static char server_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+static int drain_fd = -1;
+static bool successor_active = false;
+/**
+ * Connection to the successor, kept until the storage was handed over
+ */
+static int successor_fd = -1;
+/**
+ * Connection to the predecessor, kept until it drained
+ */
+static int predecessor_fd = -1;
+/**
+ * Receives the storage descriptors while the successor already serves,
+ * storage_ready_fd is written once they arrived or the handoff failed
+ */
+static pthread_t takeover_thread;
+static bool takeover_running = false;
+static int storage_ready_fd = -1;
+static bool storage_received = false;
+static int listeners[HANDOFF_MAX_FDS];
+static size_t listener_count = 0;
+static int storage_fds[HANDOFF_MAX_FDS];
+static size_t storage_count = 0;
+
+static bool send_fds(int fd, handoff_kind_t kind, const int *fds, size_t count){
+    handoff_msg_t msg = { .kind = kind, .count = (uint32_t) count };
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+    struct msghdr hdr = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    if(count > 0){
+        struct cmsghdr *cmsg;
+
+        memset(control, 0, sizeof(control));
+        hdr.msg_control = control;
+        hdr.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+        cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    }
+
+    while(sendmsg(fd, &hdr, MSG_NOSIGNAL) == -1){
+        if(errno != EINTR){
+            log_msg(LOG_ERR, "sendmsg error: %s", strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Receives a message of kind, descriptors beyond size are closed.
+ */
+static bool recv_fds(int fd, handoff_kind_t kind, int *fds, size_t size, size_t *count){
+    handoff_msg_t msg;
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+    struct msghdr hdr = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control)
+    };
+    ssize_t res;
+
+    *count = 0;
+    while((res = recvmsg(fd, &hdr, MSG_CMSG_CLOEXEC)) == -1){
+        if(errno != EINTR){
+            log_msg(LOG_ERR, "recvmsg error: %s", strerror(errno));
+            return false;
+        }
+    }
+
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&hdr, cmsg)){
+        size_t received;
+        int *data;
+
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS){
+            continue;
+        }
+        received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        data = (int *) CMSG_DATA(cmsg);
+        for(size_t i = 0; i < received; i++){
+            if(*count < size){
+                fds[(*count)++] = data[i];
+            } else {
+                close(data[i]);
+            }
+        }
+    }
+
+    if(res != sizeof(msg) || msg.kind != kind || msg.count != *count){
+        log_msg(LOG_ERR, "Unexpected handoff message");
+        for(size_t i = 0; i < *count; i++){
+            close(fds[i]);
+        }
+        *count = 0;
+        return false;
+    }
+    return true;
+}
+
+static void *takeover_thread_main(void *arg){
+    (void) arg;
+
+    storage_received = recv_fds(predecessor_fd, HANDOFF_STORAGE, storage_fds, HANDOFF_MAX_FDS, &storage_count);
+    if(eventfd_write(storage_ready_fd, 1) == -1){
+        log_msg(LOG_ERR, "eventfd_write error: %s", strerror(errno));
+    }
+    return NULL;
+}
+
+bool handoff_receive(const char *path, int *listen_fds, size_t size, size_t *count){
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+    int res;
+
+    *count = 0;
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        log_msg(LOG_ERR, "Handoff socket path too long: %s", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1){
+        log_msg(LOG_ERR, "socket error: %s", strerror(errno));
+        return false;
+    }
+
+    if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1){
+        int connect_errno = errno;
+
+        close(fd);
+        // nothing serves the path, or only a socket left behind by a crash
+        if(connect_errno == ENOENT || connect_errno == ECONNREFUSED){
+            log_msg(LOG_INFO, "No server to take over at %s, starting cold", path);
+            return true;
+        }
+        log_msg(LOG_ERR, "connect error: %s", strerror(connect_errno));
+        return false;
+    }
+
+    if(!recv_fds(fd, HANDOFF_LISTENERS, listen_fds, size, count)){
+        close(fd);
+        return false;
+    }
+
+    predecessor_fd = fd;
+    storage_ready_fd = eventfd(0, EFD_CLOEXEC);
+    if(storage_ready_fd == -1){
+        log_msg(LOG_ERR, "eventfd error: %s", strerror(errno));
+        goto receive_error;
+    }
+
+    // the storage follows once the predecessor drained, serving starts right away
+    takeover_running = true;
+    res = pthread_create(&takeover_thread, NULL, takeover_thread_main, NULL);
+    if(res != 0){
+        log_msg(LOG_ERR, "pthread_create error: %d", res);
+        takeover_running = false;
+        goto receive_error;
+    }
+
+    log_msg(LOG_INFO, "Took over %zu listening sockets", *count);
+    return true;
+
+receive_error:
+    for(size_t i = 0; i < *count; i++){
+        close(listen_fds[i]);
+    }
+    *count = 0;
+    if(storage_ready_fd != -1){
+        close(storage_ready_fd);
+        storage_ready_fd = -1;
+    }
+    close(predecessor_fd);
+    predecessor_fd = -1;
+    return false;
+}
+
+int handoff_storage_ready_fd(void){
+    return storage_ready_fd;
+}
+
+/**
+ * Joins the takeover thread, which has to be done or woken up already.
+ */
+static void takeover_join(void){
+    if(!takeover_running){
+        return;
+    }
+
+    pthread_join(takeover_thread, NULL);
+    takeover_running = false;
+    close(predecessor_fd);
+    predecessor_fd = -1;
+}
+
+bool handoff_wait_drained(void){
+    struct pollfd pfd = { .fd = storage_ready_fd, .events = POLLIN };
+
+    if(!takeover_running){
+        return storage_ready_fd == -1 || storage_received;
+    }
+
+    log_msg(LOG_INFO, "Waiting for the predecessor to drain its connections");
+    while(poll(&pfd, 1, -1) == -1 && errno == EINTR);
+    takeover_join();
+
+    if(storage_received){
+        log_msg(LOG_INFO, "Predecessor drained, took over %zu storage descriptors", storage_count);
+    }
+    return storage_received;
+}
+
+int handoff_storage_fd(size_t index){
+    int fd;
+
+    if(index >= storage_count){
+        return -1;
+    }
+    fd = storage_fds[index];
+    storage_fds[index] = -1;
+    return fd;
+}
+
+static void *handoff_thread_main(void *arg){
+    (void) arg;
+
+    while(__atomic_load_n(&handoff_running, __ATOMIC_ACQUIRE)){
+        struct pollfd pfd = { .fd = server_fd, .events = POLLIN };
+        int client_fd;
+
+        // woken up regularly to notice handoff_stop()
+        if(poll(&pfd, 1, 500) <= 0){
+            continue;
+        }
+
+        client_fd = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC);
+        if(client_fd == -1){
+            if(errno != EINTR && errno != EAGAIN){
+                log_msg(LOG_ERR, "accept error: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        if(!send_fds(client_fd, HANDOFF_LISTENERS, listeners, listener_count)){
+            close(client_fd);
+            continue;
+        }
+
+        log_msg(LOG_INFO, "Successor took over the listening sockets, draining connections");
+        successor_fd = client_fd;
+        __atomic_store_n(&successor_active, true, __ATOMIC_RELEASE);
+        if(eventfd_write(drain_fd, 1) == -1){
+            log_msg(LOG_ERR, "eventfd_write error: %s", strerror(errno));
+        }
+        break;
+    }
+
+    return NULL;
+}
+
+bool handoff_serve(const char *path, const int *listen_fds, size_t count){
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int res;
+
+    if(strlen(path) >= sizeof(addr.sun_path) || count > HANDOFF_MAX_FDS){
+        log_msg(LOG_ERR, "Invalid handoff socket: %s", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(server_path, path);
+    memcpy(listeners, listen_fds, sizeof(int) * count);
+    listener_count = count;
+
+    drain_fd = eventfd(0, EFD_CLOEXEC);
+    if(drain_fd == -1){
+        log_msg(LOG_ERR, "eventfd error: %s", strerror(errno));
+        return false;
+    }
+
+    server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(server_fd == -1){
+        log_msg(LOG_ERR, "socket error: %s", strerror(errno));
+        goto serve_error;
+    }
+
+    // the predecessor's socket, or one left behind by a crash
+    unlink(path);
+
+    if(bind(server_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1){
+        log_msg(LOG_ERR, "bind error: %s", strerror(errno));
+        goto serve_error;
+    }
+
+    if(listen(server_fd, HANDOFF_BACKLOG) == -1){
+        log_msg(LOG_ERR, "listen error: %s", strerror(errno));
+        goto serve_error;
+    }
+
+    handoff_running = true;
+    res = pthread_create(&handoff_thread, NULL, handoff_thread_main, NULL);
+    if(res != 0){
+        log_msg(LOG_ERR, "pthread_create error: %d", res);
+        handoff_running = false;
+        goto serve_error;
+    }
+
+    log_msg(LOG_INFO, "Serving handoff on %s", path);
+    return true;
+
+serve_error:
+    if(server_fd != -1){
+        close(server_fd);
+        server_fd = -1;
+        unlink(path);
+    }
+    close(drain_fd);
+    drain_fd = -1;
+    return false;
+}
+
+void handoff_stop(const int *fds, size_t count){
+    // a predecessor still draining keeps its storage, recvmsg() returns on shutdown
+    if(takeover_running){
+        shutdown(predecessor_fd, SHUT_RDWR);
+        takeover_join();
+    }
+    if(storage_ready_fd != -1){
+        close(storage_ready_fd);
+        storage_ready_fd = -1;
+    }
+
+    if(server_fd == -1){
+        goto stop_storage;
+    }
+
+    __atomic_store_n(&handoff_running, false, __ATOMIC_RELEASE);
+    pthread_join(handoff_thread, NULL);
+
+    if(successor_fd != -1){
+        if(send_fds(successor_fd, HANDOFF_STORAGE, fds, count)){
+            log_msg(LOG_INFO, "Handed %zu storage descriptors to the successor", count);
+        }
+        close(successor_fd);
+        successor_fd = -1;
+    } else {
+        unlink(server_path);
+    }
+
+    close(server_fd);
+    server_fd = -1;
+    close(drain_fd);
+    drain_fd = -1;
+
+stop_storage:
+    // descriptors the storage of this process did not adopt
+    for(size_t i = 0; i < storage_count; i++){
+        if(storage_fds[i] != -1){
+            close(storage_fds[i]);
+        }
+    }
+    storage_count = 0;
+}
+
+int handoff_drain_fd(void){
+    return drain_fd;
+}
+
+bool handoff_done(void){
+    return __atomic_load_n(&successor_active, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,87 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Zero-downtime restart. A server started with a handoff path asks the
+ * predecessor serving that path for its listening sockets, which never
+ * close, so clients keep queueing in their backlog instead of being
+ * refused. The successor serves them right away, while the predecessor
+ * stops accepting, drains its connections and passes the descriptors of
+ * its storage before it exits, which the successor adopts instead of
+ * opening the storage anew. All descriptors travel as SCM_RIGHTS over the
+ * UNIX socket at the handoff path.
+ */
+#define HANDOFF_MAX_FDS         64
+#define HANDOFF_BACKLOG         1
+
+typedef enum handoff_kind{
+    HANDOFF_LISTENERS = 1,
+    HANDOFF_STORAGE = 2
+} handoff_kind_t;
+
+/**
+ * Sent ahead of the descriptors of each message
+ */
+typedef struct handoff_msg{
+    uint32_t kind;
+    uint32_t count;
+} handoff_msg_t;
+
+/**
+ * Takes over the listening sockets of a predecessor serving path and
+ * receives its storage descriptors from a thread of its own. Without a
+ * predecessor, count is 0 and the server starts cold.
+ * @return false when a predecessor answered but the handoff failed
+ */
+bool handoff_receive(const char *path, int *listen_fds, size_t size, size_t *count);
+
+/**
+ * Readable once the storage descriptors of the predecessor arrived or
+ * their handoff failed, -1 after a cold start. Never read, so every loop
+ * polling it notices.
+ */
+int handoff_storage_ready_fd(void);
+
+/**
+ * Waits until the predecessor drained its connections and took in its
+ * storage descriptors, returns right away after a cold start.
+ * @return false when the storage descriptors did not arrive
+ */
+bool handoff_wait_drained(void);
+
+/**
+ * @return storage descriptor index of the predecessor, -1 when there is
+ * none. Ownership moves to the caller.
+ */
+int handoff_storage_fd(size_t index);
+
+/**
+ * Offers the listening sockets to a successor connecting to path, from a
+ * thread of its own.
+ */
+bool handoff_serve(const char *path, const int *listen_fds, size_t count);
+
+/**
+ * Hands the storage descriptors to a successor that took over, then stops
+ * serving path. The path is left to the successor.
+ */
+void handoff_stop(const int *storage_fds, size_t count);
+
+/**
+ * Readable once a successor took over the listening sockets and this
+ * process has to drain, -1 while not serving. Never read, so every loop
+ * polling it notices.
+ */
+int handoff_drain_fd(void);
+
+/**
+ * @return true once a successor took over, the storage is then left in
+ * place for it
+ */
+bool handoff_done(void);
+
+#endif // HANDOFF_H
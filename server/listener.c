@@ -0,0 +1,54 @@
+#define _GNU_SOURCE
+#include "listener.h"
+#include "async_log.h"
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <unistd.h>
+
+int listener_open(const struct addrinfo *addr, bool reuseport){
+    int fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if(fd == -1){
+        log_msg(LOG_ERR, "socket error: %s", strerror(errno));
+        return -1;
+    }
+
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) == -1){
+        log_msg(LOG_ERR, "setsockopt error: %s", strerror(errno));
+        goto listener_open_error;
+    }
+
+    if(reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) == -1){
+        log_msg(LOG_ERR, "setsockopt error: %s", strerror(errno));
+        goto listener_open_error;
+    }
+
+    if(bind(fd, addr->ai_addr, addr->ai_addrlen) == -1){
+        log_msg(LOG_ERR, "bind error: %s", strerror(errno));
+        goto listener_open_error;
+    }
+
+    return fd;
+
+listener_open_error:
+    close(fd);
+    return -1;
+}
+
+bool listener_pin_thread(pthread_t thread, size_t cpu){
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    int res;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpus > 0 ? cpu % (size_t) cpus : 0, &set);
+
+    res = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if(res != 0){
+        log_msg(LOG_ERR, "pthread_setaffinity_np error: %d", res);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,24 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define LISTEN_BACKLOG_DEFAULT  20
+#define LISTENER_MAX_SHARDS     64
+
+/**
+ * Creates a socket bound to addr. With reuseport several sockets can bind
+ * the same port and the kernel spreads new connections across them.
+ * @return the socket or -1 on error
+ */
+int listener_open(const struct addrinfo *addr, bool reuseport);
+
+/**
+ * Restricts thread to one CPU, wrapping around the online CPUs.
+ */
+bool listener_pin_thread(pthread_t thread, size_t cpu);
+
+#endif // LISTENER_H
@@ -0,0 +1,27 @@
+#!/bin/bash
+# Runs aesdload through a fixed set of scenarios against an aesdsocket that
+# is already listening, started with -k so connections can be reused.
+# Readbacks grow with the data file, so start every server build from an
+# empty one. Every result line is prefixed with its scenario, so the output
+# of two builds can be compared line by line:
+#   ./load-bench.sh > before.txt; ... ; ./load-bench.sh > after.txt
+#   paste before.txt after.txt
+# Usage: ./load-bench.sh [duration_sec] [host]
+set -e
+
+cd `dirname $0`
+duration=${1:-10}
+host=${2:-127.0.0.1}
+
+make tools >/dev/null
+
+run_scenario() {
+    name=$1
+    shift
+    ./aesdload -h ${host} -d ${duration} "$@" | sed "s/^/${name}_/"
+}
+
+run_scenario small_close -c 8 -s 64
+run_scenario mixed_close -c 8 -s 16:4096
+run_scenario small_reuse -c 32 -s 64 -r 1000
+run_scenario large_reuse -c 8 -s 65536 -r 100
@@ -0,0 +1,404 @@
+#include "metrics.h"
+#include "async_log.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *counter_names[METRIC_COUNTER_COUNT] = {
+    "connections_accepted",
+    "connections_closed",
+    "packets",
+    "bytes_in",
+    "bytes_out",
+    "connections_shed",
+    "accept_pauses"
+};
+
+static const char *histogram_names[METRIC_HISTOGRAM_COUNT] = {
+    "first_byte_ns",
+    "lock_wait_ns",
+    "lock_hold_ns",
+    "append_ns",
+    "readback_ns",
+    "connection_ns"
+};
+
+/**
+ * Every shard ever created. Shards are only prepended and never unlinked,
+ * a thread that exits leaves its shard behind for the next thread to claim,
+ * so its counts stay in the totals and neither side takes a lock
+ */
+static metrics_shard_t *shards = NULL;
+static size_t threads_alive = 0;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static __thread metrics_shard_t *local_shard = NULL;
+
+static pthread_t admin_thread;
+static int admin_fd = -1;
+static bool admin_running = false;
+static char admin_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+static uint64_t load(const uint64_t *value){
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Single writer, so a plain add published with a relaxed store is enough.
+ */
+static void store_add(uint64_t *value, uint64_t add){
+    __atomic_store_n(value, *value + add, __ATOMIC_RELAXED);
+}
+
+void metrics_histogram_merge(metrics_histogram_t *into, const metrics_histogram_t *from){
+    uint64_t max = load(&from->max);
+
+    into->count += load(&from->count);
+    into->sum += load(&from->sum);
+    if(max > into->max){
+        into->max = max;
+    }
+    for(size_t i = 0; i < METRICS_BUCKETS; i++){
+        into->buckets[i] += load(&from->buckets[i]);
+    }
+}
+
+static void shard_merge(metrics_shard_t *into, const metrics_shard_t *from){
+    for(size_t i = 0; i < METRIC_COUNTER_COUNT; i++){
+        into->counters[i] += load(&from->counters[i]);
+    }
+
+    for(size_t i = 0; i < METRIC_HISTOGRAM_COUNT; i++){
+        metrics_histogram_merge(&into->histograms[i], &from->histograms[i]);
+    }
+}
+
+static void shard_retire(void *data){
+    metrics_shard_t *shard = (metrics_shard_t *) data;
+
+    __atomic_sub_fetch(&threads_alive, 1, __ATOMIC_RELAXED);
+    // publishes the counts of this thread to the one claiming the shard next
+    __atomic_store_n(&shard->owned, false, __ATOMIC_RELEASE);
+}
+
+static void key_create(void){
+    pthread_key_create(&shard_key, shard_retire);
+}
+
+/**
+ * @return a shard a retired thread left behind, NULL when all are owned
+ */
+static metrics_shard_t *shard_claim(void){
+    for(metrics_shard_t *shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next){
+        bool owned = false;
+
+        if(!__atomic_load_n(&shard->owned, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(&shard->owned, &owned, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            return shard;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @return the shard of the calling thread, claimed or created on first use,
+ * NULL when out of memory
+ */
+static metrics_shard_t *shard_get(void){
+    metrics_shard_t *shard = local_shard;
+
+    if(shard != NULL){
+        return shard;
+    }
+
+    pthread_once(&key_once, key_create);
+
+    shard = shard_claim();
+    if(shard == NULL){
+        shard = (metrics_shard_t *) calloc(1, sizeof(*shard));
+        if(shard == NULL){
+            return NULL;
+        }
+        shard->owned = true;
+        shard->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&shards, &shard->next, shard, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+        }
+    }
+    __atomic_add_fetch(&threads_alive, 1, __ATOMIC_RELAXED);
+
+    // the destructor hands the shard on once the thread exits
+    pthread_setspecific(shard_key, shard);
+    local_shard = shard;
+    return shard;
+}
+
+static size_t bucket_index(uint64_t value){
+    int shift;
+
+    if(value < METRICS_SUB_BUCKETS){
+        return value;
+    }
+
+    shift = 63 - __builtin_clzll(value) - METRICS_SUB_BUCKET_BITS;
+    return (shift + 1) * METRICS_SUB_BUCKETS + ((value >> shift) & (METRICS_SUB_BUCKETS - 1));
+}
+
+/**
+ * @return highest value falling into bucket index
+ */
+static uint64_t bucket_value(size_t index){
+    int shift;
+    uint64_t mantissa;
+
+    if(index < METRICS_SUB_BUCKETS){
+        return index;
+    }
+
+    shift = index / METRICS_SUB_BUCKETS - 1;
+    mantissa = (index % METRICS_SUB_BUCKETS) | METRICS_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+uint64_t metrics_histogram_percentile(const metrics_histogram_t *histogram, double percentile){
+    uint64_t target = (uint64_t)(histogram->count * percentile);
+    uint64_t seen = 0;
+
+    if(histogram->count == 0){
+        return 0;
+    }
+    if(target == 0){
+        target = 1;
+    }
+
+    for(size_t i = 0; i < METRICS_BUCKETS; i++){
+        seen += histogram->buckets[i];
+        if(seen >= target){
+            uint64_t value = bucket_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+void metrics_histogram_add(metrics_histogram_t *histogram, uint64_t value){
+    histogram->buckets[bucket_index(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+    if(value > histogram->max){
+        histogram->max = value;
+    }
+}
+
+uint64_t metrics_now(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void metrics_add(metric_counter_t counter, uint64_t value){
+    metrics_shard_t *shard = shard_get();
+
+    if(shard != NULL){
+        store_add(&shard->counters[counter], value);
+    }
+}
+
+void metrics_record(metric_histogram_t histogram, uint64_t value){
+    metrics_shard_t *shard = shard_get();
+    metrics_histogram_t *target;
+
+    if(shard == NULL){
+        return;
+    }
+
+    target = &shard->histograms[histogram];
+    store_add(&target->buckets[bucket_index(value)], 1);
+    store_add(&target->count, 1);
+    store_add(&target->sum, value);
+    if(value > target->max){
+        __atomic_store_n(&target->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_record_since(metric_histogram_t histogram, uint64_t start){
+    if(start != 0){
+        metrics_record(histogram, metrics_now() - start);
+    }
+}
+
+size_t metrics_format(char *buffer, size_t size){
+    static const struct {
+        const char *name;
+        double value;
+    } percentiles[] = {
+        { "p50", 0.5 },
+        { "p90", 0.9 },
+        { "p99", 0.99 },
+        { "p999", 0.999 }
+    };
+    metrics_shard_t *total = NULL;
+    size_t threads;
+    size_t len = 0;
+
+    total = (metrics_shard_t *) calloc(1, sizeof(*total));
+    if(total == NULL){
+        log_msg(LOG_ERR, "Error allocating memory for metrics report");
+        return 0;
+    }
+
+    for(metrics_shard_t *shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next){
+        shard_merge(total, shard);
+    }
+    threads = __atomic_load_n(&threads_alive, __ATOMIC_RELAXED);
+
+#define REPORT(...) do{ \
+        int res = snprintf(buffer + len, size - len, __VA_ARGS__); \
+        if(res < 0 || (size_t) res >= size - len){ \
+            len = size - 1; \
+            goto format_exit; \
+        } \
+        len += res; \
+    } while(0)
+
+    for(size_t i = 0; i < METRIC_COUNTER_COUNT; i++){
+        REPORT("%s %llu\n", counter_names[i], (unsigned long long) total->counters[i]);
+    }
+    REPORT("connections_open %llu\n", (unsigned long long)(total->counters[METRIC_CONNECTIONS_ACCEPTED] - total->counters[METRIC_CONNECTIONS_CLOSED]));
+    REPORT("threads_alive %zu\n", threads);
+
+    for(size_t i = 0; i < METRIC_HISTOGRAM_COUNT; i++){
+        const metrics_histogram_t *histogram = &total->histograms[i];
+
+        REPORT("%s_count %llu\n", histogram_names[i], (unsigned long long) histogram->count);
+        REPORT("%s_sum %llu\n", histogram_names[i], (unsigned long long) histogram->sum);
+        REPORT("%s_max %llu\n", histogram_names[i], (unsigned long long) histogram->max);
+        for(size_t j = 0; j < sizeof(percentiles) / sizeof(percentiles[0]); j++){
+            REPORT("%s_%s %llu\n", histogram_names[i], percentiles[j].name,
+                (unsigned long long) metrics_histogram_percentile(histogram, percentiles[j].value));
+        }
+    }
+
+#undef REPORT
+
+format_exit:
+    free(total);
+    return len;
+}
+
+static void *admin_thread_main(void *arg){
+    char *report = NULL;
+    (void) arg;
+
+    report = (char *) malloc(METRICS_REPORT_LEN);
+    if(report == NULL){
+        log_msg(LOG_ERR, "Error allocating memory for metrics report");
+        return NULL;
+    }
+
+    while(__atomic_load_n(&admin_running, __ATOMIC_ACQUIRE)){
+        struct pollfd pfd = { .fd = admin_fd, .events = POLLIN };
+        size_t len;
+        size_t sent = 0;
+        int client_fd;
+
+        // woken up regularly to notice metrics_admin_stop()
+        if(poll(&pfd, 1, 500) <= 0){
+            continue;
+        }
+
+        client_fd = accept(admin_fd, NULL, NULL);
+        if(client_fd == -1){
+            if(errno != EINTR && errno != EAGAIN){
+                log_msg(LOG_ERR, "accept error: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        len = metrics_format(report, METRICS_REPORT_LEN);
+        while(sent < len){
+            ssize_t res = send(client_fd, report + sent, len - sent, MSG_NOSIGNAL);
+            if(res == -1){
+                if(errno == EINTR){
+                    continue;
+                }
+                log_msg(LOG_ERR, "send error: %s", strerror(errno));
+                break;
+            }
+            sent += res;
+        }
+
+        close(client_fd);
+    }
+
+    free(report);
+    return NULL;
+}
+
+bool metrics_admin_start(const char *path){
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int res;
+
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        log_msg(LOG_ERR, "Admin socket path too long: %s", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(admin_path, path);
+
+    admin_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(admin_fd == -1){
+        log_msg(LOG_ERR, "socket error: %s", strerror(errno));
+        return false;
+    }
+
+    // a socket left behind by an earlier run would make bind fail
+    unlink(path);
+
+    if(bind(admin_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1){
+        log_msg(LOG_ERR, "bind error: %s", strerror(errno));
+        goto admin_start_error;
+    }
+
+    if(listen(admin_fd, METRICS_ADMIN_BACKLOG) == -1){
+        log_msg(LOG_ERR, "listen error: %s", strerror(errno));
+        goto admin_start_error;
+    }
+
+    admin_running = true;
+    res = pthread_create(&admin_thread, NULL, admin_thread_main, NULL);
+    if(res != 0){
+        log_msg(LOG_ERR, "pthread_create error: %d", res);
+        admin_running = false;
+        goto admin_start_error;
+    }
+
+    log_msg(LOG_INFO, "Serving metrics on %s", path);
+    return true;
+
+admin_start_error:
+    close(admin_fd);
+    admin_fd = -1;
+    unlink(path);
+    return false;
+}
+
+void metrics_admin_stop(void){
+    if(admin_fd == -1){
+        return;
+    }
+
+    __atomic_store_n(&admin_running, false, __ATOMIC_RELEASE);
+    pthread_join(admin_thread, NULL);
+
+    close(admin_fd);
+    admin_fd = -1;
+    unlink(admin_path);
+}
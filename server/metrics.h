@@ -0,0 +1,115 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Histogram buckets are log-linear like HDR histograms: every power of two
+ * is split into METRICS_SUB_BUCKETS linear buckets, which bounds the error
+ * of a reported value to 1/METRICS_SUB_BUCKETS
+ */
+#define METRICS_SUB_BUCKET_BITS 3
+#define METRICS_SUB_BUCKETS     (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_BUCKETS         ((64 - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS)
+#define METRICS_ADMIN_BACKLOG   4
+#define METRICS_REPORT_LEN      8192
+
+typedef enum metric_counter{
+    METRIC_CONNECTIONS_ACCEPTED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_PACKETS,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    /**
+     * Connections answered busy and closed, and times accepting was paused
+     */
+    METRIC_CONNECTIONS_SHED,
+    METRIC_ACCEPT_PAUSES,
+    METRIC_COUNTER_COUNT
+} metric_counter_t;
+
+typedef enum metric_histogram{
+    /**
+     * From accept() to the first received byte
+     */
+    METRIC_FIRST_BYTE,
+    /**
+     * Waiting for and holding the data mutex during a commit
+     */
+    METRIC_LOCK_WAIT,
+    METRIC_LOCK_HOLD,
+    /**
+     * Writing a commit to the data store, including a sync
+     */
+    METRIC_APPEND,
+    /**
+     * From the start of a readback until its last byte was sent
+     */
+    METRIC_READBACK,
+    /**
+     * From accept() until the connection was closed
+     */
+    METRIC_CONNECTION,
+    METRIC_HISTOGRAM_COUNT
+} metric_histogram_t;
+
+typedef struct metrics_histogram{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[METRICS_BUCKETS];
+} metrics_histogram_t;
+
+/**
+ * Counters of one thread. Only the owning thread writes them, readers
+ * aggregate all shards on demand, so recording never takes a lock. Once
+ * the thread exits the shard is handed to the next thread that starts.
+ */
+typedef struct metrics_shard{
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    metrics_histogram_t histograms[METRIC_HISTOGRAM_COUNT];
+    bool owned;
+    struct metrics_shard *next;
+} metrics_shard_t;
+
+/**
+ * Plain histogram helpers for data owned by a single thread.
+ */
+void metrics_histogram_add(metrics_histogram_t *histogram, uint64_t value);
+void metrics_histogram_merge(metrics_histogram_t *into, const metrics_histogram_t *from);
+
+/**
+ * @return upper bound of the bucket holding the given fraction of all values, 0 when empty
+ */
+uint64_t metrics_histogram_percentile(const metrics_histogram_t *histogram, double percentile);
+
+/**
+ * @return monotonic time in nanoseconds, the unit of every histogram
+ */
+uint64_t metrics_now(void);
+
+void metrics_add(metric_counter_t counter, uint64_t value);
+void metrics_record(metric_histogram_t histogram, uint64_t value);
+
+/**
+ * Records the time passed since start, a start of 0 is ignored.
+ */
+void metrics_record_since(metric_histogram_t histogram, uint64_t start);
+
+/**
+ * Aggregates all threads into "name value" lines.
+ * @return length of the report, truncated to size - 1
+ */
+size_t metrics_format(char *buffer, size_t size);
+
+/**
+ * Serves the report to every client connecting to the UNIX socket at path,
+ * from a thread of its own.
+ */
+bool metrics_admin_start(const char *path);
+void metrics_admin_stop(void);
+
+#endif // METRICS_H
@@ -0,0 +1,212 @@
+#include "object_cache.h"
+#include "async_log.h"
+#include <stdlib.h>
+
+typedef struct object_cache_local{
+    void *head;
+    size_t count;
+} object_cache_local_t;
+
+static __thread object_cache_local_t locals[OBJECT_CACHE_MAX_CACHES];
+static __thread bool thread_registered = false;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static object_cache_t *caches = NULL;
+static size_t cache_count = 0;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+
+/**
+ * Moves up to count objects from the front of local into the depot, the
+ * ones beyond depot_max go back to the heap.
+ */
+static void local_flush(object_cache_t *cache, object_cache_local_t *local, size_t count){
+    void *overflow = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    while(count-- > 0 && local->head != NULL){
+        void *object = local->head;
+
+        local->head = *(void **) object;
+        local->count--;
+        if(cache->depot_count < cache->depot_max){
+            *(void **) object = cache->depot;
+            cache->depot = object;
+            cache->depot_count++;
+        } else {
+            *(void **) object = overflow;
+            overflow = object;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    while(overflow != NULL){
+        void *object = overflow;
+
+        overflow = *(void **) object;
+        free(object);
+        __atomic_add_fetch(&cache->heap_frees, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void local_refill(object_cache_t *cache, object_cache_local_t *local){
+    pthread_mutex_lock(&cache->lock);
+    for(size_t i = 0; i < OBJECT_CACHE_BATCH && cache->depot != NULL; i++){
+        void *object = cache->depot;
+
+        cache->depot = *(void **) object;
+        cache->depot_count--;
+        *(void **) object = local->head;
+        local->head = object;
+        local->count++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Hands the free lists of an exiting thread to the depots.
+ */
+static void thread_exit(void *arg){
+    (void) arg;
+
+    pthread_mutex_lock(&registry_lock);
+    for(object_cache_t *cache = caches; cache != NULL; cache = cache->next){
+        object_cache_local_t *local = &locals[cache->slot - 1];
+        local_flush(cache, local, local->count);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void key_create(void){
+    if(pthread_key_create(&thread_key, thread_exit) != 0){
+        log_msg(LOG_ERR, "pthread_key_create error");
+    }
+}
+
+/**
+ * @return the calling thread's free list of cache, NULL when no slot is left
+ */
+static object_cache_local_t *local_get(object_cache_t *cache){
+    size_t slot = __atomic_load_n(&cache->slot, __ATOMIC_ACQUIRE);
+
+    if(slot == 0){
+        pthread_mutex_lock(&registry_lock);
+        slot = cache->slot;
+        if(slot == 0 && cache_count < OBJECT_CACHE_MAX_CACHES){
+            slot = ++cache_count;
+            cache->next = caches;
+            caches = cache;
+            __atomic_store_n(&cache->slot, slot, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&registry_lock);
+        if(slot == 0){
+            return NULL;
+        }
+    }
+
+    // the key's value only makes the destructor run when the thread exits
+    if(!thread_registered){
+        pthread_once(&key_once, key_create);
+        pthread_setspecific(thread_key, locals);
+        thread_registered = true;
+    }
+
+    return &locals[slot - 1];
+}
+
+void *object_cache_alloc(object_cache_t *cache){
+    object_cache_local_t *local = local_get(cache);
+    void *object = NULL;
+    size_t in_use;
+    size_t high_water;
+
+    if(local != NULL && local->head == NULL){
+        local_refill(cache, local);
+    }
+
+    if(local != NULL && local->head != NULL){
+        object = local->head;
+        local->head = *(void **) object;
+        local->count--;
+    } else {
+        object = malloc(cache->object_size);
+        if(object == NULL){
+            return NULL;
+        }
+        __atomic_add_fetch(&cache->heap_allocs, 1, __ATOMIC_RELAXED);
+    }
+
+    in_use = __atomic_add_fetch(&cache->in_use, 1, __ATOMIC_RELAXED);
+    high_water = __atomic_load_n(&cache->high_water, __ATOMIC_RELAXED);
+    while(in_use > high_water && !__atomic_compare_exchange_n(&cache->high_water, &high_water, in_use,
+        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return object;
+}
+
+void object_cache_free(object_cache_t *cache, void *object){
+    object_cache_local_t *local;
+
+    if(object == NULL){
+        return;
+    }
+
+    __atomic_sub_fetch(&cache->in_use, 1, __ATOMIC_RELAXED);
+
+    local = local_get(cache);
+    if(local == NULL){
+        free(object);
+        __atomic_add_fetch(&cache->heap_frees, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    *(void **) object = local->head;
+    local->head = object;
+    local->count++;
+
+    if(local->count > OBJECT_CACHE_LOCAL_MAX){
+        local_flush(cache, local, OBJECT_CACHE_BATCH);
+    }
+}
+
+void object_cache_get_stats(object_cache_t *cache, object_cache_stats_t *stats){
+    stats->in_use = __atomic_load_n(&cache->in_use, __ATOMIC_RELAXED);
+    stats->high_water = __atomic_load_n(&cache->high_water, __ATOMIC_RELAXED);
+    stats->heap_allocs = __atomic_load_n(&cache->heap_allocs, __ATOMIC_RELAXED);
+    stats->heap_frees = __atomic_load_n(&cache->heap_frees, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&cache->lock);
+    stats->cached = cache->depot_count;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void object_cache_log_stats(void){
+    pthread_mutex_lock(&registry_lock);
+    for(object_cache_t *cache = caches; cache != NULL; cache = cache->next){
+        object_cache_stats_t stats;
+
+        object_cache_get_stats(cache, &stats);
+        log_msg(LOG_INFO, "Object cache %s: in use %zu, high water %zu, cached %zu, heap allocs %lu, heap frees %lu",
+            cache->name, stats.in_use, stats.high_water, stats.cached, stats.heap_allocs, stats.heap_frees);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void object_cache_cleanup(void){
+    pthread_mutex_lock(&registry_lock);
+    for(object_cache_t *cache = caches; cache != NULL; cache = cache->next){
+        object_cache_local_t *local = &locals[cache->slot - 1];
+
+        local_flush(cache, local, local->count);
+
+        pthread_mutex_lock(&cache->lock);
+        while(cache->depot != NULL){
+            void *object = cache->depot;
+
+            cache->depot = *(void **) object;
+            free(object);
+        }
+        cache->depot_count = 0;
+        pthread_mutex_unlock(&cache->lock);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
@@ -0,0 +1,81 @@
+#ifndef OBJECT_CACHE_H
+#define OBJECT_CACHE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Free objects a thread keeps for itself, half of them are returned to the
+ * depot once it holds more
+ */
+#define OBJECT_CACHE_LOCAL_MAX  32
+#define OBJECT_CACHE_BATCH      (OBJECT_CACHE_LOCAL_MAX / 2)
+/**
+ * Caches that can be in use at once, each has a per-thread free list
+ */
+#define OBJECT_CACHE_MAX_CACHES 8
+#define OBJECT_CACHE_DEPOT_DEFAULT  1024
+
+/**
+ * Free-list allocator for objects of one size. Every thread allocates from
+ * and frees to a free list of its own and only exchanges batches of objects
+ * with the shared depot, so objects freed by another thread than the one
+ * that allocated them find their way back without a heap round trip. The
+ * depot keeps at most depot_max objects, the heap takes the rest back.
+ * Free objects are linked through their first bytes, object_size is at
+ * least a pointer.
+ */
+typedef struct object_cache{
+    const char *name;
+    size_t object_size;
+    size_t depot_max;
+    pthread_mutex_t lock;
+    void *depot;
+    size_t depot_count;
+    /**
+     * Index of the per-thread free list plus one, 0 until first used
+     */
+    size_t slot;
+    struct object_cache *next;
+    size_t in_use;
+    size_t high_water;
+    unsigned long heap_allocs;
+    unsigned long heap_frees;
+} object_cache_t;
+
+#define OBJECT_CACHE_INITIALIZER(cache_name, size, max) { \
+        .name = (cache_name), \
+        .object_size = (size) < sizeof(void *) ? sizeof(void *) : (size), \
+        .depot_max = (max), \
+        .lock = PTHREAD_MUTEX_INITIALIZER \
+    }
+
+typedef struct object_cache_stats{
+    size_t in_use;
+    size_t high_water;
+    size_t cached;
+    unsigned long heap_allocs;
+    unsigned long heap_frees;
+} object_cache_stats_t;
+
+/**
+ * @return an uninitialized object, NULL with errno set when the heap is exhausted
+ */
+void *object_cache_alloc(object_cache_t *cache);
+
+/**
+ * Returns object to the calling thread's free list, NULL is ignored.
+ */
+void object_cache_free(object_cache_t *cache, void *object);
+
+void object_cache_get_stats(object_cache_t *cache, object_cache_stats_t *stats);
+void object_cache_log_stats(void);
+
+/**
+ * Frees the objects in the depots and the calling thread's free lists.
+ * Threads that exited already returned theirs to the depots.
+ */
+void object_cache_cleanup(void);
+
+#endif // OBJECT_CACHE_H
@@ -0,0 +1,292 @@
+#include "packet_index.h"
+#include "async_log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static packet_index_t packet_index = {
+    .fd = -1
+};
+
+/**
+ * Makes room for the given number of entries behind the staged ones.
+ */
+static bool index_reserve(size_t entries){
+    size_t needed = packet_index.count + packet_index.staged + entries;
+    size_t capacity = packet_index.capacity > 0 ? packet_index.capacity : PACKET_INDEX_MIN_ENTRIES;
+    off_t *offsets;
+
+    if(needed <= packet_index.capacity){
+        return true;
+    }
+
+    while(capacity < needed){
+        capacity *= 2;
+    }
+
+    offsets = (off_t *) realloc(packet_index.offsets, capacity * sizeof(off_t));
+    if(offsets == NULL){
+        log_msg(LOG_ERR, "Error allocating memory for packet index");
+        return false;
+    }
+    packet_index.offsets = offsets;
+    packet_index.capacity = capacity;
+    return true;
+}
+
+static bool index_add(off_t offset){
+    if(!index_reserve(1)){
+        return false;
+    }
+    packet_index.offsets[packet_index.count++] = offset;
+    return true;
+}
+
+/**
+ * Appends the committed entries from from on to the index file. The file
+ * is never synced, whatever is lost in a crash is rebuilt from the log.
+ */
+static void index_persist(size_t from){
+    const char *data = (const char *) (packet_index.offsets + from);
+    size_t len = (packet_index.count - from) * sizeof(off_t);
+
+    while(packet_index.fd != -1 && len > 0){
+        ssize_t res = write(packet_index.fd, data, len);
+        if(res == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            // a torn index is rebuilt on the next start, the entries in memory stay valid
+            log_msg(LOG_ERR, "Error writing packet index: %s", strerror(errno));
+            close(packet_index.fd);
+            packet_index.fd = -1;
+            break;
+        }
+        data += res;
+        len -= res;
+    }
+}
+
+/**
+ * Reads the persisted entries and keeps the prefix that is consistent with
+ * a log of length bytes.
+ */
+static bool index_load(off_t length){
+    struct stat st;
+    size_t entries;
+    size_t valid = 0;
+    ssize_t res;
+
+    if(fstat(packet_index.fd, &st) == -1){
+        log_msg(LOG_ERR, "fstat error: %s", strerror(errno));
+        return false;
+    }
+
+    entries = st.st_size / sizeof(off_t);
+    if(entries == 0 || !index_reserve(entries)){
+        return entries == 0;
+    }
+
+    res = pread(packet_index.fd, packet_index.offsets, entries * sizeof(off_t), 0);
+    if(res == -1){
+        log_msg(LOG_ERR, "Error reading packet index: %s", strerror(errno));
+        return false;
+    }
+    entries = res / sizeof(off_t);
+
+    while(valid < entries && packet_index.offsets[valid] < length
+        && (valid == 0 ? packet_index.offsets[valid] == 0 : packet_index.offsets[valid] > packet_index.offsets[valid - 1])){
+        valid++;
+    }
+    packet_index.count = valid;
+
+    if((off_t)(valid * sizeof(off_t)) != st.st_size && ftruncate(packet_index.fd, valid * sizeof(off_t)) == -1){
+        log_msg(LOG_ERR, "Error truncating packet index: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Adds the packets of the log the index does not cover yet. Packets are
+ * told apart by the newline that ends them, like the text protocol does.
+ */
+static bool index_rebuild(int data_fd, off_t length){
+    char buffer[64 * 1024];
+    off_t position = packet_index.count > 0 ? packet_index.offsets[packet_index.count - 1] : 0;
+
+    if(packet_index.count == 0 && length > 0 && !index_add(0)){
+        return false;
+    }
+
+    while(position < length){
+        size_t to_read = sizeof(buffer);
+        ssize_t res;
+
+        if((off_t) to_read > length - position){
+            to_read = length - position;
+        }
+        res = pread(data_fd, buffer, to_read, position);
+        if(res == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            log_msg(LOG_ERR, "pread error: %s", strerror(errno));
+            return false;
+        }
+        if(res == 0){
+            break;
+        }
+
+        for(const char *end = buffer; (end = memchr(end, '\n', buffer + res - end)) != NULL; end++){
+            off_t next = position + (end - buffer) + 1;
+            if(next < length && !index_add(next)){
+                return false;
+            }
+        }
+        position += res;
+    }
+
+    return true;
+}
+
+bool packet_index_open(const char *data_path, int index_fd, int data_fd, off_t length){
+    size_t loaded;
+
+    if(data_path == NULL){
+        return true;
+    }
+
+    snprintf(packet_index.path, sizeof(packet_index.path), "%s%s", data_path, PACKET_INDEX_SUFFIX);
+    packet_index.fd = index_fd != -1 ? index_fd : open(packet_index.path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(packet_index.fd == -1){
+        log_msg(LOG_ERR, "Error opening packet index: %s", strerror(errno));
+        return false;
+    }
+
+    if(!index_load(length)){
+        goto open_error;
+    }
+    loaded = packet_index.count;
+
+    if(!index_rebuild(data_fd, length)){
+        goto open_error;
+    }
+    index_persist(loaded);
+
+    log_msg(LOG_INFO, "Packet index opened with %zu packets, %zu rebuilt", packet_index.count, packet_index.count - loaded);
+    return true;
+
+open_error:
+    packet_index_close(false);
+    return false;
+}
+
+int packet_index_fd(void){
+    return packet_index.fd;
+}
+
+void packet_index_close(bool remove){
+    if(packet_index.fd != -1){
+        close(packet_index.fd);
+    }
+    if(remove && packet_index.path[0] != '\0' && unlink(packet_index.path) == -1){
+        log_msg(LOG_ERR, "Error removing packet index: %s", strerror(errno));
+    }
+
+    free(packet_index.offsets);
+    packet_index.offsets = NULL;
+    packet_index.first = 0;
+    packet_index.count = 0;
+    packet_index.staged = 0;
+    packet_index.capacity = 0;
+    packet_index.fd = -1;
+    packet_index.path[0] = '\0';
+}
+
+bool packet_index_stage(const struct iovec *iov, int count, off_t start){
+    if(!index_reserve(count)){
+        return false;
+    }
+
+    for(int i = 0; i < count; i++){
+        packet_index.offsets[packet_index.count + packet_index.staged++] = start;
+        start += iov[i].iov_len;
+    }
+    return true;
+}
+
+void packet_index_commit(off_t end){
+    size_t committed = packet_index.count;
+
+    for(size_t i = 0; i < packet_index.staged; i++){
+        if(packet_index.offsets[packet_index.count] >= end){
+            break;
+        }
+        packet_index.count++;
+    }
+    packet_index.staged = 0;
+
+    index_persist(committed);
+}
+
+void packet_index_trim(off_t start){
+    size_t low = packet_index.first;
+    size_t high = packet_index.count;
+
+    // entries are sorted, so the first one kept is found by bisection
+    while(low < high){
+        size_t middle = low + (high - low) / 2;
+        if(packet_index.offsets[middle] < start){
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    packet_index.first = low;
+
+    // trimmed entries are reclaimed once they make up most of the array
+    if(packet_index.first >= PACKET_INDEX_MIN_ENTRIES && packet_index.first > packet_index.count / 2){
+        memmove(packet_index.offsets, packet_index.offsets + packet_index.first,
+            (packet_index.count + packet_index.staged - packet_index.first) * sizeof(off_t));
+        packet_index.count -= packet_index.first;
+        packet_index.first = 0;
+    }
+}
+
+/**
+ * Offset packet starts at, end for the packet after the newest one.
+ */
+static off_t packet_start(size_t packet, off_t end){
+    size_t index = packet_index.first + packet;
+    return index < packet_index.count ? packet_index.offsets[index] : end;
+}
+
+bool packet_index_resolve(uint32_t packet, uint32_t offset, off_t end, off_t *position){
+    off_t start;
+
+    if(packet >= packet_index_count()){
+        return false;
+    }
+
+    start = packet_start(packet, end);
+    if((off_t) offset >= packet_start(packet + 1, end) - start){
+        return false;
+    }
+
+    *position = start + offset;
+    return true;
+}
+
+size_t packet_index_count(void){
+    return packet_index.count - packet_index.first;
+}
+
+void packet_index_span(size_t first, size_t last, off_t end, off_t *start, off_t *stop){
+    *start = packet_start(first, end);
+    *stop = last > first ? packet_start(last, end) : *start;
+}
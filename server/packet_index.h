@@ -0,0 +1,93 @@
+#ifndef PACKET_INDEX_H
+#define PACKET_INDEX_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * Appended to the data file path for the persisted index
+ */
+#define PACKET_INDEX_SUFFIX     ".idx"
+#define PACKET_INDEX_MIN_ENTRIES 1024
+
+/**
+ * Start offsets of the packets in the log, in append order. Appends stage
+ * the offsets of their packets first and commit them once the log length
+ * tells which of them were stored. Entries before first were trimmed away
+ * together with the content they pointed to.
+ */
+typedef struct packet_index{
+    off_t *offsets;
+    size_t first;
+    size_t count;
+    /**
+     * Staged entries following count, not visible to lookups yet
+     */
+    size_t staged;
+    size_t capacity;
+    /**
+     * Index file the committed entries are appended to, -1 when kept in memory only
+     */
+    int fd;
+    char path[PATH_MAX];
+} packet_index_t;
+
+/**
+ * Loads the index persisted for the log at data_path and rebuilds whatever
+ * it is missing from the length bytes of data_fd. index_fd is a descriptor
+ * of the index file that is adopted instead, -1 opens it. A NULL data_path
+ * keeps the index in memory only, it then starts out empty.
+ */
+bool packet_index_open(const char *data_path, int index_fd, int data_fd, off_t length);
+
+/**
+ * @return descriptor of the index file, -1 when kept in memory only
+ */
+int packet_index_fd(void);
+
+/**
+ * Drops all entries, the persisted index is removed as well when remove is set.
+ */
+void packet_index_close(bool remove);
+
+/**
+ * Stages the start offset of every buffer, the first one starting at start.
+ * iov is only read, so it can be handed to a writer that modifies it afterwards.
+ */
+bool packet_index_stage(const struct iovec *iov, int count, off_t start);
+
+/**
+ * Commits the staged entries that start before end, the log length after
+ * the append, and discards the others.
+ */
+void packet_index_commit(off_t end);
+
+/**
+ * Drops the entries of packets starting before start.
+ */
+void packet_index_trim(off_t start);
+
+/**
+ * Resolves byte offset of packet, counted from the oldest packet kept, to
+ * its position in a log ending at end.
+ * @return false when the packet or the offset within it does not exist
+ */
+bool packet_index_resolve(uint32_t packet, uint32_t offset, off_t end, off_t *position);
+
+/**
+ * @return number of packets kept
+ */
+size_t packet_index_count(void);
+
+/**
+ * Resolves the packets [first, last), counted from the oldest packet kept
+ * and at most packet_index_count(), to the bytes [*start, *stop) they take
+ * up in a log ending at end.
+ */
+void packet_index_span(size_t first, size_t last, off_t end, off_t *start, off_t *stop);
+
+#endif // PACKET_INDEX_H
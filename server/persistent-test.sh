@@ -0,0 +1,80 @@
+#!/bin/bash
+# Sends several packets over one persistent connection and checks that every
+# readback is the whole log, not only what the previous readback left. Runs
+# every backend that reads back through a handle kept per connection in
+# every blocking and event driven mode. The chardev backend is pointed at a
+# regular file, so no driver has to be loaded.
+# Usage: ./persistent-test.sh [port]
+set -e
+
+cd `dirname $0`
+port=${1:-9123}
+packets="one two three"
+workdir=$(mktemp -d)
+server_pid=
+
+stop_server() {
+    exec 3<&-
+    if [ -n "${server_pid}" ]; then
+        kill -TERM ${server_pid} 2>/dev/null || true
+        wait ${server_pid} 2>/dev/null || true
+    fi
+    server_pid=
+}
+
+cleanup() {
+    stop_server
+    rm -rf ${workdir}
+}
+trap cleanup EXIT
+
+make >/dev/null
+
+run_case() {
+    mode=$1
+    storage=$2
+    expected=""
+    received=0
+
+    rm -f ${workdir}/data*
+    ./aesdsocket -m ${mode} -s ${storage} -D ${workdir}/data -p ${port} -k 5 -t 0 &
+    server_pid=$!
+
+    for i in $(seq 50); do
+        if exec 3<>/dev/tcp/127.0.0.1/${port}; then
+            break
+        fi
+        sleep 0.1
+    done 2>/dev/null
+
+    for packet in ${packets}; do
+        printf '%s\n' "${packet}" >&3
+        expected="${expected}${packet}"$'\n'
+        received=$((received + 1))
+
+        readback=""
+        for i in $(seq ${received}); do
+            if ! read -r -t 5 line <&3; then
+                echo "FAIL ${mode} ${storage}: readback after ${packet} ended before line ${i}"
+                stop_server
+                return 1
+            fi
+            readback="${readback}${line}"$'\n'
+        done
+        if [ "${readback}" != "${expected}" ]; then
+            echo "FAIL ${mode} ${storage}: readback after ${packet} was '${readback}'"
+            stop_server
+            return 1
+        fi
+    done
+    stop_server
+    echo "OK ${mode} ${storage}"
+}
+
+rc=0
+for mode in thread pool epoll; do
+    for storage in file chardev; do
+        run_case ${mode} ${storage} || rc=1
+    done
+done
+exit ${rc}
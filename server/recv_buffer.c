@@ -0,0 +1,340 @@
+#include "recv_buffer.h"
+#include "frame.h"
+#include "object_cache.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NEWLINE_SCAN_X86
+#endif
+
+typedef size_t (*newline_scan_fn)(const char *data, size_t len, size_t *offsets, size_t max);
+
+static object_cache_t buffer_cache = OBJECT_CACHE_INITIALIZER("recv_buffer", RECV_BUFFER_POOL_SIZE, RECV_BUFFER_POOL_MAX);
+
+/**
+ * Received bytes not handed out as packets yet, summed over all buffers
+ */
+static size_t buffered_bytes = 0;
+
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+static newline_scan_fn scan_impl;
+
+static size_t scan_generic(const char *data, size_t len, size_t *offsets, size_t max){
+    const char *pos = data;
+    const char *end = data + len;
+    size_t count = 0;
+
+    while(count < max && pos < end && (pos = memchr(pos, '\n', end - pos)) != NULL){
+        offsets[count++] = pos - data;
+        pos++;
+    }
+
+    return count;
+}
+
+#ifdef NEWLINE_SCAN_X86
+/**
+ * Appends the newlines of the unaligned tail, which is shorter than one vector.
+ */
+static size_t scan_tail(const char *data, size_t len, size_t i, size_t *offsets, size_t count, size_t max){
+    size_t found = scan_generic(data + i, len - i, offsets + count, max - count);
+
+    for(size_t j = count; j < count + found; j++){
+        offsets[j] += i;
+    }
+
+    return count + found;
+}
+
+__attribute__((target("sse2")))
+static size_t scan_sse2(const char *data, size_t len, size_t *offsets, size_t max){
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    for(; i + 16 <= len; i += 16){
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+
+        while(mask != 0){
+            offsets[count++] = i + __builtin_ctz(mask);
+            if(count == max){
+                return count;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return scan_tail(data, len, i, offsets, count, max);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *data, size_t len, size_t *offsets, size_t max){
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    for(; i + 32 <= len; i += 32){
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+
+        while(mask != 0){
+            offsets[count++] = i + __builtin_ctz(mask);
+            if(count == max){
+                return count;
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    return scan_tail(data, len, i, offsets, count, max);
+}
+#endif
+
+static void scan_select(void){
+    scan_impl = scan_generic;
+#ifdef NEWLINE_SCAN_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        scan_impl = scan_avx2;
+    } else if(__builtin_cpu_supports("sse2")){
+        scan_impl = scan_sse2;
+    }
+#endif
+}
+
+size_t newline_scan(const char *data, size_t len, size_t *offsets, size_t max){
+    pthread_once(&scan_once, scan_select);
+    return scan_impl(data, len, offsets, max);
+}
+
+const char *newline_find(const char *data, size_t len){
+    size_t offset;
+
+    if(newline_scan(data, len, &offset, 1) == 0){
+        return NULL;
+    }
+    return data + offset;
+}
+
+static char *pool_get(void){
+    return (char *) object_cache_alloc(&buffer_cache);
+}
+
+/**
+ * Buffers of the pool size go back to the cache, grown ones to the heap.
+ */
+static void pool_put(char *data, size_t size){
+    if(size == RECV_BUFFER_POOL_SIZE){
+        object_cache_free(&buffer_cache, data);
+    } else {
+        free(data);
+    }
+}
+
+void recv_buffer_init(recv_buffer_t *buffer){
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+void recv_buffer_free(recv_buffer_t *buffer){
+    __atomic_sub_fetch(&buffered_bytes, buffer->len - buffer->start, __ATOMIC_RELAXED);
+    pool_put(buffer->data, buffer->size);
+    recv_buffer_init(buffer);
+}
+
+/**
+ * @return header plus payload length of the frame at the start of the
+ * pending data, 0 while its header is incomplete
+ */
+static size_t frame_pending_len(recv_buffer_t *buffer){
+    size_t frame_len;
+
+    if(buffer->len - buffer->start < FRAME_HEADER_LEN){
+        return 0;
+    }
+
+    frame_len = FRAME_HEADER_LEN + (size_t) frame_get_u32(buffer->data + buffer->start);
+    if(frame_len > FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD){
+        buffer->oversized = true;
+    }
+    return frame_len;
+}
+
+char *recv_buffer_reserve(recv_buffer_t *buffer, size_t min_free, size_t *available){
+    size_t wanted = min_free;
+    size_t hint = buffer->recv_hint;
+
+    if(buffer->framing){
+        size_t frame_len = frame_pending_len(buffer);
+        size_t pending = buffer->len - buffer->start;
+
+        if(buffer->oversized){
+            return NULL;
+        }
+        if(frame_len > pending && frame_len - pending > wanted){
+            wanted = frame_len - pending;
+        }
+    } else if(buffer->boundary_count == 0 && buffer->scanned == buffer->len
+        && buffer->len - buffer->start >= RECV_BUFFER_MAX_PACKET){
+        // everything pending was scanned without finding the end of the packet
+        buffer->oversized = true;
+        return NULL;
+    }
+
+    if(buffer->start > 0){
+        size_t pending = buffer->len - buffer->start;
+        memmove(buffer->data, buffer->data + buffer->start, pending);
+        buffer->scanned -= buffer->start;
+        for(size_t i = buffer->boundary_head; i < buffer->boundary_head + buffer->boundary_count; i++){
+            buffer->boundaries[i] -= buffer->start;
+        }
+        buffer->len = pending;
+        buffer->start = 0;
+    }
+
+    // the hint alone never moves a pooled buffer to the heap, only a packet
+    // longer than it does
+    if(buffer->size <= RECV_BUFFER_POOL_SIZE && hint > RECV_BUFFER_POOL_SIZE - buffer->len){
+        hint = RECV_BUFFER_POOL_SIZE - buffer->len;
+    }
+    if(hint > wanted){
+        wanted = hint;
+    }
+
+    // give the memory of a large packet back once it was consumed and
+    // recent receives are small again
+    if(buffer->len == 0 && buffer->size > RECV_BUFFER_POOL_SIZE && wanted <= RECV_BUFFER_POOL_SIZE){
+        pool_put(buffer->data, buffer->size);
+        buffer->data = NULL;
+        buffer->size = 0;
+    }
+
+    if(buffer->data == NULL && wanted <= RECV_BUFFER_POOL_SIZE){
+        buffer->data = pool_get();
+        if(buffer->data == NULL){
+            return NULL;
+        }
+        buffer->size = RECV_BUFFER_POOL_SIZE;
+    }
+
+    if(buffer->size - buffer->len < wanted){
+        size_t new_size = buffer->size > 0 ? buffer->size : RECV_BUFFER_POOL_SIZE;
+        while(new_size - buffer->len < wanted){
+            new_size *= 2;
+        }
+
+        char *new_data;
+        if(buffer->size == RECV_BUFFER_POOL_SIZE){
+            // a pooled buffer is handed back to the cache, never grown in place
+            new_data = (char *) malloc(new_size);
+            if(new_data == NULL){
+                return NULL;
+            }
+            memcpy(new_data, buffer->data, buffer->len);
+            pool_put(buffer->data, buffer->size);
+        } else {
+            new_data = (char *) realloc(buffer->data, new_size);
+            if(new_data == NULL){
+                return NULL;
+            }
+        }
+        buffer->data = new_data;
+        buffer->size = new_size;
+    }
+
+    *available = buffer->size - buffer->len;
+    buffer->last_available = *available;
+    return buffer->data + buffer->len;
+}
+
+void recv_buffer_commit(recv_buffer_t *buffer, size_t len){
+    buffer->len += len;
+    __atomic_add_fetch(&buffered_bytes, len, __ATOMIC_RELAXED);
+
+    // a receive that filled everything offered suggests more is queued in the
+    // socket, beyond the pool size only once a packet grew the buffer
+    if(len == buffer->last_available){
+        size_t max = buffer->size > RECV_BUFFER_POOL_SIZE ? RECV_BUFFER_MAX_HINT : RECV_BUFFER_POOL_SIZE;
+        size_t hint = buffer->last_available * 2;
+        buffer->recv_hint = hint < max ? hint : max;
+    } else if(len < buffer->last_available / 4){
+        buffer->recv_hint /= 2;
+    }
+}
+
+static bool next_frame(recv_buffer_t *buffer, const char **packet, size_t *packet_len){
+    size_t frame_len = frame_pending_len(buffer);
+
+    if(frame_len == 0 || buffer->oversized || buffer->len - buffer->start < frame_len){
+        return false;
+    }
+
+    *packet = buffer->data + buffer->start;
+    *packet_len = frame_len;
+    buffer->start += frame_len;
+    __atomic_sub_fetch(&buffered_bytes, frame_len, __ATOMIC_RELAXED);
+    return true;
+}
+
+bool recv_buffer_next_packet(recv_buffer_t *buffer, const char **packet, size_t *packet_len){
+    size_t end;
+
+    if(buffer->framing){
+        return next_frame(buffer, packet, packet_len);
+    }
+
+    if(buffer->boundary_count == 0){
+        size_t found;
+
+        if(buffer->scanned < buffer->start){
+            buffer->scanned = buffer->start;
+        }
+        if(buffer->scanned == buffer->len){
+            return false;
+        }
+
+        // all packet boundaries of the received data are collected at once,
+        // the following packets are handed out without scanning again
+        found = newline_scan(buffer->data + buffer->scanned, buffer->len - buffer->scanned,
+            buffer->boundaries, RECV_BUFFER_BOUNDARIES);
+        for(size_t i = 0; i < found; i++){
+            buffer->boundaries[i] += buffer->scanned;
+        }
+
+        buffer->boundary_head = 0;
+        buffer->boundary_count = found;
+        buffer->scanned = found == RECV_BUFFER_BOUNDARIES ? buffer->boundaries[found - 1] + 1 : buffer->len;
+
+        if(found == 0){
+            return false;
+        }
+    }
+
+    end = buffer->boundaries[buffer->boundary_head++];
+    buffer->boundary_count--;
+
+    *packet = buffer->data + buffer->start;
+    *packet_len = end + 1 - buffer->start;
+    buffer->start = end + 1;
+    __atomic_sub_fetch(&buffered_bytes, *packet_len, __ATOMIC_RELAXED);
+    return true;
+}
+
+void recv_buffer_set_framing(recv_buffer_t *buffer){
+    // newlines found in what follows are payload bytes now
+    buffer->framing = true;
+    buffer->boundary_count = 0;
+    buffer->scanned = buffer->len;
+}
+
+size_t recv_buffer_pending(const recv_buffer_t *buffer){
+    return buffer->len - buffer->start;
+}
+
+size_t recv_buffer_total_pending(void){
+    return __atomic_load_n(&buffered_bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,120 @@
+#ifndef RECV_BUFFER_H
+#define RECV_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Size of the buffers kept in the object cache, connections only grow past
+ * it while a large packet is being received
+ */
+#define RECV_BUFFER_POOL_SIZE   4096
+#define RECV_BUFFER_POOL_MAX    256
+/**
+ * Upper bound for the receive size a connection is offered when its recv
+ * calls keep filling all available space
+ */
+#define RECV_BUFFER_MAX_HINT    (1024 * 1024)
+#define RECV_BUFFER_BOUNDARIES  32
+/**
+ * Longest text packet accepted, a newline-less stream beyond it closes the
+ * connection like an oversized frame does
+ */
+#define RECV_BUFFER_MAX_PACKET  (64 * 1024 * 1024)
+
+/**
+ * Per-connection receive buffer that splits the byte stream into newline
+ * terminated packets, or into frames once the connection switched to binary
+ * framing. Several packets may be buffered at once.
+ */
+typedef struct recv_buffer{
+    char *data;
+    size_t size;
+    /**
+     * First byte not handed out as a packet yet
+     */
+    size_t start;
+    /**
+     * End of the received data
+     */
+    size_t len;
+    /**
+     * Everything below this index was already searched for a newline
+     */
+    size_t scanned;
+    /**
+     * Newlines found by the last scan that were not handed out yet
+     */
+    size_t boundaries[RECV_BUFFER_BOUNDARIES];
+    size_t boundary_head;
+    size_t boundary_count;
+    /**
+     * Free space offered to the next recv, follows how full recent recv calls came back
+     */
+    size_t recv_hint;
+    size_t last_available;
+    /**
+     * Set once packets are frames, split by their length prefix without
+     * scanning. A frame over FRAME_MAX_PAYLOAD or a text packet over
+     * RECV_BUFFER_MAX_PACKET sets oversized
+     */
+    bool framing;
+    bool oversized;
+} recv_buffer_t;
+
+void recv_buffer_init(recv_buffer_t *buffer);
+
+/**
+ * Releases the buffer memory, buffers of the pool size are kept for reuse.
+ */
+void recv_buffer_free(recv_buffer_t *buffer);
+
+/**
+ * Makes room for at least min_free more bytes, moving pending data to the
+ * front or growing the buffer. With framing the room covers the rest of the
+ * frame whose header was received, so its payload arrives in place.
+ * Packets returned earlier become invalid.
+ * @return where to receive into, NULL when out of memory or on an oversized packet
+ */
+char *recv_buffer_reserve(recv_buffer_t *buffer, size_t min_free, size_t *available);
+
+/**
+ * Accounts for len bytes received into the space returned by recv_buffer_reserve().
+ */
+void recv_buffer_commit(recv_buffer_t *buffer, size_t len);
+
+/**
+ * Hands out the next complete packet including its newline, or the next
+ * frame including its header, and consumes it.
+ * The pointer stays valid until the next recv_buffer_reserve() call.
+ * @return false when no complete packet is buffered
+ */
+bool recv_buffer_next_packet(recv_buffer_t *buffer, const char **packet, size_t *packet_len);
+
+/**
+ * Splits everything not handed out yet into frames from now on.
+ */
+void recv_buffer_set_framing(recv_buffer_t *buffer);
+
+/**
+ * @return number of received bytes not consumed as a packet yet
+ */
+size_t recv_buffer_pending(const recv_buffer_t *buffer);
+
+/**
+ * @return received bytes not consumed as a packet yet, over all buffers
+ */
+size_t recv_buffer_total_pending(void);
+
+/**
+ * Finds up to max newlines in one pass, using AVX2 or SSE2 when the CPU has them.
+ * @return number of offsets stored, relative to data
+ */
+size_t newline_scan(const char *data, size_t len, size_t *offsets, size_t max);
+
+/**
+ * @return first newline in data, NULL when there is none
+ */
+const char *newline_find(const char *data, size_t len);
+
+#endif // RECV_BUFFER_H
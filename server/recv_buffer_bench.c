@@ -0,0 +1,148 @@
+/**
+ * Compares the receive framing against the previous loop, which received
+ * into RECV_BUFFER_LEN byte chunks and searched each chunk with memchr().
+ * The socket is replaced by an in-memory stream so only framing is measured.
+ *
+ * usage: recv_buffer_bench [packet size] [total MiB]
+ */
+#include "object_cache.h"
+#include "recv_buffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_CHUNK_LEN     512
+
+typedef struct stream{
+    const char *data;
+    size_t len;
+    size_t position;
+} stream_t;
+
+static size_t stream_recv(stream_t *stream, char *buffer, size_t len){
+    size_t left = stream->len - stream->position;
+
+    if(len > left){
+        len = left;
+    }
+    memcpy(buffer, stream->data + stream->position, len);
+    stream->position += len;
+    return len;
+}
+
+static double elapsed_sec(const struct timespec *start){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Previous loop: fixed chunks appended to a growing packet, memchr over each chunk.
+ */
+static size_t bench_chunked(stream_t *stream){
+    char chunk[BENCH_CHUNK_LEN];
+    char *packet = NULL;
+    size_t packet_len = 0;
+    size_t packets = 0;
+    size_t res;
+
+    while((res = stream_recv(stream, chunk, sizeof(chunk))) > 0){
+        size_t offset = 0;
+
+        while(offset < res){
+            char *newline = memchr(chunk + offset, '\n', res - offset);
+            size_t len = newline != NULL ? (size_t)(newline - (chunk + offset)) + 1 : res - offset;
+            char *new_packet = realloc(packet, packet_len + len);
+
+            if(new_packet == NULL){
+                free(packet);
+                return 0;
+            }
+            packet = new_packet;
+            memcpy(packet + packet_len, chunk + offset, len);
+            packet_len += len;
+            offset += len;
+
+            if(newline != NULL){
+                packets++;
+                packet_len = 0;
+            }
+        }
+    }
+
+    free(packet);
+    return packets;
+}
+
+static size_t bench_recv_buffer(stream_t *stream){
+    recv_buffer_t buffer;
+    const char *packet;
+    size_t packet_len;
+    size_t packets = 0;
+
+    recv_buffer_init(&buffer);
+
+    while(true){
+        size_t available;
+        size_t res;
+        char *space;
+
+        while(recv_buffer_next_packet(&buffer, &packet, &packet_len)){
+            packets++;
+        }
+
+        space = recv_buffer_reserve(&buffer, BENCH_CHUNK_LEN, &available);
+        if(space == NULL || (res = stream_recv(stream, space, available)) == 0){
+            break;
+        }
+        recv_buffer_commit(&buffer, res);
+    }
+
+    recv_buffer_free(&buffer);
+    return packets;
+}
+
+static void run(const char *name, size_t (*bench)(stream_t *), const char *data, size_t len){
+    stream_t stream = { .data = data, .len = len };
+    struct timespec start;
+    size_t packets;
+    double sec;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    packets = bench(&stream);
+    sec = elapsed_sec(&start);
+
+    printf("%-12s %10zu packets %8.3f s %10.1f MiB/s\n", name, packets, sec, len / sec / (1024 * 1024));
+}
+
+int main(int argc, char **argv){
+    size_t packet_size = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+    size_t total = (argc > 2 ? strtoul(argv[2], NULL, 10) : 256) * 1024 * 1024;
+    char *data;
+
+    if(packet_size == 0 || total < packet_size){
+        fprintf(stderr, "usage: %s [packet size] [total MiB]\n", argv[0]);
+        return 1;
+    }
+
+    total -= total % packet_size;
+    data = malloc(total);
+    if(data == NULL){
+        fprintf(stderr, "Error allocating %zu bytes\n", total);
+        return 1;
+    }
+
+    for(size_t i = 0; i < total; i++){
+        data[i] = (i + 1) % packet_size == 0 ? '\n' : 'a' + i % 26;
+    }
+
+    printf("%zu byte packets, %zu MiB\n", packet_size, total / (1024 * 1024));
+    run("chunked", bench_chunked, data, total);
+    run("recv_buffer", bench_recv_buffer, data, total);
+
+    free(data);
+    object_cache_cleanup();
+    return 0;
+}
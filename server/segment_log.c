@@ -0,0 +1,442 @@
+#define _GNU_SOURCE
+#include "segment_log.h"
+#include "async_log.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static segment_log_t segment_log;
+
+static segment_t *segment_get(size_t index){
+    return &segment_log.segments[index % SEGMENT_LOG_MAX_SEGMENTS];
+}
+
+static void segment_path(char *path, size_t size, size_t index){
+    snprintf(path, size, SEGMENT_LOG_NAME_FORMAT, segment_log.dir, index);
+}
+
+static time_t monotonic_sec(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+/**
+ * Preallocates and maps the next segment. The blocks are reserved up front,
+ * so appends neither allocate extents nor fault on a full disk.
+ */
+static bool segment_create(void){
+    size_t index = segment_log.next;
+    segment_t *segment = segment_get(index);
+    char path[PATH_MAX];
+    char *map;
+    int res;
+    int fd;
+
+    // the slot is still mapped for a snapshot or holds a live segment
+    if(index - segment_log.mapped_first >= SEGMENT_LOG_MAX_SEGMENTS){
+        log_msg(LOG_ERR, "Segment log full, dropping further content");
+        return false;
+    }
+
+    segment_path(path, sizeof(path), index);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1){
+        log_msg(LOG_ERR, "Error opening segment: %s", strerror(errno));
+        return false;
+    }
+
+    res = fallocate(fd, 0, 0, SEGMENT_LOG_SIZE);
+    if(res == -1 && errno == EOPNOTSUPP){
+        // a sparse segment still works, its blocks are allocated on first touch
+        res = ftruncate(fd, SEGMENT_LOG_SIZE);
+    }
+    if(res == -1){
+        log_msg(LOG_ERR, "Error preallocating segment: %s", strerror(errno));
+        close(fd);
+        unlink(path);
+        return false;
+    }
+
+    map = (char *) mmap(NULL, SEGMENT_LOG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED){
+        log_msg(LOG_ERR, "mmap error: %s", strerror(errno));
+        close(fd);
+        unlink(path);
+        return false;
+    }
+
+    // packets_before and appended_at are set by the first append into it
+    segment->fd = fd;
+    segment->first_packet = -1;
+    __atomic_store_n(&segment->map, map, __ATOMIC_RELEASE);
+    segment_log.next++;
+    log_msg(LOG_DEBUG, "Created segment %zu", index);
+    return true;
+}
+
+static void segment_unmap(segment_t *segment){
+    munmap(segment->map, SEGMENT_LOG_SIZE);
+    segment->map = NULL;
+    if(segment->fd != -1){
+        close(segment->fd);
+        segment->fd = -1;
+    }
+}
+
+/**
+ * Moves the writeback mark to end, segments entirely behind it need their
+ * descriptor no more.
+ */
+static void segment_mark_written(off_t end){
+    for(size_t i = segment_log.written / SEGMENT_LOG_SIZE; i < (size_t)(end / SEGMENT_LOG_SIZE); i++){
+        segment_t *segment = segment_get(i);
+
+        if(segment->fd != -1){
+            close(segment->fd);
+            segment->fd = -1;
+        }
+    }
+    segment_log.written = end;
+}
+
+/**
+ * Syncs everything appended after the synced mark, one msync() per touched
+ * segment.
+ */
+static bool segment_sync(off_t end){
+    static long page_size = 0;
+
+    if(page_size == 0){
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+
+    while(segment_log.synced < end){
+        size_t index = segment_log.synced / SEGMENT_LOG_SIZE;
+        off_t base = (off_t) index * SEGMENT_LOG_SIZE;
+        size_t start = (segment_log.synced - base) & ~((size_t) page_size - 1);
+        size_t stop = end - base < SEGMENT_LOG_SIZE ? (size_t)(end - base) : SEGMENT_LOG_SIZE;
+
+        if(msync(segment_get(index)->map + start, stop - start, MS_SYNC) == -1){
+            log_msg(LOG_ERR, "msync error: %s", strerror(errno));
+            return false;
+        }
+        segment_log.synced = base + stop;
+    }
+
+    if(segment_log.written < end){
+        segment_mark_written(end);
+    }
+    return true;
+}
+
+/**
+ * Starts writeback of everything appended after the writeback mark without
+ * waiting for it. msync() with MS_ASYNC does nothing on Linux, so the
+ * ranges go to sync_file_range() on the segment files.
+ */
+static void segment_writeback(off_t end){
+    off_t from = segment_log.written;
+
+    while(from < end){
+        size_t index = from / SEGMENT_LOG_SIZE;
+        off_t base = (off_t) index * SEGMENT_LOG_SIZE;
+        off_t stop = end - base < SEGMENT_LOG_SIZE ? end - base : SEGMENT_LOG_SIZE;
+        int fd = segment_get(index)->fd;
+
+        if(fd != -1 && sync_file_range(fd, from - base, stop - (from - base), SYNC_FILE_RANGE_WRITE) == -1){
+            log_msg(LOG_ERR, "sync_file_range error: %s", strerror(errno));
+            return;
+        }
+        from = base + stop;
+    }
+
+    segment_mark_written(end);
+}
+
+/**
+ * Decides whether the oldest live segment is past the retention limits,
+ * moving the start to the next packet boundary when it is.
+ * @return true when the segment can be dropped
+ */
+static bool segment_expired(time_t now){
+    const retention_limits_t *retention = &segment_log.retention;
+    segment_t *oldest = segment_get(segment_log.live_first);
+    segment_t *next = NULL;
+    bool expired = false;
+
+    // a start moved past the segment by an earlier drop leaves nothing to keep
+    if(segment_log.start >= (off_t)(segment_log.live_first + 1) * SEGMENT_LOG_SIZE){
+        return true;
+    }
+
+    // readers have to start at a packet boundary behind the segment
+    for(size_t i = segment_log.live_first + 1; i < segment_log.next && next == NULL; i++){
+        if(segment_get(i)->first_packet != -1){
+            next = segment_get(i);
+        }
+    }
+    if(next == NULL){
+        return false;
+    }
+
+    if(retention->max_packets > 0 && segment_log.packets - next->packets_before >= retention->max_packets){
+        expired = true;
+    }
+    if(retention->max_bytes > 0 && (size_t)(segment_log.length - next->first_packet) >= retention->max_bytes){
+        expired = true;
+    }
+    if(retention->max_age_sec > 0 && now - oldest->appended_at >= retention->max_age_sec){
+        expired = true;
+    }
+
+    if(expired){
+        __atomic_store_n(&segment_log.start, next->first_packet, __ATOMIC_RELEASE);
+    }
+    return expired;
+}
+
+/**
+ * Drops whole segments past the retention limits, nothing is rewritten.
+ * A dropped segment is unlinked right away and unmapped once no snapshot
+ * reads from it anymore.
+ */
+static void segment_retain(void){
+    time_t now = monotonic_sec();
+    char path[PATH_MAX];
+
+    while(segment_log.live_first + 1 < segment_log.next && segment_expired(now)){
+        segment_path(path, sizeof(path), segment_log.live_first);
+        if(unlink(path) == -1){
+            log_msg(LOG_ERR, "Error removing segment: %s", strerror(errno));
+        }
+        log_msg(LOG_DEBUG, "Dropped segment %zu", segment_log.live_first);
+        segment_log.live_first++;
+    }
+
+    // dropped content is not synced anymore
+    if(segment_log.synced < (off_t) segment_log.live_first * SEGMENT_LOG_SIZE){
+        segment_log.synced = (off_t) segment_log.live_first * SEGMENT_LOG_SIZE;
+    }
+    if(segment_log.written < segment_log.synced){
+        segment_mark_written(segment_log.synced);
+    }
+
+    while(segment_log.mapped_first < segment_log.live_first){
+        segment_t *segment = segment_get(segment_log.mapped_first);
+
+        if(__atomic_load_n(&segment->pins, __ATOMIC_ACQUIRE) > 0){
+            break;
+        }
+        segment_unmap(segment);
+        segment_log.mapped_first++;
+    }
+}
+
+/**
+ * @return whether name is one written by SEGMENT_LOG_NAME_FORMAT
+ */
+static bool segment_name(const char *name){
+    size_t digits = strspn(name, "0123456789");
+
+    return digits >= 8 && strcmp(name + digits, ".seg") == 0;
+}
+
+/**
+ * Removes the segments a previous run left in dir. Retention may have
+ * removed any prefix of them, so the directory is listed instead of
+ * probing indexes.
+ */
+static bool segment_remove_all(const char *dir){
+    DIR *listing = opendir(dir);
+    struct dirent *entry;
+
+    if(listing == NULL){
+        log_msg(LOG_ERR, "Error listing segment directory: %s", strerror(errno));
+        return false;
+    }
+
+    while((entry = readdir(listing)) != NULL){
+        if(segment_name(entry->d_name) && unlinkat(dirfd(listing), entry->d_name, 0) == -1){
+            log_msg(LOG_ERR, "Error removing segment %s: %s", entry->d_name, strerror(errno));
+        }
+    }
+
+    closedir(listing);
+    return true;
+}
+
+bool segment_log_open(const char *dir, const retention_limits_t *retention){
+    if(mkdir(dir, 0755) == -1 && errno != EEXIST){
+        log_msg(LOG_ERR, "Error creating segment directory: %s", strerror(errno));
+        return false;
+    }
+
+    if(!segment_remove_all(dir)){
+        return false;
+    }
+
+    segment_log.dir = dir;
+    segment_log.retention = *retention;
+
+    log_msg(LOG_INFO, "Segment log opened in %s", dir);
+    return true;
+}
+
+void segment_log_close(void){
+    char path[PATH_MAX];
+
+    for(size_t i = segment_log.mapped_first; i < segment_log.next; i++){
+        segment_unmap(segment_get(i));
+        segment_path(path, sizeof(path), i);
+        if(i >= segment_log.live_first && unlink(path) == -1){
+            log_msg(LOG_ERR, "Error removing segment: %s", strerror(errno));
+        }
+    }
+
+    if(segment_log.dir != NULL){
+        if(rmdir(segment_log.dir) == 0){
+            log_msg(LOG_INFO, "Removed segment directory");
+        } else {
+            log_msg(LOG_ERR, "Error removing segment directory: %s", strerror(errno));
+        }
+    }
+
+    segment_log.dir = NULL;
+    segment_log.mapped_first = 0;
+    segment_log.live_first = 0;
+    segment_log.next = 0;
+    segment_log.start = 0;
+    segment_log.length = 0;
+    segment_log.synced = 0;
+    segment_log.written = 0;
+    segment_log.packets = 0;
+}
+
+/**
+ * Forgets an append that failed part way, what was copied into the
+ * mappings already is overwritten by the next one.
+ */
+static void segment_rollback(off_t length, uint64_t packets){
+    for(size_t i = length / SEGMENT_LOG_SIZE; i < segment_log.next; i++){
+        segment_t *segment = segment_get(i);
+
+        if(segment->first_packet >= length){
+            segment->first_packet = -1;
+        }
+    }
+
+    segment_log.packets = packets;
+    if(segment_log.synced > length){
+        segment_log.synced = length;
+    }
+    if(segment_log.written > length){
+        segment_log.written = length;
+    }
+}
+
+bool segment_log_appendv(const struct iovec *iov, int count, bool sync){
+    off_t tail = segment_log.length;
+    uint64_t packets = segment_log.packets;
+    bool success = true;
+
+    for(int i = 0; i < count && success; i++){
+        const char *data = (const char *) iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        bool packet_start = true;
+
+        while(len > 0){
+            size_t index = tail / SEGMENT_LOG_SIZE;
+            size_t offset = tail % SEGMENT_LOG_SIZE;
+            size_t to_copy = SEGMENT_LOG_SIZE - offset;
+            segment_t *segment;
+
+            if(index == segment_log.next && !segment_create()){
+                success = false;
+                break;
+            }
+
+            segment = segment_get(index);
+            if(offset == 0){
+                segment->packets_before = segment_log.packets;
+            }
+            if(packet_start){
+                if(segment->first_packet == -1){
+                    segment->first_packet = tail;
+                }
+                segment_log.packets++;
+                packet_start = false;
+            }
+
+            if(to_copy > len){
+                to_copy = len;
+            }
+            memcpy(segment->map + offset, data, to_copy);
+            segment->appended_at = monotonic_sec();
+            tail += to_copy;
+            data += to_copy;
+            len -= to_copy;
+        }
+    }
+
+    if(success && sync){
+        success = segment_sync(tail);
+    } else if(success && tail - segment_log.written >= SEGMENT_LOG_WRITEBACK_BYTES){
+        // bounds the dirty pages the next explicit sync or the kernel has to write
+        segment_writeback(tail);
+    }
+
+    // the caller fails every packet of a failed append, readers see none of them
+    if(!success){
+        segment_rollback(segment_log.length, packets);
+        return false;
+    }
+
+    __atomic_store_n(&segment_log.length, tail, __ATOMIC_RELEASE);
+    segment_retain();
+    return true;
+}
+
+off_t segment_log_start(void){
+    return __atomic_load_n(&segment_log.start, __ATOMIC_ACQUIRE);
+}
+
+off_t segment_log_length(void){
+    return __atomic_load_n(&segment_log.length, __ATOMIC_ACQUIRE);
+}
+
+off_t segment_log_pin(off_t offset){
+    off_t pin = offset / SEGMENT_LOG_SIZE;
+
+    __atomic_add_fetch(&segment_get(pin)->pins, 1, __ATOMIC_RELAXED);
+    return pin;
+}
+
+void segment_log_unpin(off_t pin){
+    __atomic_sub_fetch(&segment_get(pin)->pins, 1, __ATOMIC_RELEASE);
+}
+
+size_t segment_log_peek(off_t offset, const char **data){
+    off_t length = segment_log_length();
+    size_t segment_offset = offset % SEGMENT_LOG_SIZE;
+    size_t available;
+
+    if(offset >= length){
+        return 0;
+    }
+
+    available = SEGMENT_LOG_SIZE - segment_offset;
+    if((off_t) available > length - offset){
+        available = length - offset;
+    }
+
+    *data = __atomic_load_n(&segment_get(offset / SEGMENT_LOG_SIZE)->map, __ATOMIC_ACQUIRE) + segment_offset;
+    return available;
+}
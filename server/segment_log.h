@@ -0,0 +1,130 @@
+#ifndef SEGMENT_LOG_H
+#define SEGMENT_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define SEGMENT_LOG_SIZE            (4 * 1024 * 1024)
+#define SEGMENT_LOG_MAX_SEGMENTS    1024
+#define SEGMENT_LOG_NAME_FORMAT     "%s/%08zu.seg"
+/**
+ * Without explicit syncing, dirty pages are handed to writeback every time
+ * this many bytes were appended
+ */
+#define SEGMENT_LOG_WRITEBACK_BYTES (1024 * 1024)
+
+/**
+ * How much of the log is kept, 0 leaves a limit off. Whole segments are
+ * dropped once the segments after them still hold max_packets packets or
+ * max_bytes bytes, or once nothing in them is younger than max_age_sec.
+ * The tail segment is never dropped.
+ */
+typedef struct retention_limits{
+    size_t max_packets;
+    size_t max_bytes;
+    int max_age_sec;
+} retention_limits_t;
+
+typedef struct segment{
+    char *map;
+    /**
+     * Descriptor writeback is started on, closed once the writeback mark
+     * passed the segment, -1 after that
+     */
+    int fd;
+    /**
+     * Offset of the first packet starting in the segment, -1 while a
+     * packet spans all of it
+     */
+    off_t first_packet;
+    /**
+     * Packets started before the segment
+     */
+    uint64_t packets_before;
+    /**
+     * CLOCK_MONOTONIC second of the last append into the segment
+     */
+    time_t appended_at;
+    /**
+     * Snapshots reading from this segment onwards, it stays mapped until
+     * they were released
+     */
+    size_t pins;
+} segment_t;
+
+/**
+ * The log as a directory of fixed size segment files, each preallocated
+ * with fallocate() and mapped while it is part of the log. Appends copy
+ * into the mapping of the last segment and roll to a new one when it is
+ * full. Offsets keep growing over the lifetime of the log, a byte at
+ * offset lives in segment offset / SEGMENT_LOG_SIZE, which occupies slot
+ * segment % SEGMENT_LOG_MAX_SEGMENTS.
+ * Readers only need the published start and length to access the mappings,
+ * appends are serialized by the caller.
+ */
+typedef struct segment_log{
+    const char *dir;
+    retention_limits_t retention;
+    segment_t segments[SEGMENT_LOG_MAX_SEGMENTS];
+    /**
+     * Oldest mapped segment, oldest segment still part of the log and the
+     * segment created next
+     */
+    size_t mapped_first;
+    size_t live_first;
+    size_t next;
+    /**
+     * Offset of the first packet still readable and bytes appended ever,
+     * both visible to readers
+     */
+    off_t start;
+    off_t length;
+    /**
+     * Bytes already synced and bytes handed to writeback, which covers
+     * the synced ones
+     */
+    off_t synced;
+    off_t written;
+    uint64_t packets;
+} segment_log_t;
+
+/**
+ * Creates dir when missing and starts an empty log in it, segments left
+ * there by a previous run are replaced.
+ */
+bool segment_log_open(const char *dir, const retention_limits_t *retention);
+
+/**
+ * Unmaps and removes every segment, then dir itself when it is empty.
+ */
+void segment_log_close(void);
+
+/**
+ * Copies all buffers to the end of the log and publishes them, every buffer
+ * is one packet. With sync set they reach the disk before readers can see
+ * them. When the append fails, none of the buffers is published. Segments
+ * past the retention limits are dropped afterwards.
+ */
+bool segment_log_appendv(const struct iovec *iov, int count, bool sync);
+
+off_t segment_log_start(void);
+off_t segment_log_length(void);
+
+/**
+ * Keeps the segments from offset onwards mapped until segment_log_unpin()
+ * is called with the returned pin. Called with appends serialized.
+ */
+off_t segment_log_pin(off_t offset);
+void segment_log_unpin(off_t pin);
+
+/**
+ * @return number of contiguous bytes at offset, 0 past the end of the log.
+ * offset has to lie in segments pinned by the caller.
+ */
+size_t segment_log_peek(off_t offset, const char **data);
+
+#endif // SEGMENT_LOG_H
@@ -0,0 +1,33 @@
+#include "storage.h"
+
+static const storage_backend_t *backends[] = {
+    &storage_file,
+    &storage_chardev,
+    &storage_memory,
+    &storage_segment
+};
+
+const storage_backend_t *storage_find(const char *name){
+    for(size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++){
+        if(strcmp(backends[i]->name, name) == 0){
+            return backends[i];
+        }
+    }
+    return NULL;
+}
+
+bool storage_is_seekto(const char *packet, size_t packet_len){
+    return packet_len >= AESD_SEEKTO_KEYWORD_LEN && strncmp(packet, AESD_SEEKTO_KEYWORD, AESD_SEEKTO_KEYWORD_LEN) == 0;
+}
+
+bool storage_seekto(int handle, const char *packet, size_t packet_len, off_t *position){
+    struct aesd_seekto seekto;
+    log_msg(LOG_INFO, "Received seekto keyword");
+
+    *position = -1;
+    if(!parse_seekto_command(packet, packet_len, &seekto)){
+        log_msg(LOG_ERR, "Malformed seekto command");
+        return false;
+    }
+    return server_config.storage->seek(handle, &seekto, position);
+}
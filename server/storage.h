@@ -0,0 +1,110 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "aesdsocket.h"
+#include <sys/uio.h>
+
+#define STORAGE_FILE_NAME       "file"
+#define STORAGE_CHARDEV_NAME    "chardev"
+#define STORAGE_MEMORY_NAME     "memory"
+#define STORAGE_SEGMENT_NAME    "segment"
+#define STORAGE_FILE_PATH       "/var/tmp/aesdsocketdata"
+#define STORAGE_CHARDEV_PATH    "/dev/aesdchar"
+#define STORAGE_SEGMENT_PATH    "/var/tmp/aesdsocketdata.d"
+
+struct data_snapshot;
+
+typedef struct storage_stats{
+    /**
+     * Bytes a full readback returns, -1 when the backend cannot tell
+     */
+    off_t length;
+    /**
+     * Most bytes the backend can hold, -1 when only the disk limits it
+     */
+    off_t capacity;
+} storage_stats_t;
+
+/**
+ * Where packets are appended and read back from. Every call except init()
+ * and cleanup() is made with the data mutex held, appends are serialized by
+ * the group commit of the data store.
+ */
+typedef struct storage_backend{
+    const char *name;
+    const char *default_path;
+    /**
+     * Whether the periodic timestamps are written into this backend
+     */
+    bool timestamps;
+    /**
+     * Prepares path, NULL for backends that do not use one
+     */
+    bool (*init)(const char *path);
+    void (*cleanup)(void);
+    /**
+     * Handle a connection appends and reads back through
+     * @return handle or -1 on error
+     */
+    int (*open)(void);
+    void (*close)(int handle);
+    /**
+     * Appends all buffers, iov may be modified while partial writes are resumed.
+     */
+    bool (*appendv)(int handle, struct iovec *iov, int count);
+    /**
+     * Captures what a full readback through handle returns, from the start
+     * of the storage whatever earlier readbacks left behind.
+     */
+    bool (*readback)(int handle, struct data_snapshot *snapshot);
+    /**
+     * Captures everything stored after cursor and the cursor that follows it.
+     */
+    bool (*readback_from)(int handle, off_t cursor, struct data_snapshot *snapshot, off_t *new_cursor);
+    /**
+     * Captures at most len bytes stored from offset on, without moving the
+     * readback position of handle.
+     */
+    bool (*readback_range)(int handle, off_t offset, uint64_t len, struct data_snapshot *snapshot);
+    /**
+     * Resolves the seekto target and leaves the offset the readback starts
+     * from in position, -1 when the target does not exist.
+     */
+    bool (*seek)(int handle, const struct aesd_seekto *seekto, off_t *position);
+    /**
+     * Resolves range to the offsets [*start, *end) it covers, clamped to
+     * what is stored.
+     * @return false when the backend cannot resolve the unit of range
+     */
+    bool (*locate)(int handle, const aesd_range_t *range, off_t *start, off_t *end);
+    void (*stats)(storage_stats_t *stats);
+    /**
+     * Fills fds with the descriptors a successor adopts in init() after a
+     * handoff, see handoff.h. NULL when the content is not handed over
+     * @return number of descriptors
+     */
+    size_t (*handoff_fds)(int *fds, size_t size);
+} storage_backend_t;
+
+extern const storage_backend_t storage_file;
+extern const storage_backend_t storage_chardev;
+extern const storage_backend_t storage_memory;
+extern const storage_backend_t storage_segment;
+
+/**
+ * @return the backend called name, NULL when there is none
+ */
+const storage_backend_t *storage_find(const char *name);
+
+/**
+ * @return true when packet is a seekto command
+ */
+bool storage_is_seekto(const char *packet, size_t packet_len);
+
+/**
+ * Parses the seekto command in packet and applies it to handle, see seek().
+ * @return false when the command is malformed or its target does not exist
+ */
+bool storage_seekto(int handle, const char *packet, size_t packet_len, off_t *position);
+
+#endif // STORAGE_H
@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+#include "storage.h"
+#include "data_store.h"
+#include <fcntl.h>
+
+static const char *device_path = NULL;
+
+static bool chardev_init(const char *path){
+    device_path = path;
+    return true;
+}
+
+static void chardev_cleanup(void){
+    log_msg(LOG_INFO, "using  aesd char device, not removing data file");
+    device_path = NULL;
+}
+
+/**
+ * The driver keeps a file position per open file, so every connection
+ * gets its own descriptor.
+ */
+static int chardev_open(void){
+    int fd = open(device_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(fd == -1){
+        log_msg(LOG_ERR, "Error opening data file: %s", strerror(errno));
+    }
+    return fd;
+}
+
+static void chardev_close(int handle){
+    if(handle != -1){
+        close(handle);
+    }
+}
+
+/**
+ * The driver keeps every write as its own entry and has nothing to sync.
+ */
+static bool chardev_appendv(int handle, struct iovec *iov, int count){
+    int first = 0;
+
+    while(first < count){
+        ssize_t res = writev(handle, iov + first, count - first);
+        if(res == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            log_msg(LOG_ERR, "writev error: %s", strerror(errno));
+            return false;
+        }
+
+        while(first < count && (size_t) res >= iov[first].iov_len){
+            res -= iov[first].iov_len;
+            first++;
+        }
+        if(first < count){
+            iov[first].iov_base = (char *) iov[first].iov_base + res;
+            iov[first].iov_len -= res;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Moves up to limit bytes of device content into a pipe without copying
+ * them through user space.
+ * @return true when the device was drained or the limit reached, false when the rest has to be copied
+ */
+static bool snapshot_splice(int handle, data_snapshot_t *snapshot, uint64_t limit){
+    if(pipe2(snapshot->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1){
+        log_msg(LOG_ERR, "pipe2 error: %s", strerror(errno));
+        snapshot->pipe_fds[0] = snapshot->pipe_fds[1] = -1;
+        return false;
+    }
+
+    // best effort, the pipe just holds less when the limit is lower
+    fcntl(snapshot->pipe_fds[1], F_SETPIPE_SZ, SNAPSHOT_PIPE_SIZE);
+
+    while(snapshot->pipe_len < limit){
+        size_t wanted = limit - snapshot->pipe_len < SNAPSHOT_PIPE_SIZE ? (size_t)(limit - snapshot->pipe_len) : SNAPSHOT_PIPE_SIZE;
+        ssize_t res = splice(handle, NULL, snapshot->pipe_fds[1], NULL, wanted, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(res > 0){
+            snapshot->pipe_len += res;
+            continue;
+        }
+        if(res == 0){
+            return true;
+        }
+        if(errno == EINTR){
+            continue;
+        }
+        if(errno != EAGAIN && errno != EINVAL){
+            log_msg(LOG_ERR, "splice error: %s", strerror(errno));
+        }
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * The char device only keeps the last few writes, so moving what is left
+ * from the current file position out under the lock is cheap and keeps the
+ * readback consistent. Whatever does not fit into the pipe is copied, all
+ * of it at most limit bytes.
+ */
+static bool snapshot_read(int handle, data_snapshot_t *snapshot, uint64_t limit){
+    size_t size = 0;
+
+    if(snapshot_splice(handle, snapshot, limit)){
+        return true;
+    }
+    limit -= snapshot->pipe_len;
+
+    while((uint64_t) snapshot->length < limit){
+        if(size - (size_t) snapshot->length < RECV_BUFFER_LEN){
+            size_t new_size = size + RECV_BUFFER_LEN * 8;
+            char *new_buffer = (char *) realloc(snapshot->buffer, new_size);
+            if(new_buffer == NULL){
+                log_msg(LOG_ERR, "Error allocating memory for snapshot");
+                return false;
+            }
+            snapshot->buffer = new_buffer;
+            size = new_size;
+        }
+
+        size_t wanted = size - snapshot->length;
+        if(wanted > limit - snapshot->length){
+            wanted = limit - snapshot->length;
+        }
+
+        ssize_t res = read(handle, snapshot->buffer + snapshot->length, wanted);
+        if(res == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            log_msg(LOG_ERR, "read error: %s", strerror(errno));
+            return false;
+        }
+        if(res == 0){
+            return true;
+        }
+        snapshot->length += res;
+    }
+
+    return true;
+}
+
+/**
+ * The handle is kept open across the packets of a connection and the last
+ * readback left it at the end, so every full readback starts over.
+ */
+static bool chardev_readback(int handle, data_snapshot_t *snapshot){
+    if(lseek(handle, 0, SEEK_SET) == -1){
+        log_msg(LOG_ERR, "lseek error: %s", strerror(errno));
+        return false;
+    }
+    return snapshot_read(handle, snapshot, UINT64_MAX);
+}
+
+static bool chardev_readback_from(int handle, off_t cursor, data_snapshot_t *snapshot, off_t *new_cursor){
+    // the driver refuses offsets past its content, which leaves nothing to send
+    if(lseek(handle, cursor, SEEK_SET) == -1 && lseek(handle, 0, SEEK_END) == -1){
+        log_msg(LOG_ERR, "lseek error: %s", strerror(errno));
+        return false;
+    }
+    if(!snapshot_read(handle, snapshot, UINT64_MAX)){
+        return false;
+    }
+    *new_cursor = lseek(handle, 0, SEEK_CUR);
+    return true;
+}
+
+static bool chardev_readback_range(int handle, off_t offset, uint64_t len, data_snapshot_t *snapshot){
+    off_t position = lseek(handle, 0, SEEK_CUR);
+    bool success = true;
+
+    // the driver refuses offsets past its content, which leaves nothing to send
+    if(position == -1 || lseek(handle, offset, SEEK_SET) != -1){
+        success = snapshot_read(handle, snapshot, len);
+    }
+    if(position != -1 && lseek(handle, position, SEEK_SET) == -1){
+        log_msg(LOG_ERR, "lseek error: %s", strerror(errno));
+    }
+    return success;
+}
+
+/**
+ * The driver resolves the target and moves the file position of handle there.
+ */
+static bool chardev_seek(int handle, const struct aesd_seekto *seekto, off_t *position){
+    *position = -1;
+    log_msg(LOG_DEBUG, "Sending ioctl request: %lu", (unsigned long) AESDCHAR_IOCSEEKTO);
+    if(ioctl(handle, AESDCHAR_IOCSEEKTO, seekto) < 0){
+        log_msg(LOG_ERR, "ioctl error: %s", strerror(errno));
+        return false;
+    }
+    *position = lseek(handle, 0, SEEK_CUR);
+    if(*position == -1){
+        log_msg(LOG_ERR, "lseek error: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * The driver reports the size of the entries it still holds as its end.
+ */
+static void chardev_stats(storage_stats_t *stats){
+    int fd = open(device_path, O_RDONLY | O_CLOEXEC);
+
+    stats->length = -1;
+    stats->capacity = -1;
+    if(fd != -1){
+        stats->length = lseek(fd, 0, SEEK_END);
+        close(fd);
+    }
+}
+
+/**
+ * The driver keeps no packet index we could use, only byte ranges are served.
+ */
+static bool chardev_locate(int handle, const aesd_range_t *range, off_t *start, off_t *end){
+    storage_stats_t stats;
+    (void) handle;
+
+    if(range->packets){
+        return false;
+    }
+
+    chardev_stats(&stats);
+    if(stats.length == -1){
+        return false;
+    }
+    *start = range_bound(range->first, 0, stats.length);
+    *end = range_bound(range->last, *start, stats.length);
+    return true;
+}
+
+const storage_backend_t storage_chardev = {
+    .name = STORAGE_CHARDEV_NAME,
+    .default_path = STORAGE_CHARDEV_PATH,
+    .timestamps = false,
+    .init = chardev_init,
+    .cleanup = chardev_cleanup,
+    .open = chardev_open,
+    .close = chardev_close,
+    .appendv = chardev_appendv,
+    .readback = chardev_readback,
+    .readback_from = chardev_readback_from,
+    .readback_range = chardev_readback_range,
+    .seek = chardev_seek,
+    .locate = chardev_locate,
+    .stats = chardev_stats
+};
@@ -0,0 +1,382 @@
+#include "storage.h"
+#include "data_log.h"
+#include "data_store.h"
+#include "handoff.h"
+#include "packet_index.h"
+#include "segment_log.h"
+
+/**
+ * Path removed again on cleanup, NULL while the file backend is not in use
+ */
+static const char *file_path = NULL;
+
+/**
+ * Descriptors a predecessor hands over, see file_handoff_fds()
+ */
+#define FILE_HANDOFF_DATA       0
+#define FILE_HANDOFF_INDEX      1
+
+static bool file_init(const char *path){
+    if(!data_log_open(path, handoff_storage_fd(FILE_HANDOFF_DATA), server_config.mirror_chunks)){
+        return false;
+    }
+    if(!packet_index_open(path, handoff_storage_fd(FILE_HANDOFF_INDEX), data_log_fd(), data_log_length())){
+        data_log_close();
+        return false;
+    }
+    file_path = path;
+    return true;
+}
+
+static void file_cleanup(void){
+    // a successor took over the file and its index
+    bool keep = handoff_done();
+
+    packet_index_close(!keep);
+    data_log_close();
+    if(file_path == NULL || keep){
+        file_path = NULL;
+        return;
+    }
+
+    if(remove(file_path) == 0){
+        log_msg(LOG_INFO, "Removed data file");
+    } else {
+        log_msg(LOG_ERR, "Error removing data file: %s", strerror(errno));
+    }
+    file_path = NULL;
+}
+
+/**
+ * Every connection shares the long-lived data log.
+ */
+static int log_open(void){
+    return data_log_fd();
+}
+
+static void log_close(int handle){
+    (void) handle;
+}
+
+static bool file_appendv(int handle, struct iovec *iov, int count){
+    bool success = true;
+    (void) handle;
+
+    if(!packet_index_stage(iov, count, data_log_length())){
+        return false;
+    }
+
+    switch(server_config.sync_mode){
+    case SYNC_MODE_PACKET:
+        for(int i = 0; i < count && success; i++){
+            success = data_log_appendv(&iov[i], 1, true);
+        }
+        break;
+    case SYNC_MODE_GROUP:
+        success = data_log_appendv(iov, count, true);
+        break;
+    default:
+        success = data_log_appendv(iov, count, false);
+        break;
+    }
+
+    // packets that reached the log are indexed, even when the rest failed
+    packet_index_commit(data_log_length());
+    return success;
+}
+
+/**
+ * The log only ever grows, so the committed length is enough to describe a
+ * consistent view: bytes appended later are simply not part of it.
+ */
+static void log_snapshot(data_snapshot_t *snapshot){
+    snapshot->data_fd = data_log_fd();
+    snapshot->peek = data_log_peek;
+    snapshot->length = data_log_length();
+}
+
+/**
+ * Pins the mirror from where the snapshot starts, so the chunks it sends
+ * from are not dropped meanwhile. What precedes the mirror comes from the file.
+ */
+static void log_snapshot_pin(data_snapshot_t *snapshot){
+    snapshot->peek_start = data_log_mirror_start();
+    snapshot->pin = data_log_pin(snapshot->position);
+    snapshot->unpin = data_log_unpin;
+}
+
+static bool log_readback(int handle, data_snapshot_t *snapshot){
+    (void) handle;
+    log_snapshot(snapshot);
+    log_snapshot_pin(snapshot);
+    return true;
+}
+
+static bool log_readback_from(int handle, off_t cursor, data_snapshot_t *snapshot, off_t *new_cursor){
+    (void) handle;
+    log_snapshot(snapshot);
+    snapshot->position = cursor < snapshot->length ? cursor : snapshot->length;
+    log_snapshot_pin(snapshot);
+    *new_cursor = snapshot->length;
+    return true;
+}
+
+/**
+ * Limits a snapshot of the whole log to the range, offsets past its end leave it empty.
+ */
+static void snapshot_limit(data_snapshot_t *snapshot, off_t offset, uint64_t len){
+    if(offset > snapshot->position){
+        snapshot->position = offset < snapshot->length ? offset : snapshot->length;
+    }
+    if(len < (uint64_t)(snapshot->length - snapshot->position)){
+        snapshot->length = snapshot->position + (off_t) len;
+    }
+}
+
+static bool log_readback_range(int handle, off_t offset, uint64_t len, data_snapshot_t *snapshot){
+    (void) handle;
+    log_snapshot(snapshot);
+    snapshot_limit(snapshot, offset, len);
+    log_snapshot_pin(snapshot);
+    return true;
+}
+
+/**
+ * The log is shared by all connections, so the readback starts from the
+ * resolved offset instead of moving a position.
+ */
+static bool log_seek(int handle, const struct aesd_seekto *seekto, off_t *position){
+    (void) handle;
+    *position = -1;
+    if(!packet_index_resolve(seekto->write_cmd, seekto->write_cmd_offset, data_log_length(), position)){
+        log_msg(LOG_ERR, "No packet %u with offset %u stored", seekto->write_cmd, seekto->write_cmd_offset);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Bytes are log offsets, packets are counted from the oldest packet kept.
+ */
+static bool range_locate(const aesd_range_t *range, off_t log_start, off_t log_end, off_t *start, off_t *end){
+    if(range->packets){
+        int64_t count = (int64_t) packet_index_count();
+        int64_t first = range_bound(range->first, 0, count);
+
+        packet_index_span(first, range_bound(range->last, first, count), log_end, start, end);
+    } else {
+        *start = range_bound(range->first, log_start, log_end);
+        *end = range_bound(range->last, *start, log_end);
+    }
+    return true;
+}
+
+static bool log_locate(int handle, const aesd_range_t *range, off_t *start, off_t *end){
+    (void) handle;
+    return range_locate(range, 0, data_log_length(), start, end);
+}
+
+static void file_stats(storage_stats_t *stats){
+    stats->length = data_log_length();
+    stats->capacity = -1;
+}
+
+static size_t file_handoff_fds(int *fds, size_t size){
+    size_t count = 0;
+
+    if(size > FILE_HANDOFF_INDEX && data_log_fd() != -1){
+        fds[FILE_HANDOFF_DATA] = data_log_fd();
+        count = FILE_HANDOFF_DATA + 1;
+        if(packet_index_fd() != -1){
+            fds[FILE_HANDOFF_INDEX] = packet_index_fd();
+            count = FILE_HANDOFF_INDEX + 1;
+        }
+    }
+    return count;
+}
+
+const storage_backend_t storage_file = {
+    .name = STORAGE_FILE_NAME,
+    .default_path = STORAGE_FILE_PATH,
+    .timestamps = true,
+    .init = file_init,
+    .cleanup = file_cleanup,
+    .open = log_open,
+    .close = log_close,
+    .appendv = file_appendv,
+    .readback = log_readback,
+    .readback_from = log_readback_from,
+    .readback_range = log_readback_range,
+    .seek = log_seek,
+    .locate = log_locate,
+    .stats = file_stats,
+    .handoff_fds = file_handoff_fds
+};
+
+/**
+ * The data log without its file, content lives in the mirror only and is
+ * lost on exit.
+ */
+static bool memory_init(const char *path){
+    (void) path;
+    return data_log_open(NULL, -1, DATA_LOG_MAX_CHUNKS);
+}
+
+static void memory_cleanup(void){
+    packet_index_close(false);
+    data_log_close();
+}
+
+/**
+ * Appends ignore the handle, it only has to look valid to connections.
+ */
+static int memory_open(void){
+    return 0;
+}
+
+static bool memory_appendv(int handle, struct iovec *iov, int count){
+    bool success;
+    (void) handle;
+
+    if(!packet_index_stage(iov, count, data_log_length())){
+        return false;
+    }
+    success = data_log_appendv(iov, count, false);
+    packet_index_commit(data_log_length());
+    return success;
+}
+
+static void memory_stats(storage_stats_t *stats){
+    stats->length = data_log_length();
+    stats->capacity = (off_t) DATA_LOG_MAX_CHUNKS * DATA_LOG_CHUNK_SIZE;
+}
+
+const storage_backend_t storage_memory = {
+    .name = STORAGE_MEMORY_NAME,
+    .default_path = NULL,
+    .timestamps = true,
+    .init = memory_init,
+    .cleanup = memory_cleanup,
+    .open = memory_open,
+    .close = log_close,
+    .appendv = memory_appendv,
+    .readback = log_readback,
+    .readback_from = log_readback_from,
+    .readback_range = log_readback_range,
+    .seek = log_seek,
+    .locate = log_locate,
+    .stats = memory_stats
+};
+
+static bool segment_init(const char *path){
+    return segment_log_open(path, &server_config.retention);
+}
+
+static void segment_cleanup(void){
+    packet_index_close(false);
+    segment_log_close();
+}
+
+/**
+ * Packet sync applies to each packet, group sync to the whole batch.
+ */
+static bool segment_appendv(int handle, struct iovec *iov, int count){
+    bool success = true;
+    (void) handle;
+
+    if(!packet_index_stage(iov, count, segment_log_length())){
+        return false;
+    }
+
+    switch(server_config.sync_mode){
+    case SYNC_MODE_PACKET:
+        for(int i = 0; i < count && success; i++){
+            success = segment_log_appendv(&iov[i], 1, true);
+        }
+        break;
+    case SYNC_MODE_GROUP:
+        success = segment_log_appendv(iov, count, true);
+        break;
+    default:
+        success = segment_log_appendv(iov, count, false);
+        break;
+    }
+
+    // retention may have dropped the oldest packets along with their segments
+    packet_index_commit(segment_log_length());
+    packet_index_trim(segment_log_start());
+    return success;
+}
+
+/**
+ * Readbacks are served from the segment mappings, nothing is read from the
+ * files. The snapshot pins the segments it covers, so dropping them leaves
+ * it intact.
+ */
+static bool segment_readback(int handle, data_snapshot_t *snapshot){
+    (void) handle;
+    snapshot->peek = segment_log_peek;
+    snapshot->position = segment_log_start();
+    snapshot->length = segment_log_length();
+    snapshot->pin = segment_log_pin(snapshot->position);
+    snapshot->unpin = segment_log_unpin;
+    return true;
+}
+
+/**
+ * A cursor pointing at dropped content continues with the oldest packet kept.
+ */
+static bool segment_readback_from(int handle, off_t cursor, data_snapshot_t *snapshot, off_t *new_cursor){
+    segment_readback(handle, snapshot);
+    if(cursor > snapshot->position){
+        snapshot->position = cursor < snapshot->length ? cursor : snapshot->length;
+    }
+    *new_cursor = snapshot->length;
+    return true;
+}
+
+static bool segment_readback_range(int handle, off_t offset, uint64_t len, data_snapshot_t *snapshot){
+    segment_readback(handle, snapshot);
+    snapshot_limit(snapshot, offset, len);
+    return true;
+}
+
+/**
+ * Packets are counted from the oldest one retention kept.
+ */
+static bool segment_seek(int handle, const struct aesd_seekto *seekto, off_t *position){
+    (void) handle;
+    *position = -1;
+    if(!packet_index_resolve(seekto->write_cmd, seekto->write_cmd_offset, segment_log_length(), position)){
+        log_msg(LOG_ERR, "No packet %u with offset %u stored", seekto->write_cmd, seekto->write_cmd_offset);
+        return false;
+    }
+    return true;
+}
+
+static bool segment_locate(int handle, const aesd_range_t *range, off_t *start, off_t *end){
+    (void) handle;
+    return range_locate(range, segment_log_start(), segment_log_length(), start, end);
+}
+
+static void segment_stats(storage_stats_t *stats){
+    stats->length = segment_log_length() - segment_log_start();
+    stats->capacity = (off_t) SEGMENT_LOG_MAX_SEGMENTS * SEGMENT_LOG_SIZE;
+}
+
+const storage_backend_t storage_segment = {
+    .name = STORAGE_SEGMENT_NAME,
+    .default_path = STORAGE_SEGMENT_PATH,
+    .timestamps = true,
+    .init = segment_init,
+    .cleanup = segment_cleanup,
+    .open = memory_open,
+    .close = log_close,
+    .appendv = segment_appendv,
+    .readback = segment_readback,
+    .readback_from = segment_readback_from,
+    .readback_range = segment_readback_range,
+    .seek = segment_seek,
+    .locate = segment_locate,
+    .stats = segment_stats
+};
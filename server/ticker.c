@@ -0,0 +1,68 @@
+#include "ticker.h"
+#include "data_store.h"
+#include <sys/timerfd.h>
+
+static int timer_fd = -1;
+/**
+ * Reused by every tick, the commit only references it until it returns
+ */
+static char tick_buffer[TICKER_BUFFER_LEN];
+
+int ticker_open(int interval_sec){
+    struct itimerspec timer = {
+        .it_value = { .tv_sec = interval_sec },
+        .it_interval = { .tv_sec = interval_sec }
+    };
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(timer_fd == -1){
+        log_msg(LOG_ERR, "timerfd_create error: %s", strerror(errno));
+        return -1;
+    }
+
+    if(timerfd_settime(timer_fd, 0, &timer, NULL) == -1){
+        log_msg(LOG_ERR, "timerfd_settime error: %s", strerror(errno));
+        ticker_close();
+        return -1;
+    }
+
+    log_msg(LOG_DEBUG, "Ticker started with %d s interval", interval_sec);
+    return timer_fd;
+}
+
+void ticker_expired(pthread_mutex_t *mutex){
+    uint64_t expirations;
+    size_t len;
+
+    if(read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)){
+        if(errno != EAGAIN && errno != EINTR){
+            log_msg(LOG_ERR, "timerfd read error: %s", strerror(errno));
+        }
+        return;
+    }
+
+    // ticks are skipped until the predecessor handed the storage over
+    if(data_store_pending_fd() != -1){
+        return;
+    }
+
+    len = format_timestamp(tick_buffer, sizeof(tick_buffer));
+    if(len == 0){
+        return;
+    }
+
+    if(data_store_commit(data_store_open(), mutex, tick_buffer, len, false, NULL)){
+        log_msg(LOG_INFO, "Wrote timestamp to data file");
+    }
+}
+
+int ticker_fd(void){
+    return timer_fd;
+}
+
+void ticker_close(void){
+    if(timer_fd != -1){
+        close(timer_fd);
+        timer_fd = -1;
+    }
+}
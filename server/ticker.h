@@ -0,0 +1,31 @@
+#ifndef TICKER_H
+#define TICKER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#define TICKER_INTERVAL_DEFAULT_SEC 10
+#define TICKER_BUFFER_LEN           128
+
+/**
+ * Periodic timestamp writer of file mode, driven by a timerfd the server's
+ * main loop waits on next to its listener. Ticks are appended through
+ * data_store_commit() like client packets, so they take part in group
+ * commits and share the data log handle.
+ * @return the non-blocking timerfd or -1 on error
+ */
+int ticker_open(int interval_sec);
+
+/**
+ * Writes a timestamp when the timerfd expired, several missed expirations
+ * still write a single one. Returns right away on a spurious wakeup.
+ */
+void ticker_expired(pthread_mutex_t *mutex);
+
+/**
+ * @return the timerfd, -1 when the ticker is not running
+ */
+int ticker_fd(void);
+void ticker_close(void);
+
+#endif // TICKER_H
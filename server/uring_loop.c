@@ -0,0 +1,974 @@
+#include "uring_loop.h"
+#include "admission.h"
+#include "data_log.h"
+#include "data_store.h"
+#include "frame.h"
+#include "handoff.h"
+#include "metrics.h"
+#include "packet_index.h"
+#include "recv_buffer.h"
+#include "storage.h"
+#include "ticker.h"
+
+#ifdef HAVE_LIBURING
+#include <fcntl.h>
+#include <liburing.h>
+#include <sys/uio.h>
+
+// fixed file slot of the data file, client sockets follow it
+#define URING_DATA_SLOT     0
+#define URING_CLIENT_SLOT(index)    ((index) + 1)
+#define URING_TICK_INDEX    0xffffffu
+
+#define URING_USER_DATA(index, op)  (((uint64_t)(index) << 8) | (op))
+#define URING_USER_INDEX(data)      ((uint32_t)((data) >> 8))
+#define URING_USER_OP(data)         ((uring_op_t)((data) & 0xff))
+
+typedef enum uring_op{
+    URING_OP_ACCEPT,
+    URING_OP_RECV,
+    URING_OP_IDLE,
+    URING_OP_WRITE,
+    URING_OP_READ,
+    URING_OP_SEND,
+    URING_OP_HEADER,
+    URING_OP_TICK,
+    URING_OP_TICK_WRITE,
+    URING_OP_ACCEPT_RETRY,
+    URING_OP_DRAIN,
+    URING_OP_CANCEL,
+    URING_OP_STORAGE
+} uring_op_t;
+
+typedef struct uring_connection{
+    bool in_use;
+    bool closing;
+    unsigned int index;
+    unsigned int pending;
+    int client_fd;
+    /**
+     * Char device only, every client needs its own handle for seekto. Reads
+     * are issued at position, so the handle's file position is not used
+     */
+    int data_fd;
+    char addr_str[INET6_ADDRSTRLEN];
+    /**
+     * Registered buffer of this slot, used for receiving and for readback chunks
+     */
+    char *buffer;
+    /**
+     * Partial or pipelined packets are framed here, a single complete packet
+     * is written straight from the registered buffer instead
+     */
+    recv_buffer_t recv_buffer;
+    const char *packet;
+    size_t packet_len;
+    bool packet_fixed;
+    /**
+     * Incremental readback requested by a cursor command
+     */
+    bool cursor_request;
+    off_t cursor;
+    char header[AESD_CURSOR_HEADER_LEN];
+    size_t header_len;
+    size_t header_sent;
+    off_t position;
+    off_t length;
+    size_t chunk_len;
+    size_t chunk_sent;
+    struct uring_connection *next_append;
+    /**
+     * Metrics timestamps, first_byte_pending is cleared once data arrived
+     */
+    uint64_t accepted_at;
+    uint64_t first_byte_pending;
+    uint64_t append_start;
+    uint64_t readback_start;
+} uring_connection_t;
+
+static struct io_uring ring;
+static uring_connection_t connections[URING_MAX_CONNECTIONS];
+static char *buffers = NULL;
+static int listen_socket = -1;
+static int data_fd = -1;
+static int synced_fd = -1;
+static struct sockaddr_storage accept_addr;
+static socklen_t accept_addr_len;
+static struct __kernel_timespec tick_interval;
+static struct __kernel_timespec idle_timeout;
+static struct __kernel_timespec accept_retry = { .tv_nsec = ADMISSION_RETRY_MS * 1000000L };
+static char tick_buffer[TICKER_BUFFER_LEN];
+static bool tick_pending = false;
+/**
+ * Appends are serialized: only one write is in flight at a time, so the
+ * committed log length is exact when a readback is linked behind it
+ */
+static bool append_busy = false;
+/**
+ * Set until the predecessor handed the storage over, appends wait in their
+ * queue meanwhile while clients are accepted and received from
+ */
+static bool storage_pending = false;
+/**
+ * Set once a successor took over the listener, the loop ends with the last connection
+ */
+static bool draining = false;
+static uring_connection_t *append_head = NULL;
+static uring_connection_t *append_tail = NULL;
+
+static struct io_uring_sqe *get_sqe(void){
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if(sqe == NULL){
+        io_uring_submit(&ring);
+        sqe = io_uring_get_sqe(&ring);
+    }
+    return sqe;
+}
+
+/**
+ * Linked chains must end up in one submission, flush the queue when it
+ * cannot hold the whole chain.
+ */
+static void reserve_sqes(unsigned int count){
+    if(io_uring_sq_space_left(&ring) < count){
+        io_uring_submit(&ring);
+    }
+}
+
+static void submit_accept(void){
+    struct io_uring_sqe *sqe = get_sqe();
+
+    accept_addr_len = sizeof(accept_addr);
+    io_uring_prep_accept(sqe, listen_socket, (struct sockaddr *)&accept_addr, &accept_addr_len, 0);
+    io_uring_sqe_set_data64(sqe, URING_USER_DATA(0, URING_OP_ACCEPT));
+}
+
+/**
+ * Accepts the next client, or checks again after a while when overloaded.
+ */
+static void submit_accept_admitted(void){
+    struct io_uring_sqe *sqe;
+
+    if(draining){
+        return;
+    }
+
+    if(!admission_paused()){
+        submit_accept();
+        return;
+    }
+
+    sqe = get_sqe();
+    io_uring_prep_timeout(sqe, &accept_retry, 0, 0);
+    io_uring_sqe_set_data64(sqe, URING_USER_DATA(URING_TICK_INDEX, URING_OP_ACCEPT_RETRY));
+}
+
+/**
+ * Stops accepting once the successor signals it took over the listener.
+ */
+static void submit_drain(void){
+    struct io_uring_sqe *sqe = get_sqe();
+
+    io_uring_prep_poll_add(sqe, handoff_drain_fd(), POLLIN);
+    io_uring_sqe_set_data64(sqe, URING_USER_DATA(URING_TICK_INDEX, URING_OP_DRAIN));
+}
+
+static void handle_drain(void){
+    struct io_uring_sqe *sqe = get_sqe();
+
+    log_msg(LOG_INFO, "io_uring loop draining its connections");
+    draining = true;
+    // completes the pending accept with -ECANCELED
+    io_uring_prep_cancel64(sqe, URING_USER_DATA(0, URING_OP_ACCEPT), 0);
+    io_uring_sqe_set_data64(sqe, URING_USER_DATA(URING_TICK_INDEX, URING_OP_CANCEL));
+}
+
+/**
+ * @return true once draining and neither a connection nor an append is left
+ */
+static bool drained(void){
+    if(!draining || append_busy){
+        return false;
+    }
+    for(size_t i = 0; i < URING_MAX_CONNECTIONS; i++){
+        if(connections[i].in_use){
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Resumes the appends once the storage of the predecessor arrived.
+ */
+static void submit_storage(void){
+    struct io_uring_sqe *sqe = get_sqe();
+
+    io_uring_prep_poll_add(sqe, data_store_pending_fd(), POLLIN);
+    io_uring_sqe_set_data64(sqe, URING_USER_DATA(URING_TICK_INDEX, URING_OP_STORAGE));
+}
+
+static void submit_tick(void){
+    struct io_uring_sqe *sqe = get_sqe();
+
+    io_uring_prep_timeout(sqe, &tick_interval, 0, 0);
+    io_uring_sqe_set_data64(sqe, URING_USER_DATA(URING_TICK_INDEX, URING_OP_TICK));
+}
+
+/**
+ * Persistent connections link an idle timeout behind the receive, which
+ * cancels it when the client stays silent for too long.
+ */
+static void submit_recv(uring_connection_t *conn){
+    struct io_uring_sqe *sqe;
+
+    reserve_sqes(2);
+    sqe = get_sqe();
+
+    io_uring_prep_read_fixed(sqe, URING_CLIENT_SLOT(conn->index), conn->buffer, URING_BUFFER_LEN, 0, conn->index);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data64(sqe, URING_USER_DATA(conn->index, URING_OP_RECV));
+    conn->pending++;
+
+    if(server_config.persistent){
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = get_sqe();
+        io_uring_prep_link_timeout(sqe, &idle_timeout, 0);
+        io_uring_sqe_set_data64(sqe, URING_USER_DATA(conn->index, URING_OP_IDLE));
+        conn->pending++;
+    }
+}
+
+static void prep_send(struct io_uring_sqe *sqe, uring_connection_t *conn){
+    io_uring_prep_send(sqe, URING_CLIENT_SLOT(conn->index), conn->buffer + conn->chunk_sent,
+        conn->chunk_len - conn->chunk_sent, MSG_NOSIGNAL);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data64(sqe, URING_USER_DATA(conn->index, URING_OP_SEND));
+    conn->pending++;
+}
+
+/**
+ * Queues the next readback chunk. File mode knows the exact chunk length, so
+ * the send is linked behind the read. The char device reports its end with a
+ * short read, which would break the link, so its send is issued on completion.
+ */
+static void submit_read(uring_connection_t *conn, bool linked){
+    struct io_uring_sqe *sqe;
+
+    reserve_sqes(2);
+    sqe = get_sqe();
+
+    if(data_fd != -1){
+        size_t len = URING_BUFFER_LEN;
+        if((off_t) len > conn->length - conn->position){
+            len = conn->length - conn->position;
+        }
+        conn->chunk_len = len;
+        conn->chunk_sent = 0;
+        io_uring_prep_read_fixed(sqe, URING_DATA_SLOT, conn->buffer, len, conn->position, conn->index);
+        sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        io_uring_sqe_set_data64(sqe, URING_USER_DATA(conn->index, URING_OP_READ));
+        conn->pending++;
+        prep_send(get_sqe(), conn);
+    } else {
+        io_uring_prep_read_fixed(sqe, conn->data_fd, conn->buffer, URING_BUFFER_LEN, conn->position, conn->index);
+        if(linked){
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+        io_uring_sqe_set_data64(sqe, URING_USER_DATA(conn->index, URING_OP_READ));
+        conn->pending++;
+    }
+}
+
+static void submit_header(uring_connection_t *conn){
+    struct io_uring_sqe *sqe = get_sqe();
+
+    io_uring_prep_send(sqe, URING_CLIENT_SLOT(conn->index), conn->header + conn->header_sent,
+        conn->header_len - conn->header_sent, MSG_NOSIGNAL | MSG_MORE);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data64(sqe, URING_USER_DATA(conn->index, URING_OP_HEADER));
+    conn->pending++;
+}
+
+/**
+ * Starts the readback of a cursor command once its payload is stored. The
+ * loop is the only writer, so the end of the log cannot move until the
+ * readback was sent.
+ */
+static bool cursor_readback_start(uring_connection_t *conn){
+    off_t new_cursor;
+
+    conn->cursor_request = false;
+
+    if(data_fd != -1){
+        new_cursor = data_log_length();
+        conn->length = new_cursor;
+    } else {
+        new_cursor = lseek(conn->data_fd, 0, SEEK_END);
+        if(new_cursor == -1){
+            log_msg(LOG_ERR, "lseek error: %s", strerror(errno));
+            return false;
+        }
+    }
+    conn->position = conn->cursor < new_cursor ? conn->cursor : new_cursor;
+
+    conn->header_len = format_cursor_header(conn->header, sizeof(conn->header), new_cursor);
+    conn->header_sent = 0;
+    submit_header(conn);
+    return true;
+}
+
+static void connection_release(uring_connection_t *conn){
+    int unregister = -1;
+
+    log_msg(LOG_INFO, "Closed connection from %s", conn->addr_str);
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+    metrics_record_since(METRIC_CONNECTION, conn->accepted_at);
+
+    io_uring_register_files_update(&ring, URING_CLIENT_SLOT(conn->index), &unregister, 1);
+    close(conn->client_fd);
+    if(conn->data_fd != -1){
+        close(conn->data_fd);
+    }
+    recv_buffer_free(&conn->recv_buffer);
+    admission_release();
+
+    conn->in_use = false;
+    conn->closing = false;
+    conn->cursor_request = false;
+    conn->client_fd = -1;
+    conn->data_fd = -1;
+    conn->packet = NULL;
+    conn->packet_len = 0;
+}
+
+/**
+ * Marks the connection for closing, it is released once every submitted
+ * request of it has completed.
+ */
+static void connection_close(uring_connection_t *conn){
+    conn->closing = true;
+    if(conn->pending == 0){
+        connection_release(conn);
+    }
+}
+
+static void start_next_append(void);
+static void readback_done(uring_connection_t *conn);
+
+/**
+ * Mirrors a packet about to be written to the data file and stages its
+ * index entry, both are published once the write completed.
+ */
+static void stage_append(const char *data, size_t len){
+    struct iovec iov = { .iov_base = (void *) data, .iov_len = len };
+
+    data_log_mirror(data, len);
+    packet_index_stage(&iov, 1, data_log_length());
+}
+
+static void publish_append(size_t len){
+    data_log_publish(len);
+    packet_index_commit(data_log_length());
+}
+
+static void start_append(uring_connection_t *conn){
+    const char *packet = conn->packet;
+    size_t packet_len = conn->packet_len;
+    struct io_uring_sqe *sqe;
+    const char *payload;
+    size_t payload_len;
+    aesd_range_t range;
+
+    // opened with the first packet, the storage may arrive after the client
+    if(data_fd == -1 && conn->data_fd == -1){
+        conn->data_fd = data_store_open();
+        if(conn->data_fd == -1){
+            connection_close(conn);
+            start_next_append();
+            return;
+        }
+    }
+
+    // cursor readbacks need the length after the write, so nothing is linked
+    if(parse_cursor_command(packet, packet_len, &conn->cursor, &payload, &payload_len)){
+        log_msg(LOG_DEBUG, "Received cursor %lld", (long long) conn->cursor);
+        conn->cursor_request = true;
+
+        if(payload_len == 0){
+            conn->readback_start = metrics_now();
+            if(!cursor_readback_start(conn)){
+                connection_close(conn);
+            }
+            start_next_append();
+            return;
+        }
+
+        append_busy = true;
+        sqe = get_sqe();
+        if(data_fd != -1){
+            if(conn->packet_fixed){
+                io_uring_prep_write_fixed(sqe, URING_DATA_SLOT, payload, payload_len, -1, conn->index);
+            } else {
+                io_uring_prep_write(sqe, URING_DATA_SLOT, payload, payload_len, -1);
+            }
+            sqe->flags |= IOSQE_FIXED_FILE;
+            stage_append(payload, payload_len);
+        } else if(conn->packet_fixed){
+            io_uring_prep_write_fixed(sqe, conn->data_fd, payload, payload_len, -1, conn->index);
+        } else {
+            io_uring_prep_write(sqe, conn->data_fd, payload, payload_len, -1);
+        }
+        io_uring_sqe_set_data64(sqe, URING_USER_DATA(conn->index, URING_OP_WRITE));
+        conn->pending++;
+        conn->append_start = metrics_now();
+        return;
+    }
+
+    // reads from the char device cannot be limited to a range here, it is answered with nothing
+    if(parse_range_command(packet, packet_len, &range)){
+        off_t start;
+        off_t end;
+
+        conn->readback_start = metrics_now();
+        if(data_fd != -1 && server_config.storage->locate(conn->data_fd, &range, &start, &end) && start < end){
+            conn->position = start;
+            conn->length = end;
+            submit_read(conn, false);
+        } else {
+            readback_done(conn);
+        }
+        start_next_append();
+        return;
+    }
+
+    // binary framing is not offered here, the handshake is answered with a plain readback
+    if(storage_is_seekto(packet, packet_len) || (packet_len == AESD_BINARY_KEYWORD_LEN
+        && memcmp(packet, AESD_BINARY_KEYWORD, AESD_BINARY_KEYWORD_LEN) == 0)){
+        off_t position = -1;
+
+        if(storage_is_seekto(packet, packet_len)){
+            storage_seekto(conn->data_fd, packet, packet_len, &position);
+        }
+        conn->position = position != -1 ? position : 0;
+        if(data_fd != -1){
+            conn->length = data_log_length();
+        }
+        conn->readback_start = metrics_now();
+        submit_read(conn, false);
+        start_next_append();
+        return;
+    }
+
+    append_busy = true;
+
+    reserve_sqes(3);
+    sqe = get_sqe();
+
+    if(data_fd != -1){
+        if(conn->packet_fixed){
+            io_uring_prep_write_fixed(sqe, URING_DATA_SLOT, packet, packet_len, -1, conn->index);
+        } else {
+            io_uring_prep_write(sqe, URING_DATA_SLOT, packet, packet_len, -1);
+        }
+        sqe->flags |= IOSQE_FIXED_FILE;
+        stage_append(packet, packet_len);
+        // the readback of this client covers everything up to and including its packet
+        conn->length = data_log_length() + packet_len;
+    } else if(conn->packet_fixed){
+        io_uring_prep_write_fixed(sqe, conn->data_fd, packet, packet_len, -1, conn->index);
+    } else {
+        io_uring_prep_write(sqe, conn->data_fd, packet, packet_len, -1);
+    }
+
+    sqe->flags |= IOSQE_IO_LINK;
+    io_uring_sqe_set_data64(sqe, URING_USER_DATA(conn->index, URING_OP_WRITE));
+    conn->pending++;
+    conn->append_start = metrics_now();
+    conn->position = 0;
+
+    submit_read(conn, true);
+}
+
+static void start_next_append(void){
+    if(append_busy || storage_pending){
+        return;
+    }
+
+    if(tick_pending){
+        struct io_uring_sqe *sqe = get_sqe();
+        size_t len = strlen(tick_buffer);
+
+        io_uring_prep_write(sqe, URING_DATA_SLOT, tick_buffer, len, -1);
+        sqe->flags |= IOSQE_FIXED_FILE;
+        stage_append(tick_buffer, len);
+        io_uring_sqe_set_data64(sqe, URING_USER_DATA(URING_TICK_INDEX, URING_OP_TICK_WRITE));
+        tick_pending = false;
+        append_busy = true;
+        return;
+    }
+
+    if(append_head != NULL){
+        uring_connection_t *conn = append_head;
+        admission_append_end(conn->packet_len);
+        append_head = conn->next_append;
+        if(append_head == NULL){
+            append_tail = NULL;
+        }
+        conn->next_append = NULL;
+        start_append(conn);
+    }
+}
+
+static void queue_append(uring_connection_t *conn){
+    admission_append_begin(conn->packet_len);
+    conn->next_append = NULL;
+    if(append_tail == NULL){
+        append_head = conn;
+    } else {
+        append_tail->next_append = conn;
+    }
+    append_tail = conn;
+
+    start_next_append();
+}
+
+/**
+ * Registers the data file of the file backend and starts the ticker. The
+ * data log stays owned by the data store, the ring only borrows its
+ * descriptor. The ring never has more than one append in flight, so a
+ * synced descriptor gives the per-packet durability either sync mode asks for.
+ */
+static bool storage_attach(void){
+    if(server_config.storage == &storage_file){
+        int fd = data_log_fd();
+
+        if(server_config.sync_mode != SYNC_MODE_NONE){
+            fd = open(server_config.data_path, O_RDWR | O_APPEND | O_DSYNC | O_CLOEXEC);
+            if(fd == -1){
+                log_msg(LOG_ERR, "Error opening data file: %s", strerror(errno));
+                return false;
+            }
+            synced_fd = fd;
+        }
+
+        if(io_uring_register_files_update(&ring, URING_DATA_SLOT, &fd, 1) != 1){
+            log_msg(LOG_ERR, "Error registering data file");
+            return false;
+        }
+        data_fd = fd;
+    }
+
+    if(data_fd != -1 && server_config.tick_interval_sec > 0){
+        tick_interval.tv_sec = server_config.tick_interval_sec;
+        submit_tick();
+    }
+    return true;
+}
+
+/**
+ * Takes the storage over once the predecessor drained, or stops the loop
+ * when that failed, and resumes the appends queued meanwhile.
+ */
+static void handle_storage(void){
+    storage_pending = false;
+    if(!data_store_attach() || !storage_attach()){
+        is_active = false;
+        return;
+    }
+    start_next_append();
+}
+
+static void accept_client(int res){
+    uring_connection_t *conn = NULL;
+
+    if(res < 0){
+        if(res != -EINTR && res != -ECANCELED){
+            log_msg(LOG_ERR, "accept error: %s", strerror(-res));
+        }
+        return;
+    }
+
+    if(!admission_admit(res)){
+        return;
+    }
+
+    for(size_t i = 0; i < URING_MAX_CONNECTIONS; i++){
+        if(!connections[i].in_use){
+            conn = &connections[i];
+            break;
+        }
+    }
+
+    if(conn == NULL){
+        log_msg(LOG_ERR, "No free connection slot, dropping client");
+        close(res);
+        admission_release();
+        return;
+    }
+
+    conn->client_fd = res;
+    conn->accepted_at = metrics_now();
+    conn->first_byte_pending = conn->accepted_at;
+    inet_ntop(accept_addr.ss_family, get_in_addr((struct sockaddr *)&accept_addr), conn->addr_str, sizeof(conn->addr_str));
+
+    log_msg(LOG_INFO, "Accepted connection from %s", conn->addr_str);
+
+    if(io_uring_register_files_update(&ring, URING_CLIENT_SLOT(conn->index), &conn->client_fd, 1) != 1){
+        log_msg(LOG_ERR, "Error registering client socket");
+        close(conn->client_fd);
+        conn->client_fd = -1;
+        admission_release();
+        return;
+    }
+
+    conn->in_use = true;
+    metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+    submit_recv(conn);
+}
+
+static void handle_accept(int res){
+    accept_client(res);
+    // only once the client is counted, so the next accept sees the current load
+    submit_accept_admitted();
+}
+
+/**
+ * Queues the next buffered packet for appending or asks for more data.
+ */
+static void next_packet(uring_connection_t *conn){
+    if(recv_buffer_next_packet(&conn->recv_buffer, &conn->packet, &conn->packet_len)){
+        log_msg(LOG_DEBUG, "Newline detected. Packet fully received");
+        conn->packet_fixed = false;
+        queue_append(conn);
+    } else {
+        submit_recv(conn);
+    }
+}
+
+static void handle_recv(uring_connection_t *conn, int res){
+    size_t available;
+    char *space;
+
+    if(res <= 0){
+        if(res == 0){
+            log_msg(LOG_INFO, "Connection closed by client");
+            // a packet only counts once its newline arrived, the rest is dropped
+            if(recv_buffer_pending(&conn->recv_buffer) > 0){
+                log_msg(LOG_INFO, "Discarding %zu bytes of an unterminated packet", recv_buffer_pending(&conn->recv_buffer));
+            }
+        } else if(res != -ECANCELED){
+            log_msg(LOG_ERR, "recv error: %s", strerror(-res));
+        }
+        connection_close(conn);
+        return;
+    }
+
+    log_msg(LOG_DEBUG, "Received %d bytes", res);
+    metrics_add(METRIC_BYTES_IN, res);
+    metrics_record_since(METRIC_FIRST_BYTE, conn->first_byte_pending);
+    conn->first_byte_pending = 0;
+
+    // common case: exactly one packet arrived, append it from the registered buffer
+    if(recv_buffer_pending(&conn->recv_buffer) == 0 && conn->buffer[res - 1] == '\n'
+        && newline_find(conn->buffer, res - 1) == NULL){
+        log_msg(LOG_DEBUG, "Newline detected. Packet fully received");
+        conn->packet = conn->buffer;
+        conn->packet_len = res;
+        conn->packet_fixed = true;
+        queue_append(conn);
+        return;
+    }
+
+    space = recv_buffer_reserve(&conn->recv_buffer, res, &available);
+    if(space == NULL){
+        if(conn->recv_buffer.oversized){
+            log_msg(LOG_ERR, "Packet exceeds the maximum length, closing connection");
+        } else {
+            log_msg(LOG_ERR, "Error allocating memory for packet");
+        }
+        connection_close(conn);
+        return;
+    }
+    memcpy(space, conn->buffer, res);
+    recv_buffer_commit(&conn->recv_buffer, res);
+
+    next_packet(conn);
+}
+
+/**
+ * Called once the readback of a packet went out completely.
+ */
+static void readback_done(uring_connection_t *conn){
+    log_msg(LOG_INFO, "Data sent to client");
+    metrics_record_since(METRIC_READBACK, conn->readback_start);
+
+    if(server_config.persistent){
+        next_packet(conn);
+    } else {
+        connection_close(conn);
+    }
+}
+
+static void handle_completion(struct io_uring_cqe *cqe){
+    uint64_t user_data = io_uring_cqe_get_data64(cqe);
+    uring_op_t op = URING_USER_OP(user_data);
+    uint32_t index = URING_USER_INDEX(user_data);
+    uring_connection_t *conn = NULL;
+    int res = cqe->res;
+
+    switch(op){
+    case URING_OP_ACCEPT:
+        handle_accept(res);
+        return;
+    case URING_OP_ACCEPT_RETRY:
+        submit_accept_admitted();
+        return;
+    case URING_OP_DRAIN:
+        handle_drain();
+        return;
+    case URING_OP_CANCEL:
+        return;
+    case URING_OP_STORAGE:
+        handle_storage();
+        return;
+    case URING_OP_TICK:
+        if(format_timestamp(tick_buffer, sizeof(tick_buffer)) > 0){
+            tick_pending = true;
+            start_next_append();
+        }
+        submit_tick();
+        return;
+    case URING_OP_TICK_WRITE:
+        append_busy = false;
+        publish_append(res > 0 ? (size_t) res : 0);
+        if(res > 0){
+            log_msg(LOG_INFO, "Wrote timestamp to data file");
+        } else {
+            log_msg(LOG_ERR, "write error: %s", strerror(-res));
+        }
+        start_next_append();
+        return;
+    default:
+        break;
+    }
+
+    conn = &connections[index];
+    conn->pending--;
+
+    if(op == URING_OP_WRITE){
+        append_busy = false;
+        metrics_add(METRIC_PACKETS, 1);
+        metrics_record_since(METRIC_APPEND, conn->append_start);
+        conn->readback_start = metrics_now();
+        if(data_fd != -1){
+            publish_append(res > 0 ? (size_t) res : 0);
+        }
+        if(res < 0){
+            log_msg(LOG_ERR, "write error: %s", strerror(-res));
+            // the slot may be released already and must not be handled again
+            connection_close(conn);
+            start_next_append();
+            return;
+        }
+        start_next_append();
+    }
+
+    if(conn->closing){
+        connection_close(conn);
+        return;
+    }
+
+    switch(op){
+    case URING_OP_RECV:
+        handle_recv(conn, res);
+        break;
+    case URING_OP_WRITE:
+        if(conn->cursor_request && !cursor_readback_start(conn)){
+            connection_close(conn);
+        }
+        break;
+    case URING_OP_HEADER:
+        if(res < 0){
+            log_msg(LOG_ERR, "send error: %s", strerror(-res));
+            connection_close(conn);
+            break;
+        }
+        conn->header_sent += res;
+        metrics_add(METRIC_BYTES_OUT, res);
+        if(conn->header_sent < conn->header_len){
+            submit_header(conn);
+        } else if(data_fd != -1 && conn->position >= conn->length){
+            readback_done(conn);
+        } else {
+            submit_read(conn, false);
+        }
+        break;
+    case URING_OP_IDLE:
+        if(res == -ETIME){
+            log_msg(LOG_INFO, "Idle timeout expired");
+        }
+        break;
+    case URING_OP_READ:
+        if(res < 0){
+            if(res != -ECANCELED){
+                log_msg(LOG_ERR, "read error: %s", strerror(-res));
+            }
+            connection_close(conn);
+        } else if(data_fd != -1){
+            // send is already linked behind this read
+            conn->position += res;
+        } else if(res == 0){
+            readback_done(conn);
+        } else {
+            conn->position += res;
+            conn->chunk_len = res;
+            conn->chunk_sent = 0;
+            prep_send(get_sqe(), conn);
+        }
+        break;
+    case URING_OP_SEND:
+        if(res < 0){
+            if(res != -ECANCELED){
+                log_msg(LOG_ERR, "send error: %s", strerror(-res));
+            }
+            connection_close(conn);
+            break;
+        }
+        log_msg(LOG_DEBUG, "Sent %d bytes", res);
+        metrics_add(METRIC_BYTES_OUT, res);
+        conn->chunk_sent += res;
+        if(conn->chunk_sent < conn->chunk_len){
+            prep_send(get_sqe(), conn);
+        } else if(data_fd != -1 && conn->position >= conn->length){
+            readback_done(conn);
+        } else {
+            submit_read(conn, false);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+int uring_loop_run(int listen_fd){
+    struct iovec iovecs[URING_MAX_CONNECTIONS];
+    int files[URING_MAX_CONNECTIONS + 1];
+    int return_val = 0;
+    int res;
+
+    listen_socket = listen_fd;
+    idle_timeout.tv_sec = server_config.idle_timeout_sec;
+
+    res = io_uring_queue_init(URING_ENTRIES, &ring, 0);
+    if(res < 0){
+        log_msg(LOG_ERR, "io_uring_queue_init error: %s", strerror(-res));
+        return -1;
+    }
+
+    buffers = (char *) aligned_alloc(4096, (size_t) URING_MAX_CONNECTIONS * URING_BUFFER_LEN);
+    if(buffers == NULL){
+        log_msg(LOG_ERR, "Error allocating memory for registered buffers");
+        return_val = -1;
+        goto uring_exit;
+    }
+
+    for(unsigned int i = 0; i < URING_MAX_CONNECTIONS; i++){
+        memset(&connections[i], 0, sizeof(connections[i]));
+        connections[i].index = i;
+        connections[i].client_fd = -1;
+        connections[i].data_fd = -1;
+        connections[i].buffer = buffers + (size_t) i * URING_BUFFER_LEN;
+        recv_buffer_init(&connections[i].recv_buffer);
+        iovecs[i].iov_base = connections[i].buffer;
+        iovecs[i].iov_len = URING_BUFFER_LEN;
+    }
+
+    res = io_uring_register_buffers(&ring, iovecs, URING_MAX_CONNECTIONS);
+    if(res < 0){
+        log_msg(LOG_ERR, "io_uring_register_buffers error: %s", strerror(-res));
+        return_val = -1;
+        goto uring_exit;
+    }
+
+    files[URING_DATA_SLOT] = -1;
+    for(size_t i = 0; i < URING_MAX_CONNECTIONS; i++){
+        files[URING_CLIENT_SLOT(i)] = -1;
+    }
+
+    res = io_uring_register_files(&ring, files, URING_MAX_CONNECTIONS + 1);
+    if(res < 0){
+        log_msg(LOG_ERR, "io_uring_register_files error: %s", strerror(-res));
+        return_val = -1;
+        goto uring_exit;
+    }
+
+    submit_accept();
+    if(handoff_drain_fd() != -1){
+        submit_drain();
+    }
+    if(data_store_pending_fd() != -1){
+        storage_pending = true;
+        submit_storage();
+    } else if(!storage_attach()){
+        return_val = -1;
+        goto uring_exit;
+    }
+
+    log_msg(LOG_INFO, "io_uring loop started");
+
+    while(is_active && !drained()){
+        struct io_uring_cqe *cqe;
+        unsigned int head;
+        unsigned int count = 0;
+
+        res = io_uring_submit_and_wait(&ring, 1);
+        if(res < 0){
+            if(res == -EINTR){
+                continue;
+            }
+            log_msg(LOG_ERR, "io_uring_submit_and_wait error: %s", strerror(-res));
+            return_val = -1;
+            break;
+        }
+
+        // completions of all connections are handled in one batch, new
+        // requests are submitted together on the next iteration
+        io_uring_for_each_cqe(&ring, head, cqe){
+            handle_completion(cqe);
+            count++;
+        }
+        io_uring_cq_advance(&ring, count);
+    }
+
+    log_msg(LOG_INFO, "io_uring loop stopped");
+
+    for(size_t i = 0; i < URING_MAX_CONNECTIONS; i++){
+        if(connections[i].in_use){
+            connection_release(&connections[i]);
+        }
+    }
+
+uring_exit:
+    draining = false;
+    storage_pending = false;
+    io_uring_queue_exit(&ring);
+    if(synced_fd != -1){
+        close(synced_fd);
+        synced_fd = -1;
+    }
+    data_fd = -1;
+    free(buffers);
+    buffers = NULL;
+    return return_val;
+}
+
+#else
+
+int uring_loop_run(int listen_fd){
+    (void) listen_fd;
+    log_msg(LOG_ERR, "aesdsocket was built without liburing, io_uring mode is not available");
+    return -1;
+}
+
+#endif
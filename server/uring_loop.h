@@ -0,0 +1,21 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include "aesdsocket.h"
+
+#define URING_ENTRIES               256
+#define URING_MAX_CONNECTIONS       128
+#define URING_BUFFER_LEN            (16 * 1024)
+
+/**
+ * Runs the io_uring reactor on the already listening socket until is_active
+ * is cleared, or once a successor took over the listener and the last
+ * connection closed. Receives, appends and readbacks are submitted as linked SQEs on
+ * fixed files and registered buffers, completions are reaped in batches.
+ * In file mode the timestamp ticker runs inside the ring as well, which
+ * makes the loop the only writer of the data file.
+ * @return 0 on clean shutdown, -1 on setup error or when built without liburing
+ */
+int uring_loop_run(int listen_fd);
+
+#endif // URING_LOOP_H
@@ -0,0 +1,296 @@
+#include "worker_pool.h"
+#include "async_log.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+static bool deque_init(work_deque_t *deque){
+    deque->items = (void **) malloc(WORK_DEQUE_INITIAL_CAPACITY * sizeof(*deque->items));
+    if(deque->items == NULL){
+        return false;
+    }
+    deque->capacity = WORK_DEQUE_INITIAL_CAPACITY;
+    deque->head = 0;
+    deque->count = 0;
+    deque->max_count = 0;
+    pthread_mutex_init(&deque->lock, NULL);
+    return true;
+}
+
+static void deque_destroy(work_deque_t *deque){
+    pthread_mutex_destroy(&deque->lock);
+    free(deque->items);
+    deque->items = NULL;
+}
+
+static bool deque_push_back(work_deque_t *deque, void *item){
+    pthread_mutex_lock(&deque->lock);
+
+    if(deque->count == deque->capacity){
+        size_t new_capacity = deque->capacity * 2;
+        void **new_items = (void **) malloc(new_capacity * sizeof(*new_items));
+        if(new_items == NULL){
+            pthread_mutex_unlock(&deque->lock);
+            return false;
+        }
+        for(size_t i = 0; i < deque->count; i++){
+            new_items[i] = deque->items[(deque->head + i) % deque->capacity];
+        }
+        free(deque->items);
+        deque->items = new_items;
+        deque->capacity = new_capacity;
+        deque->head = 0;
+    }
+
+    deque->items[(deque->head + deque->count) % deque->capacity] = item;
+    deque->count++;
+    if(deque->count > deque->max_count){
+        deque->max_count = deque->count;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+/**
+ * The owner takes the oldest connection so clients are served in accept order.
+ */
+static void *deque_pop_front(work_deque_t *deque){
+    void *item = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if(deque->count > 0){
+        item = deque->items[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return item;
+}
+
+/**
+ * Thieves take from the opposite end to stay out of the owner's way.
+ */
+static void *deque_steal_back(work_deque_t *deque){
+    void *item = NULL;
+
+    if(pthread_mutex_trylock(&deque->lock) != 0){
+        return NULL;
+    }
+    if(deque->count > 0){
+        deque->count--;
+        item = deque->items[(deque->head + deque->count) % deque->capacity];
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return item;
+}
+
+static void *worker_take(worker_t *worker){
+    worker_pool_t *pool = worker->pool;
+    void *item = deque_pop_front(&worker->deque);
+
+    for(size_t i = 1; item == NULL && i < pool->worker_count; i++){
+        worker_t *victim = &pool->workers[(worker->index + i) % pool->worker_count];
+        item = deque_steal_back(&victim->deque);
+        if(item != NULL){
+            __atomic_add_fetch(&worker->steals, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    if(item != NULL){
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+    }
+
+    return item;
+}
+
+static void *worker_thread(void *arg){
+    worker_t *worker = (worker_t *) arg;
+    worker_pool_t *pool = worker->pool;
+
+    log_msg(LOG_DEBUG, "Worker %zu started", worker->index);
+
+    while(true){
+        void *item = worker_take(worker);
+
+        if(item != NULL){
+            pool->release(pool->handler(item));
+            __atomic_add_fetch(&worker->executed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->idle_lock);
+        while(__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0 && !pool->stopping){
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+        bool done = pool->stopping && __atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0;
+        pthread_mutex_unlock(&pool->idle_lock);
+
+        if(done){
+            break;
+        }
+    }
+
+    log_msg(LOG_DEBUG, "Worker %zu stopped", worker->index);
+
+    return NULL;
+}
+
+worker_pool_t *worker_pool_create(size_t worker_count, worker_handler_t handler, worker_release_t release){
+    worker_pool_t *pool = NULL;
+    size_t started = 0;
+    int res;
+
+    if(worker_count == 0){
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = cpus > 0 ? (size_t) cpus : 1;
+    }
+
+    pool = (worker_pool_t *) calloc(1, sizeof(*pool));
+    if(pool == NULL){
+        log_msg(LOG_ERR, "Error allocating memory for worker pool");
+        return NULL;
+    }
+
+    pool->workers = (worker_t *) calloc(worker_count, sizeof(*pool->workers));
+    if(pool->workers == NULL){
+        log_msg(LOG_ERR, "Error allocating memory for workers");
+        free(pool);
+        return NULL;
+    }
+
+    pool->worker_count = worker_count;
+    pool->handler = handler;
+    pool->release = release != NULL ? release : free;
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    for(size_t i = 0; i < worker_count; i++){
+        pool->workers[i].index = i;
+        pool->workers[i].pool = pool;
+        if(!deque_init(&pool->workers[i].deque)){
+            log_msg(LOG_ERR, "Error allocating memory for worker deque");
+            goto create_error;
+        }
+    }
+
+    for(started = 0; started < worker_count; started++){
+        res = pthread_create(&pool->workers[started].thread, NULL, worker_thread, &pool->workers[started]);
+        if(res != 0){
+            log_msg(LOG_ERR, "pthread_create error: %d", res);
+            goto create_error;
+        }
+    }
+
+    log_msg(LOG_INFO, "Worker pool started with %zu workers", worker_count);
+
+    return pool;
+
+create_error:
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+    for(size_t i = 0; i < started; i++){
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for(size_t i = 0; i < worker_count; i++){
+        if(pool->workers[i].deque.items != NULL){
+            deque_destroy(&pool->workers[i].deque);
+        }
+    }
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_mutex_destroy(&pool->idle_lock);
+    free(pool->workers);
+    free(pool);
+    return NULL;
+}
+
+bool worker_pool_submit(worker_pool_t *pool, void *item){
+    worker_t *target = NULL;
+    size_t start = pool->next_worker;
+
+    // submissions only come from the accept loop, so next_worker needs no locking
+    pool->next_worker = (pool->next_worker + 1) % pool->worker_count;
+
+    for(size_t i = 0; i < pool->worker_count; i++){
+        worker_t *candidate = &pool->workers[(start + i) % pool->worker_count];
+        if(target == NULL || __atomic_load_n(&candidate->deque.count, __ATOMIC_RELAXED) < __atomic_load_n(&target->deque.count, __ATOMIC_RELAXED)){
+            target = candidate;
+        }
+    }
+
+    if(!deque_push_back(&target->deque, item)){
+        log_msg(LOG_ERR, "Error growing deque of worker %zu", target->index);
+        return false;
+    }
+
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+
+    return true;
+}
+
+void worker_pool_get_stats(worker_pool_t *pool, worker_pool_stats_t *stats){
+    memset(stats, 0, sizeof(*stats));
+    stats->worker_count = pool->worker_count;
+
+    for(size_t i = 0; i < pool->worker_count; i++){
+        worker_t *worker = &pool->workers[i];
+        pthread_mutex_lock(&worker->deque.lock);
+        stats->queue_depth += worker->deque.count;
+        if(worker->deque.max_count > stats->max_queue_depth){
+            stats->max_queue_depth = worker->deque.max_count;
+        }
+        pthread_mutex_unlock(&worker->deque.lock);
+        stats->executed += __atomic_load_n(&worker->executed, __ATOMIC_RELAXED);
+        stats->steals += __atomic_load_n(&worker->steals, __ATOMIC_RELAXED);
+    }
+}
+
+void worker_pool_log_stats(worker_pool_t *pool){
+    worker_pool_stats_t stats;
+
+    for(size_t i = 0; i < pool->worker_count; i++){
+        worker_t *worker = &pool->workers[i];
+        log_msg(LOG_INFO, "Worker %zu: depth %zu, max depth %zu, executed %lu, steals %lu",
+            i, worker->deque.count, worker->deque.max_count, worker->executed, worker->steals);
+    }
+
+    worker_pool_get_stats(pool, &stats);
+    log_msg(LOG_INFO, "Worker pool: %zu workers, depth %zu, max depth %zu, executed %lu, steals %lu",
+        stats.worker_count, stats.queue_depth, stats.max_queue_depth, stats.executed, stats.steals);
+}
+
+void worker_pool_destroy(worker_pool_t *pool){
+    if(pool == NULL){
+        return;
+    }
+
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+
+    for(size_t i = 0; i < pool->worker_count; i++){
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    worker_pool_log_stats(pool);
+
+    for(size_t i = 0; i < pool->worker_count; i++){
+        deque_destroy(&pool->workers[i].deque);
+    }
+
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_mutex_destroy(&pool->idle_lock);
+    free(pool->workers);
+    free(pool);
+}
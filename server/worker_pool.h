@@ -0,0 +1,76 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define WORK_DEQUE_INITIAL_CAPACITY 64
+
+/**
+ * Handler executed by a worker for every submitted item. The pointer it
+ * returns is passed to the pool's release function as soon as the handler
+ * finishes.
+ */
+typedef void *(*worker_handler_t)(void *item);
+typedef void (*worker_release_t)(void *result);
+
+typedef struct work_deque{
+    pthread_mutex_t lock;
+    void **items;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    size_t max_count;
+} work_deque_t;
+
+typedef struct worker{
+    pthread_t thread;
+    size_t index;
+    struct worker_pool *pool;
+    work_deque_t deque;
+    unsigned long executed;
+    unsigned long steals;
+} worker_t;
+
+typedef struct worker_pool{
+    worker_t *workers;
+    size_t worker_count;
+    size_t next_worker;
+    worker_handler_t handler;
+    worker_release_t release;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    size_t pending;
+    bool stopping;
+} worker_pool_t;
+
+typedef struct worker_pool_stats{
+    size_t worker_count;
+    size_t queue_depth;
+    size_t max_queue_depth;
+    unsigned long executed;
+    unsigned long steals;
+} worker_pool_stats_t;
+
+/**
+ * Starts worker_count long-lived workers, each owning a work-stealing deque.
+ * Passing 0 starts one worker per online CPU. A NULL release uses free().
+ * @return the pool or NULL on error
+ */
+worker_pool_t *worker_pool_create(size_t worker_count, worker_handler_t handler, worker_release_t release);
+
+/**
+ * Queues item on the least loaded worker, idle workers steal from the others.
+ */
+bool worker_pool_submit(worker_pool_t *pool, void *item);
+
+void worker_pool_get_stats(worker_pool_t *pool, worker_pool_stats_t *stats);
+void worker_pool_log_stats(worker_pool_t *pool);
+
+/**
+ * Lets the workers finish everything already queued, joins them and frees the pool.
+ */
+void worker_pool_destroy(worker_pool_t *pool);
+
+#endif // WORKER_POOL_H
@@ -0,0 +1,169 @@
+#include "unity.h"
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include "../../server/completion_queue.h"
+
+#define PRODUCER_COUNT      4
+#define PRODUCER_PUSHES     20000
+
+typedef struct test_item{
+    size_t producer;
+    size_t sequence;
+    completion_node_t node;
+} test_item_t;
+
+typedef struct test_producer{
+    pthread_t thread;
+    completion_queue_t *queue;
+    test_item_t *items;
+} test_producer_t;
+
+static bool queue_readable(completion_queue_t *queue)
+{
+    struct pollfd pfd = { .fd = completion_queue_fd(queue), .events = POLLIN };
+    return poll(&pfd, 1, 0) == 1;
+}
+
+static test_item_t *pop_item(completion_queue_t *queue)
+{
+    completion_node_t *node = completion_queue_pop(queue);
+    return node != NULL ? completion_entry(node, test_item_t, node) : NULL;
+}
+
+static void *producer_thread(void *arg)
+{
+    test_producer_t *producer = (test_producer_t *) arg;
+
+    for(size_t i = 0; i < PRODUCER_PUSHES; i++){
+        completion_queue_push(producer->queue, &producer->items[i].node);
+    }
+    return NULL;
+}
+
+/**
+* A new queue pops nothing and does not wake the consumer.
+*/
+void test_completion_queue_empty()
+{
+    completion_queue_t queue;
+
+    TEST_ASSERT_TRUE(completion_queue_init(&queue));
+    TEST_ASSERT_NULL(completion_queue_pop(&queue));
+    TEST_ASSERT_FALSE(queue_readable(&queue));
+    completion_queue_destroy(&queue);
+}
+
+/**
+* Nodes of a single producer come out in push order, also when the queue
+* runs empty in between.
+*/
+void test_completion_queue_order()
+{
+    completion_queue_t queue;
+    test_item_t items[3] = { { .sequence = 0 }, { .sequence = 1 }, { .sequence = 2 } };
+
+    TEST_ASSERT_TRUE(completion_queue_init(&queue));
+
+    completion_queue_push(&queue, &items[0].node);
+    TEST_ASSERT_EQUAL_PTR(&items[0], pop_item(&queue));
+    TEST_ASSERT_NULL(pop_item(&queue));
+
+    completion_queue_push(&queue, &items[1].node);
+    completion_queue_push(&queue, &items[2].node);
+    TEST_ASSERT_EQUAL_PTR(&items[1], pop_item(&queue));
+    TEST_ASSERT_EQUAL_PTR(&items[2], pop_item(&queue));
+    TEST_ASSERT_NULL(pop_item(&queue));
+
+    // a node popped before can be pushed again
+    completion_queue_push(&queue, &items[0].node);
+    TEST_ASSERT_EQUAL_PTR(&items[0], pop_item(&queue));
+    TEST_ASSERT_NULL(pop_item(&queue));
+
+    completion_queue_destroy(&queue);
+}
+
+/**
+* Only the first push after a clear writes the eventfd, a push after the
+* clear makes it readable again.
+*/
+void test_completion_queue_signal()
+{
+    completion_queue_t queue;
+    test_item_t items[3];
+    eventfd_t value = 0;
+
+    TEST_ASSERT_TRUE(completion_queue_init(&queue));
+
+    completion_queue_push(&queue, &items[0].node);
+    completion_queue_push(&queue, &items[1].node);
+    TEST_ASSERT_TRUE(queue_readable(&queue));
+    TEST_ASSERT_EQUAL_INT(0, eventfd_read(completion_queue_fd(&queue), &value));
+    TEST_ASSERT_EQUAL_UINT64(1, value);
+
+    completion_queue_clear(&queue);
+    TEST_ASSERT_FALSE(queue_readable(&queue));
+    TEST_ASSERT_EQUAL_PTR(&items[0], pop_item(&queue));
+    TEST_ASSERT_EQUAL_PTR(&items[1], pop_item(&queue));
+
+    completion_queue_push(&queue, &items[2].node);
+    TEST_ASSERT_TRUE(queue_readable(&queue));
+    completion_queue_clear(&queue);
+    TEST_ASSERT_EQUAL_PTR(&items[2], pop_item(&queue));
+    TEST_ASSERT_NULL(pop_item(&queue));
+
+    completion_queue_destroy(&queue);
+}
+
+/**
+* Concurrent producers: the consumer waits on the eventfd only and still
+* receives every node exactly once, in push order per producer.
+*/
+void test_completion_queue_producers()
+{
+    completion_queue_t queue;
+    test_producer_t producers[PRODUCER_COUNT];
+    size_t expected[PRODUCER_COUNT] = {0};
+    size_t popped = 0;
+
+    TEST_ASSERT_TRUE(completion_queue_init(&queue));
+
+    for(size_t i = 0; i < PRODUCER_COUNT; i++){
+        producers[i].queue = &queue;
+        producers[i].items = calloc(PRODUCER_PUSHES, sizeof(test_item_t));
+        TEST_ASSERT_NOT_NULL(producers[i].items);
+        for(size_t j = 0; j < PRODUCER_PUSHES; j++){
+            producers[i].items[j].producer = i;
+            producers[i].items[j].sequence = j;
+        }
+    }
+    for(size_t i = 0; i < PRODUCER_COUNT; i++){
+        TEST_ASSERT_EQUAL_INT(0, pthread_create(&producers[i].thread, NULL, producer_thread, &producers[i]));
+    }
+
+    while(popped < PRODUCER_COUNT * PRODUCER_PUSHES){
+        struct pollfd pfd = { .fd = completion_queue_fd(&queue), .events = POLLIN };
+        test_item_t *item;
+
+        // a lost wakeup shows up as a timeout
+        TEST_ASSERT_EQUAL_INT_MESSAGE(1, poll(&pfd, 1, 5000), "No wakeup for pending pushes");
+        completion_queue_clear(&queue);
+        while((item = pop_item(&queue)) != NULL){
+            TEST_ASSERT_EQUAL_size_t(expected[item->producer], item->sequence);
+            expected[item->producer]++;
+            popped++;
+        }
+    }
+
+    for(size_t i = 0; i < PRODUCER_COUNT; i++){
+        pthread_join(producers[i].thread, NULL);
+        TEST_ASSERT_EQUAL_size_t(PRODUCER_PUSHES, expected[i]);
+        free(producers[i].items);
+    }
+    TEST_ASSERT_NULL(completion_queue_pop(&queue));
+
+    completion_queue_destroy(&queue);
+}